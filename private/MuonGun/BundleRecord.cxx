@@ -0,0 +1,98 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/BundleRecord.h>
+#include <MuonGun/NormalizationCache.h>
+#include <icetray/serialization.h>
+
+#include <cmath>
+
+namespace I3MuonGun {
+
+BundleRecord::BundleRecord() : logGenerationProbability(NAN), generatorHash(0)
+{}
+
+BundleRecord::BundleRecord(const I3Particle &axis, const BundleSpec &bundle)
+    : pos(axis.GetPos()), dir(axis.GetDir()), logGenerationProbability(NAN), generatorHash(0)
+{
+	for (size_t i=0; i < bundle.size(); i++) {
+		if (bundle.IsOmitted(i)) {
+			omittedRadius.push_back(bundle.GetRadius(i));
+			omittedEnergy.push_back(bundle.GetEnergy(i));
+		} else {
+			radius.push_back(bundle.GetRadius(i));
+			energy.push_back(bundle.GetEnergy(i));
+		}
+	}
+}
+
+BundleRecord::~BundleRecord() {}
+
+I3Particle
+BundleRecord::GetAxis() const
+{
+	I3Particle axis;
+	axis.SetPos(pos);
+	axis.SetDir(dir);
+
+	return axis;
+}
+
+BundleSpec
+BundleRecord::GetBundle() const
+{
+	BundleSpec bundle;
+	bundle.reserve(radius.size() + omittedRadius.size());
+	for (size_t i=0; i < radius.size(); i++)
+		bundle.push_back(BundleEntry(radius[i], energy[i]));
+	for (size_t i=0; i < omittedRadius.size(); i++)
+		bundle.push_back(BundleEntry(omittedRadius[i], omittedEnergy[i], true));
+
+	return bundle;
+}
+
+uint64_t
+BundleRecord::GetGeneratorHash(const GenerationProbability &generator)
+{
+	// The serialized form would also include lazily computed
+	// normalizations, which depend on what the generator has been used for
+	return CacheKey("GeneratorHash").Add(generator.Hash()).GetValue();
+}
+
+bool
+BundleRecord::operator==(const BundleRecord &other) const
+{
+	return pos == other.pos && dir == other.dir
+	    && radius == other.radius && energy == other.energy
+	    && omittedRadius == other.omittedRadius && omittedEnergy == other.omittedEnergy
+	    && generatorHash == other.generatorHash
+	    && (logGenerationProbability == other.logGenerationProbability
+	    || (std::isnan(logGenerationProbability) && std::isnan(other.logGenerationProbability)));
+}
+
+template <typename Archive>
+void
+BundleRecord::serialize(Archive &ar, unsigned version)
+{
+	if (version > 0)
+		log_fatal_stream("Version "<<version<<" is from the future");
+
+	ar & make_nvp("I3FrameObject", base_object<I3FrameObject>(*this));
+	ar & make_nvp("Pos", pos);
+	ar & make_nvp("Dir", dir);
+	ar & make_nvp("Radius", radius);
+	ar & make_nvp("Energy", energy);
+	ar & make_nvp("OmittedRadius", omittedRadius);
+	ar & make_nvp("OmittedEnergy", omittedEnergy);
+	ar & make_nvp("LogGenerationProbability", logGenerationProbability);
+	ar & make_nvp("GeneratorHash", generatorHash);
+}
+
+}
+
+I3_SERIALIZABLE(I3MuonGun::BundleRecord);
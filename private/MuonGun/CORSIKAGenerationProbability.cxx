@@ -13,6 +13,7 @@
 #include <MuonGun/Flux.h>
 #include <MuonGun/RadialDistribution.h>
 #include <MuonGun/EnergyDistribution.h>
+#include <MuonGun/NormalizationCache.h>
 
 #include <boost/foreach.hpp>
 
@@ -49,21 +50,32 @@ CORSIKAGenerationProbability::IsCompatible(GenerationProbabilityConstPtr o) cons
 	    && *energyDistribution_ == *(other->energyDistribution_));
 }
 
+uint64_t
+CORSIKAGenerationProbability::Hash() const
+{
+	return CacheKey("CORSIKAGenerationProbability").Add(surface_->Hash()).Add(flux_->Hash())
+	    .Add(radialDistribution_->Hash()).Add(energyDistribution_->Hash()).GetValue();
+}
+
 double
-CORSIKAGenerationProbability::GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundlespec) const
+CORSIKAGenerationProbability::GetLogGenerationProbability(const BundleKinematics &kinematics) const
 {	
-	std::pair<double, double> steps = surface_->GetIntersection(axis.GetPos(), axis.GetDir());
+	const BundleSpec &bundlespec = kinematics.GetBundle();
 	// This shower axis doesn't intersect the sampling surface. Bail.
-	if (!std::isfinite(steps.first))
+	if (!std::isfinite(kinematics.GetEntry(surface_)))
 		return 0.;
 	
-	double h = GetDepth(axis.GetPos().GetZ() + steps.first*axis.GetDir().GetZ());
-	double coszen = cos(axis.GetDir().GetZenith());
-	unsigned m = static_cast<unsigned>(bundlespec.size());
+	double h = kinematics.GetDepth(surface_);
+	double coszen = kinematics.GetCosZenith();
+	unsigned m = kinematics.GetMultiplicity();
 	double logprob = flux_->GetLog(h, coszen, m);
-	BOOST_FOREACH(const BundleConfiguration::value_type &track, bundlespec)
-		logprob += energyDistribution_->GetLog(h, coszen, m, track.radius,
-		    EnergyDistribution::log_value(std::log(track.energy)));
+	for (unsigned i=0; i < m; i++) {
+		EnergyDistribution::log_value loge(kinematics.GetLogEnergy(i));
+		if (bundlespec.IsOmitted(i))
+			logprob += energyDistribution_->GetLogCumulative(h, coszen, m, bundlespec.GetRadius(i), loge);
+		else
+			logprob += energyDistribution_->GetLog(h, coszen, m, bundlespec.GetRadius(i), loge);
+	}
 	
 	return logprob;
 }
@@ -35,9 +35,11 @@ public:
 	virtual SamplingSurfaceConstPtr GetInjectionSurface() const { return surface_; }
 	GenerationProbabilityPtr Clone() const;
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const;
+	virtual uint64_t Hash() const;
 	
 protected:
-	double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	double GetLogGenerationProbability(const BundleKinematics &kinematics) const;
+	using GenerationProbability::GetLogGenerationProbability;
 private:
 	SamplingSurfacePtr surface_;
 	FluxPtr flux_;
@@ -0,0 +1,197 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/CounterRandomService.h>
+#include <dataclasses/I3Vector.h>
+
+#include <boost/make_shared.hpp>
+#include <boost/random/binomial_distribution.hpp>
+#include <boost/random/exponential_distribution.hpp>
+#include <boost/random/normal_distribution.hpp>
+#include <boost/random/poisson_distribution.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+
+#include <algorithm>
+
+namespace I3MuonGun {
+
+namespace {
+
+// Adapts CounterRandomService to the UniformRandomNumberGenerator concept
+// so that it can drive boost::random distributions
+struct engine {
+	typedef uint32_t result_type;
+	engine(CounterRandomService &rng) : rng_(rng) {}
+	static result_type min() { return 0; }
+	static result_type max() { return 0xffffffff; }
+	result_type operator()() { return rng_.Next(); }
+	CounterRandomService &rng_;
+};
+
+inline void
+mulhilo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo)
+{
+	uint64_t product = uint64_t(a)*uint64_t(b);
+	hi = uint32_t(product >> 32);
+	lo = uint32_t(product);
+}
+
+}
+
+void
+CounterRandomService::Philox(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4])
+{
+	const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+	const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+	
+	uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+	uint32_t k[2] = {key[0], key[1]};
+	for (unsigned round=0; round < 10; round++) {
+		if (round > 0) {
+			k[0] += W0;
+			k[1] += W1;
+		}
+		uint32_t hi0, lo0, hi1, lo1;
+		mulhilo(M0, c[0], hi0, lo0);
+		mulhilo(M1, c[2], hi1, lo1);
+		uint32_t next[4] = {hi1 ^ c[1] ^ k[0], lo1, hi0 ^ c[3] ^ k[1], lo0};
+		std::copy(next, next+4, c);
+	}
+	std::copy(c, c+4, result);
+}
+
+CounterRandomService::CounterRandomService(uint32_t run, uint64_t event, uint32_t stream)
+    : run_(run), stream_(stream)
+{
+	SetEvent(event);
+}
+
+CounterRandomService::~CounterRandomService() {}
+
+void
+CounterRandomService::SetEvent(uint64_t event)
+{
+	event_ = event;
+	block_ = 0;
+	position_ = 4;
+}
+
+void
+CounterRandomService::Refill()
+{
+	const uint32_t counter[4] = {uint32_t(block_), uint32_t(block_ >> 32),
+	    uint32_t(event_), uint32_t(event_ >> 32)};
+	const uint32_t key[2] = {run_, stream_};
+	Philox(counter, key, buffer_);
+	block_++;
+	position_ = 0;
+}
+
+uint32_t
+CounterRandomService::Next()
+{
+	if (position_ > 3)
+		Refill();
+	return buffer_[position_++];
+}
+
+double
+CounterRandomService::Uniform(double x1)
+{
+	// 53 random bits, offset by half a step so that the result lies in the
+	// open interval (0,1)
+	const uint64_t a = Next() >> 5, b = Next() >> 6;
+	return x1*((double((a << 26) | b) + 0.5)/9007199254740992.);
+}
+
+double
+CounterRandomService::Uniform(double x1, double x2)
+{
+	return x1 + Uniform(x2-x1);
+}
+
+double
+CounterRandomService::Gaus(double mean, double stddev)
+{
+	engine e(*this);
+	return boost::random::normal_distribution<double>(mean, stddev)(e);
+}
+
+double
+CounterRandomService::Exp(double tau)
+{
+	engine e(*this);
+	return boost::random::exponential_distribution<double>(1./tau)(e);
+}
+
+int
+CounterRandomService::Binomial(int ntot, double prob)
+{
+	engine e(*this);
+	return boost::random::binomial_distribution<int, double>(ntot, prob)(e);
+}
+
+unsigned int
+CounterRandomService::Integer(unsigned int imax)
+{
+	// The injectors draw a multiplicity with Integer(max-min), which is
+	// Integer(0) when only one multiplicity is allowed
+	if (imax == 0)
+		return 0;
+	engine e(*this);
+	return boost::random::uniform_int_distribution<unsigned int>(0, imax-1)(e);
+}
+
+int
+CounterRandomService::Poisson(double mean)
+{
+	engine e(*this);
+	return boost::random::poisson_distribution<int, double>(mean)(e);
+}
+
+double
+CounterRandomService::PoissonD(double mean)
+{
+	engine e(*this);
+	return double(boost::random::poisson_distribution<uint64_t, double>(mean)(e));
+}
+
+I3FrameObjectPtr
+CounterRandomService::GetState() const
+{
+	I3VectorUInt64Ptr state = boost::make_shared<I3VectorUInt64>();
+	state->push_back(run_);
+	state->push_back(stream_);
+	state->push_back(event_);
+	state->push_back(block_);
+	state->push_back(position_);
+	return state;
+}
+
+void
+CounterRandomService::RestoreState(I3FrameObjectConstPtr state)
+{
+	I3VectorUInt64ConstPtr s = boost::dynamic_pointer_cast<const I3VectorUInt64>(state);
+	if (!s || s->size() != 5)
+		log_fatal("Not a CounterRandomService state");
+	run_ = uint32_t((*s)[0]);
+	stream_ = uint32_t((*s)[1]);
+	event_ = (*s)[2];
+	position_ = unsigned((*s)[4]);
+	if (position_ < 4 && (*s)[3] > 0) {
+		// Regenerate the partially consumed block
+		block_ = (*s)[3]-1;
+		Refill();
+		position_ = unsigned((*s)[4]);
+	} else {
+		block_ = (*s)[3];
+		position_ = 4;
+	}
+}
+
+}
@@ -0,0 +1,72 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_COUNTERRANDOMSERVICE_H_INCLUDED
+#define I3MUONGUN_COUNTERRANDOMSERVICE_H_INCLUDED
+
+#include <phys-services/I3RandomService.h>
+#include <stdint.h>
+
+namespace I3MuonGun {
+
+/**
+ * @brief A counter-based random number generator
+ *
+ * Random numbers are the output of the Philox4x32-10 bijection (Salmon et
+ * al., "Parallel random numbers: as easy as 1, 2, 3", SC11) applied to an
+ * incrementing counter. The stream is fully determined by a (run, event,
+ * stream) triple, so any event can be regenerated without replaying the
+ * ones before it, and events can be generated in any order or on any number
+ * of threads with identical results.
+ */
+class CounterRandomService : public I3RandomService {
+public:
+	/**
+	 * @param[in] run    run number, used as the seed
+	 * @param[in] event  index of the event within the run
+	 * @param[in] stream sub-stream for independent consumers within
+	 *                   one event
+	 */
+	CounterRandomService(uint32_t run, uint64_t event, uint32_t stream=0);
+	virtual ~CounterRandomService();
+	
+	virtual int Binomial(int ntot, double prob);
+	virtual double Exp(double tau);
+	virtual unsigned int Integer(unsigned int imax);
+	virtual int Poisson(double mean);
+	virtual double PoissonD(double mean);
+	virtual double Uniform(double x1 = 1);
+	virtual double Uniform(double x1, double x2);
+	virtual double Gaus(double mean, double stddev);
+	
+	/** @returns an I3VectorUInt64 holding the key and counter */
+	virtual I3FrameObjectPtr GetState() const;
+	virtual void RestoreState(I3FrameObjectConstPtr state);
+	
+	/** @brief Advance to the beginning of the given event */
+	void SetEvent(uint64_t event);
+	
+	/** @brief Draw the next 32 random bits */
+	uint32_t Next();
+	
+	/** @brief The raw Philox4x32-10 bijection */
+	static void Philox(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]);
+private:
+	void Refill();
+	
+	uint32_t run_, stream_;
+	uint64_t event_, block_;
+	uint32_t buffer_[4];
+	unsigned position_;
+};
+
+I3_POINTER_TYPEDEFS(CounterRandomService);
+
+}
+
+#endif // I3MUONGUN_COUNTERRANDOMSERVICE_H_INCLUDED
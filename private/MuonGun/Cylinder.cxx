@@ -7,6 +7,7 @@
  */
 
 #include <MuonGun/Cylinder.h>
+#include <MuonGun/NormalizationCache.h>
 
 namespace I3MuonGun {
 
@@ -40,6 +41,14 @@ Cylinder::operator==(const SamplingSurface &s) const
 		    GetCenter() == other->GetCenter());
 }
 
+uint64_t
+Cylinder::Hash() const
+{
+	const I3Position &center = GetCenter();
+	return CacheKey("Cylinder").Add(GetRadius()).Add(GetLength())
+	    .Add(center.GetX()).Add(center.GetY()).Add(center.GetZ()).GetValue();
+}
+
 template <typename Archive>
 void
 Cylinder::serialize(Archive &ar, unsigned version)
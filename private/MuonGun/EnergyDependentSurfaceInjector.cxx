@@ -10,6 +10,7 @@
 #include <MuonGun/I3MuonGun.h>
 #include <MuonGun/SamplingSurface.h>
 #include <MuonGun/Cylinder.h>
+#include <MuonGun/NormalizationCache.h>
 #include <MuonGun/Flux.h>
 #include <MuonGun/EnergyDistribution.h>
 #include <MuonGun/RadialDistribution.h>
@@ -48,33 +49,38 @@ EnergyDependentSurfaceInjector::IsCompatible(GenerationProbabilityConstPtr o) co
 		return *scalingFunction_ == *(other->scalingFunction_);
 }
 
-void
-EnergyDependentSurfaceInjector::Generate(I3RandomService &rng, I3MCTree &tree,
-    BundleConfiguration &bundle) const
+uint64_t
+EnergyDependentSurfaceInjector::Hash() const
+{
+	return CacheKey("EnergyDependentSurfaceInjector").Add(StaticSurfaceInjector::Hash())
+	    .Add(scalingFunction_->Hash()).GetValue();
+}
+
+SamplingSurfaceConstPtr
+EnergyDependentSurfaceInjector::SampleAxis(I3RandomService &rng, I3Position &pos,
+    I3Direction &dir, double &depth, BundleSpec &bundle) const
 {
-	I3Direction dir;
-	I3Position pos;
 	unsigned m;
 	double flux;
-	double maxflux = (*flux_)(surface_->GetMinDepth(), 1., flux_->GetMinMultiplicity());
-	double h, coszen;
+	double maxflux = (*flux_)(surface_->GetMinDepth(), zenithRange_.second, flux_->GetMinMultiplicity());
 	SamplingSurfaceConstPtr surface;
-	do {
+	while (true) {
 		// Choose a multiplicity
 		bundle.clear();
 		m = rng.Integer(flux_->GetMaxMultiplicity() - flux_->GetMinMultiplicity())
 		    + flux_->GetMinMultiplicity();
 		// Choose an ensemble of energies
 		for (unsigned i=0; i < m; i++)
-			bundle.push_back(BundleEntry(0., energyGenerator_->Generate(rng)));
+			bundle.push_back(BundleEntry(0., GenerateEnergy(rng)));
 		bundle.sort();
 		
 		// Choose target surface based on highest-energy muon
-		surface = GetTargetSurface(bundle.front().energy);
+		surface = GetTargetSurface(bundle.GetMaxEnergy());
 		// Sample an impact point on the target surface
-		surface->SampleImpactRay(pos, dir, rng);
-		h = GetDepth(pos.GetZ());
-		coszen = cos(dir.GetZenith());
+		surface->SampleImpactRay(pos, dir, rng, zenithRange_.first, zenithRange_.second);
+		if (!InRange(dir))
+			continue;
+		depth = GetDepth(pos.GetZ());
 		
 		// Snap the impact point back to the injection surface
 		std::pair<double, double> steps = surface_->GetIntersection(pos, dir);
@@ -86,7 +92,23 @@ EnergyDependentSurfaceInjector::Generate(I3RandomService &rng, I3MCTree &tree,
 		
 		// Accept or reject the chosen zenith angle and multiplicity
 		flux = (*flux_)(surface_->GetMinDepth(), cos(dir.GetZenith()), m);
-	} while (rng.Uniform(0., maxflux) > flux);
+		if (rng.Uniform(0., maxflux) <= flux)
+			break;
+	}
+	
+	return surface;
+}
+
+void
+EnergyDependentSurfaceInjector::Generate(I3RandomService &rng, I3MCTree &tree,
+    BundleSpec &bundle) const
+{
+	I3Direction dir;
+	I3Position pos;
+	double h;
+	SamplingSurfaceConstPtr surface = SampleAxis(rng, pos, dir, h, bundle);
+	unsigned m = static_cast<unsigned>(bundle.size());
+	double coszen = cos(dir.GetZenith());
 
 	I3Particle primary;
 	primary.SetPos(pos);
@@ -97,22 +119,58 @@ EnergyDependentSurfaceInjector::Generate(I3RandomService &rng, I3MCTree &tree,
 	primary.SetTime(0.);
 	I3MCTreeUtils::AddPrimary(tree, primary);
 	
+	// The target surface depends on the energy of the leading muon, so it
+	// is always kept. Every other muon is known to be below both the
+	// threshold and the leading energy, so record the tighter bound.
+	const double bound = std::min(threshold_, bundle.GetMaxEnergy());
+	
 	// For each muon, draw a radial offset and add an entry
 	// to the MCTree
-	BOOST_FOREACH(BundleConfiguration::value_type &bspec, bundle) {
+	for (unsigned i=0; i < m; i++) {
 		double radius = 0., azimuth = 0.;
 		if (m > 1u) {
 			radius = radialDistribution_->Generate(rng, h, coszen, m);
 			azimuth = rng.Uniform(0., 2*M_PI);
 		}
+		bundle.SetRadius(i, radius);
+		// Entries are sorted, so the first is the leading muon
+		if (i > 0 && bundle.GetEnergy(i) < threshold_) {
+			bundle.Omit(i, bound);
+			continue;
+		}
 		
 		I3Particle track = CreateParallelTrack(radius, azimuth, *surface, primary);
-		track.SetEnergy(bspec.energy);
-		bspec.radius = radius;
+		track.SetEnergy(bundle.GetEnergy(i));
 		I3MCTreeUtils::AppendChild(tree, primary, track);
 	}
 }
 
+void
+EnergyDependentSurfaceInjector::GenerateBatch(I3RandomService &rng, size_t n,
+    BundleBatch &batch) const
+{
+	I3Direction dir;
+	I3Position pos;
+	double h;
+	BundleSpec bundle;
+	for (size_t i=0; i < n; i++) {
+		SampleAxis(rng, pos, dir, h, bundle);
+		batch.AddBundle(pos, dir);
+		unsigned m = bundle.GetMultiplicity();
+		double coszen = cos(dir.GetZenith());
+		for (unsigned j=0; j < m; j++) {
+			double radius = 0.;
+			if (m > 1u) {
+				radius = radialDistribution_->Generate(rng, h, coszen, m);
+				// Draw (and discard) the azimuth about the axis so that the
+				// random sequence stays in step with Generate()
+				rng.Uniform(0., 2*M_PI);
+			}
+			batch.AddMuon(radius, bundle.GetEnergy(j));
+		}
+	}
+}
+
 SamplingSurfacePtr
 EnergyDependentSurfaceInjector::GetTargetSurface(double energy) const
 {
@@ -125,41 +183,46 @@ EnergyDependentSurfaceInjector::GetTargetSurface(double energy) const
 double
 EnergyDependentSurfaceInjector::GetTotalRate(SamplingSurfaceConstPtr surface) const
 {
-	double total_rate = 0.;
-	for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++)
-		total_rate += surface->IntegrateFlux(boost::bind(boost::cref(*flux_), _1, _2, m));
-	return total_rate;
+	CacheKey key("TotalRate");
+	key.Add(surface).Add(flux_).Add(zenithRange_.first).Add(zenithRange_.second);
+	return NormalizationCache::GetInstance().Get(key, [&]()
+	{
+		double rate = 0.;
+		for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++)
+			rate += surface->IntegrateFlux(boost::bind(boost::cref(*flux_), _1, _2, m),
+			    zenithRange_.first, zenithRange_.second);
+		return rate;
+	})*(azimuthRange_.second-azimuthRange_.first)/(2*M_PI);
 }
 
 double
-EnergyDependentSurfaceInjector::GetLogGenerationProbability(const I3Particle &axis,
-    const BundleConfiguration &bundlespec) const
+EnergyDependentSurfaceInjector::GetLogGenerationProbability(const BundleKinematics &kinematics) const
 {
-	// Entries are sorted in descending order of energy, so the
-	// "minimum" entry has the maximum energy
-	SamplingSurfaceConstPtr surface =
-	    GetTargetSurface(std::min_element(bundlespec.begin(), bundlespec.end())->energy);
-	std::pair<double, double> steps =
-	    surface->GetIntersection(axis.GetPos(), axis.GetDir());
-	// This shower axis doesn't intersect the target surface. Bail.
-	if (!std::isfinite(steps.first))
+	const BundleSpec &bundlespec = kinematics.GetBundle();
+	SamplingSurfaceConstPtr surface = GetTargetSurface(bundlespec.GetMaxEnergy());
+	// This shower axis doesn't intersect the target surface, or points in
+	// a direction we never generate. Bail.
+	if (!std::isfinite(kinematics.GetEntry(surface)) || !InRange(kinematics.GetAxis().GetDir()))
 		return -std::numeric_limits<double>::infinity();
 	
-	double h = GetDepth(axis.GetPos().GetZ() + steps.first*axis.GetDir().GetZ());
-	double coszen = cos(axis.GetDir().GetZenith());
-	unsigned m = static_cast<unsigned>(bundlespec.size());
+	double h = kinematics.GetDepth(surface);
+	double coszen = kinematics.GetCosZenith();
+	unsigned m = kinematics.GetMultiplicity();
 
 	// We used the flux to do rejection sampling in zenith and multiplicity. Evaluate
 	// the properly-normalized PDF here.
 	double logprob = flux_->GetLog(surface_->GetMinDepth(), coszen, m) - GetZenithNorm();
-	BOOST_FOREACH(const BundleEntry &track, bundlespec) {
+	for (unsigned i=0; i < m; i++) {
 		if (m > 1)
-			logprob += radialDistribution_->GetLog(h, coszen, m, track.radius);
-		logprob += energyGenerator_->GetLog(track.energy);
+			logprob += radialDistribution_->GetLog(h, coszen, m, bundlespec.GetRadius(i));
+		if (bundlespec.IsOmitted(i))
+			logprob += GetLogEnergyCumulative(bundlespec.GetEnergy(i));
+		else
+			logprob += GetLogEnergyProbability(bundlespec.GetEnergy(i));
 	}
 	
 	// We only distributed events over the target surface, not the entire injection surface
-	return logprob - std::log(surface->GetAcceptance());
+	return logprob - GetLogAcceptance(*surface);
 }
 
 template <typename Archive>
@@ -172,6 +235,12 @@ EnergyDependentSurfaceInjector::serialize(Archive &ar, unsigned)
 
 SurfaceScalingFunction::~SurfaceScalingFunction() {}
 
+uint64_t
+SurfaceScalingFunction::Hash() const
+{
+	return CacheKey("SurfaceScalingFunction").GetValue();
+}
+
 template <typename Archive>
 void
 SurfaceScalingFunction::serialize(Archive &ar __attribute__((unused)), unsigned version __attribute__((unused)))
@@ -205,6 +274,12 @@ ConstantSurfaceScalingFunction::operator==(const SurfaceScalingFunction &o) cons
 		return (*surface_ == *(other->surface_));
 }
 
+uint64_t
+ConstantSurfaceScalingFunction::Hash() const
+{
+	return CacheKey("ConstantSurfaceScalingFunction").Add(surface_->Hash()).GetValue();
+}
+
 template <typename Archive>
 void
 BasicSurfaceScalingFunction::serialize(Archive &ar, unsigned version)
@@ -317,6 +392,18 @@ BasicSurfaceScalingFunction::operator==(const SurfaceScalingFunction &o) const
 		    centerBounds_ == other->centerBounds_);
 }
 
+uint64_t
+BasicSurfaceScalingFunction::Hash() const
+{
+	CacheKey key("BasicSurfaceScalingFunction");
+	const pair *pairs[] = { &scale_, &energyScale_, &offset_, &power_, &rBounds_, &zBounds_,
+	    &centerBounds_.first, &centerBounds_.second };
+	BOOST_FOREACH(const pair *p, pairs)
+		key.Add(p->first).Add(p->second);
+	
+	return key.GetValue();
+}
+
 }
 
 I3_SERIALIZABLE(I3MuonGun::SurfaceScalingFunction);
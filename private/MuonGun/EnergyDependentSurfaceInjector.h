@@ -30,6 +30,8 @@ public:
 	
 	/** @brief Compare for equality */
 	virtual bool operator==(const SurfaceScalingFunction&) const = 0;
+	/** @brief A hash of the configuration, consistent with operator== */
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -45,6 +47,7 @@ public:
 	
 	virtual SamplingSurfacePtr GetSurface(double energy) const;
 	virtual bool operator==(const SurfaceScalingFunction&) const;
+	virtual uint64_t Hash() const;
 private:
 	ConstantSurfaceScalingFunction();
 	friend class icecube::serialization::access;
@@ -63,6 +66,7 @@ public:
 	
 	virtual SamplingSurfacePtr GetSurface(double energy) const;
 	virtual bool operator==(const SurfaceScalingFunction&) const;
+	virtual uint64_t Hash() const;
 	
 	void SetCapScaling(double energyScale, double scale, double offset, double power);
 	void SetSideScaling(double energyScale, double scale, double offset, double power);
@@ -106,12 +110,17 @@ public:
 	    SurfaceScalingFunctionPtr scaling=boost::make_shared<BasicSurfaceScalingFunction>());
 
 	// GenerationProbability interface
-	virtual double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	virtual double GetLogGenerationProbability(const BundleKinematics &kinematics) const;
+	using GenerationProbability::GetLogGenerationProbability;
 	virtual GenerationProbabilityPtr Clone() const;
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const;
+	virtual uint64_t Hash() const;
 	
 	// Generator interface
-	void Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const;
+	void Generate(I3RandomService &rng, I3MCTree &tree, BundleSpec &bundle) const;
+	using Generator::Generate;
+	using Generator::GenerateBatch;
+	void GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const;
 	
 	SurfaceScalingFunctionPtr GetScaling() const { return scalingFunction_; }
 	void SetScaling(SurfaceScalingFunctionPtr &f) { scalingFunction_ = f; }
@@ -128,6 +137,16 @@ public:
 	 */
 	double GetTotalRate(SamplingSurfaceConstPtr surface) const;
 private:
+	/**
+	 * Draw a multiplicity and set of energies, then an impact point on
+	 * the target surface appropriate for the most energetic muon.
+	 * The impact point is moved back to the injection surface, but *depth*
+	 * is the vertical depth of the original point on the target surface.
+	 *
+	 * @returns the target surface
+	 */
+	SamplingSurfaceConstPtr SampleAxis(I3RandomService &rng, I3Position &pos,
+	    I3Direction &dir, double &depth, BundleSpec &bundle) const;
 	
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -7,39 +7,41 @@
  */
 
 #include <MuonGun/EnergyDistribution.h>
+#include <MuonGun/NormalizationCache.h>
 #include <MuonGun/RadialDistribution.h>
 #include <phys-services/I3RandomService.h>
 #include <MuonGun/EnsembleSampler.h>
 
 #include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+#include <algorithm>
 
 namespace I3MuonGun {
 
 EnergyDistribution::~EnergyDistribution() {};
 
-double
-EnergyDistribution::operator()(double d, double ct, 
-    unsigned m, double r, double e) const
+uint64_t
+EnergyDistribution::Hash() const
 {
-	return std::exp(GetLog(d, ct, m, r, log_value(std::log(e))));
+	return CacheKey("EnergyDistribution").GetValue();
 }
 
+namespace {
+
+// Integrate a density in radius and energy, given as a function
+// log_density(radius, log_energy)
+template <typename LogDensity>
 double
-EnergyDistribution::Integrate(double d, double ct, 
-    unsigned m, double r_min, double r_max, double e_min, double e_max) const
+integrate_density(const LogDensity &log_density, unsigned m,
+    double r_min, double r_max, double loge_min, double loge_max)
 {
-	// restrict integration to range where density can be nonzero
-	double loge_min = std::max(minLog_, std::log(e_min));
-	double loge_max = std::min(maxLog_, std::log(e_max));
-	r_min = std::max(0., r_min);
-	r_max = std::min(GetMaxRadius(), r_max);
 	if (m > 1) {
 		// Integrate dP/(dlogE dr^2) for numerical stability
-		auto integrand = [this,d,ct,m](double r2, double loge)
+		auto integrand = [&log_density](double r2, double loge)
 		{
 			double r = std::sqrt(r2);
-			return std::exp(GetLog(d, ct, m, r, log_value(loge))
-			    - std::log(2*r) + loge);
+			return std::exp(log_density(r, loge) - std::log(2*r) + loge);
 		};
 		boost::array<double, 2> lo = {{r_min*r_min, loge_min}};
 		boost::array<double, 2> hi = {{r_max*r_max, loge_max}};
@@ -47,14 +49,53 @@ EnergyDistribution::Integrate(double d, double ct,
 		    lo, hi, 1e-12, 1e-6, 10000);
 	} else {
 		// For single muons, dP/dr is a delta function at 0
-		auto integrand = [this,d,ct,m](double loge)
+		auto integrand = [&log_density](double loge)
 		{
-			return std::exp(GetLog(d, ct, m, 0, log_value(loge)) + loge);
+			return std::exp(log_density(0., loge) + loge);
 		};
 		return I3MuonGun::Integrate(boost::function<double(double)>(integrand), loge_min, loge_max);
 	}
 }
 
+}
+
+double
+EnergyDistribution::operator()(double d, double ct, 
+    unsigned m, double r, double e) const
+{
+	return std::exp(GetLog(d, ct, m, r, log_value(std::log(e))));
+}
+
+double
+EnergyDistribution::Integrate(double d, double ct, 
+    unsigned m, double r_min, double r_max, double e_min, double e_max) const
+{
+	// restrict integration to range where density can be nonzero
+	double loge_min = std::max(minLog_, std::log(e_min));
+	double loge_max = std::min(maxLog_, std::log(e_max));
+	r_min = std::max(0., r_min);
+	r_max = std::min(GetMaxRadius(), r_max);
+	return integrate_density([this,d,ct,m](double r, double loge)
+	{
+		return GetLog(d, ct, m, r, log_value(loge));
+	}, m, r_min, r_max, loge_min, loge_max);
+}
+
+double
+EnergyDistribution::GetLogCumulative(double d, double ct,
+    unsigned m, double r, log_value log_energy) const
+{
+	double loge_max = std::min(maxLog_, double(log_energy));
+	if (!(loge_max > minLog_))
+		return -std::numeric_limits<double>::infinity();
+	auto integrand = [this,d,ct,m,r](double loge)
+	{
+		return std::exp(GetLog(d, ct, m, r, log_value(loge)) + loge);
+	};
+	return std::log(I3MuonGun::Integrate(boost::function<double(double)>(integrand),
+	    minLog_, loge_max));
+}
+
 bool
 SplineEnergyDistribution::operator==(const EnergyDistribution &o) const
 {
@@ -62,7 +103,15 @@ SplineEnergyDistribution::operator==(const EnergyDistribution &o) const
 	if (!other)
 		return false;
 	else
-		return (singles_ == other->singles_ && bundles_ == other->bundles_);
+		return (singles_ == other->singles_ && bundles_ == other->bundles_
+		    && minLog_ == other->minLog_ && maxLog_ == other->maxLog_);
+}
+
+uint64_t
+SplineEnergyDistribution::Hash() const
+{
+	return CacheKey("SplineEnergyDistribution").Add(singles_.Hash()).Add(bundles_.Hash())
+	    .Add(minLog_).Add(maxLog_).GetValue();
 }
 
 SplineEnergyDistribution::SplineEnergyDistribution(const std::string &singles, const std::string &bundles)
@@ -72,10 +121,25 @@ SplineEnergyDistribution::SplineEnergyDistribution(const std::string &singles, c
 		log_fatal("'%s' does not appear to be a single-muon energy distribution", singles.c_str());
 	if (bundles_.GetNDim() != 5u)
 		log_fatal("'%s' does not appear to be a muon bundle energy distribution", bundles.c_str());
+	ResetEnergyRange();
+}
+
+void
+SplineEnergyDistribution::ResetEnergyRange()
+{
 	SetMin(std::exp(std::max(singles_.GetExtents(2).first, bundles_.GetExtents(2).first)));
 	SetMax(std::exp(std::min(singles_.GetExtents(2).second, bundles_.GetExtents(2).second)));
 }
 
+bool
+SplineEnergyDistribution::IsTruncated() const
+{
+	// Allow for rounding in the round trip through exp() in ResetEnergyRange()
+	const double tol = 1e-9;
+	return (minLog_ > std::max(singles_.GetExtents(2).first, bundles_.GetExtents(2).first) + tol
+	    || maxLog_ < std::min(singles_.GetExtents(2).second, bundles_.GetExtents(2).second) - tol);
+}
+
 double
 SplineEnergyDistribution::GetMaxRadius() const
 {
@@ -85,6 +149,50 @@ SplineEnergyDistribution::GetMaxRadius() const
 double
 SplineEnergyDistribution::GetLog(double depth, double cos_theta, 
     unsigned multiplicity, double radius, log_value log_energy) const
+{
+	double logprob = GetLogDensity(depth, cos_theta, multiplicity, radius, log_energy);
+	if (std::isfinite(logprob) && IsTruncated())
+		logprob -= GetLogNorm(depth, cos_theta, multiplicity);
+	
+	return logprob;
+}
+
+double
+SplineEnergyDistribution::GetLogNorm(double depth, double cos_theta, unsigned multiplicity) const
+{
+	// Every muon in a bundle needs the same normalization, so remember the
+	// last one calculated on this thread. The memo is keyed on the
+	// configuration rather than on the address of the distribution, which
+	// may be reused by another one.
+	struct memo {
+		uint64_t hash;
+		double depth, cos_theta;
+		unsigned multiplicity;
+		double value;
+	};
+	static thread_local memo last = {0, NAN, NAN, 0, NAN};
+	const uint64_t hash = Hash();
+	if (last.hash == hash && last.depth == depth && last.cos_theta == cos_theta
+	    && last.multiplicity == multiplicity)
+		return last.value;
+	
+	last = {hash, depth, cos_theta, multiplicity,
+	    std::log(IntegrateDensity(depth, cos_theta, multiplicity))};
+	return last.value;
+}
+
+double
+SplineEnergyDistribution::IntegrateDensity(double depth, double cos_theta, unsigned multiplicity) const
+{
+	return integrate_density([this,depth,cos_theta,multiplicity](double r, double loge)
+	{
+		return GetLogDensity(depth, cos_theta, multiplicity, r, log_value(loge));
+	}, multiplicity, 0., GetMaxRadius(), minLog_, maxLog_);
+}
+
+double
+SplineEnergyDistribution::GetLogDensity(double depth, double cos_theta,
+    unsigned multiplicity, double radius, log_value log_energy) const
 {
 	double coords[5] = {cos_theta, depth, static_cast<double>(multiplicity),
 	    radius, log_energy};
@@ -131,9 +239,11 @@ SplineEnergyDistribution::Generate(I3RandomService &rng, double depth,
 		}
 	}
 	
+	// The sampler doesn't need the normalization, so skip it even if the
+	// energy range is truncated
 	auto log_posterior = [this,depth,cos_theta,multiplicity](double r, double e)
 	{
-		return this->GetLog(depth, cos_theta, multiplicity, r,
+		return this->GetLogDensity(depth, cos_theta, multiplicity, r,
 		    EnergyDistribution::log_value(std::log(e)));
 	};
 	Sampler sampler(log_posterior, initial_ensemble);
@@ -175,7 +285,14 @@ BMSSEnergyDistribution::BMSSEnergyDistribution() :
 bool
 BMSSEnergyDistribution::operator==(const EnergyDistribution &o) const
 {
-	return dynamic_cast<const BMSSEnergyDistribution*>(&o);
+	const BMSSEnergyDistribution *other = dynamic_cast<const BMSSEnergyDistribution*>(&o);
+	return (other && minLog_ == other->minLog_ && maxLog_ == other->maxLog_);
+}
+
+uint64_t
+BMSSEnergyDistribution::Hash() const
+{
+	return CacheKey("BMSSEnergyDistribution").Add(minLog_).Add(maxLog_).GetValue();
 }
 
 OffsetPowerLaw
@@ -261,6 +378,12 @@ OffsetPowerLaw::operator==(const OffsetPowerLaw &other) const
 	    && emin_ == other.emin_ && emax_ == other.emax_ );
 }
 
+uint64_t
+OffsetPowerLaw::Hash() const
+{
+	return CacheKey("OffsetPowerLaw").Add(gamma_).Add(offset_).Add(emin_).Add(emax_).GetValue();
+}
+
 double
 OffsetPowerLaw::operator()(double energy) const
 {
@@ -285,6 +408,17 @@ OffsetPowerLaw::GetLog(EnergyDistribution::log_value log_energy) const
 	return GetLog(std::exp(log_energy));
 }
 
+double
+OffsetPowerLaw::GetLogCumulative(double energy) const
+{
+	if (!(energy > emin_))
+		return -std::numeric_limits<double>::infinity();
+	else if (energy >= emax_)
+		return 0.;
+	double n = (gamma_ == 1) ? std::log(energy + offset_) : std::pow(energy + offset_, 1-gamma_);
+	return std::log((n - nmin_)/(nmax_ - nmin_));
+}
+
 double
 OffsetPowerLaw::Generate(I3RandomService &rng) const
 {
@@ -300,21 +434,202 @@ OffsetPowerLaw::InverseSurvivalFunction(double p) const
 		return std::pow((1-p)*(nmax_ - nmin_) + nmin_, 1./(1.-gamma_)) - offset_;
 }
 
+PiecewisePowerLaw::PiecewisePowerLaw() : logEnergy_(2, NAN), logDensity_(2, NAN)
+{}
+
+PiecewisePowerLaw::PiecewisePowerLaw(const std::vector<double> &energies,
+    const std::vector<double> &log_density) : logDensity_(log_density)
+{
+	if (energies.size() < 2)
+		log_fatal("Need at least 2 knots");
+	if (energies.size() != log_density.size())
+		log_fatal("Need exactly one density for each knot");
+	BOOST_FOREACH(double e, energies) {
+		if (!(e > 0))
+			log_fatal("Knot energies must be positive");
+		if (!logEnergy_.empty() && !(std::log(e) > logEnergy_.back()))
+			log_fatal("Knot energies must be strictly increasing");
+		logEnergy_.push_back(std::log(e));
+	}
+	BOOST_FOREACH(double f, log_density)
+		if (!std::isfinite(f))
+			log_fatal("Densities must be finite and positive");
+	
+	Normalize();
+}
+
+namespace {
+
+// Integral of exp(a t) over [0, L], divided by L. Stable as a -> 0.
+inline double
+segment_factor(double a, double L)
+{
+	double x = a*L;
+	return (std::abs(x) < 1e-8) ? 1. + x/2 : std::expm1(x)/x;
+}
+
+}
+
+void
+PiecewisePowerLaw::Normalize()
+{
+	const double lognorm = std::log(UpdateSegments());
+	BOOST_FOREACH(double &f, logDensity_)
+		f -= lognorm;
+	// Derive the segments from the normalized densities, exactly as
+	// serialize() does after loading
+	UpdateSegments();
+}
+
+double
+PiecewisePowerLaw::UpdateSegments()
+{
+	const size_t nseg = logEnergy_.size()-1;
+	slope_.resize(nseg);
+	cdf_.resize(nseg);
+	
+	// In segment i, dP/dE = f_i (E/E_i)^s_i, whose integral is
+	// f_i E_i L_i [exp((s_i+1) L_i) - 1]/((s_i+1) L_i), with L_i = log(E_{i+1}/E_i)
+	double total = 0;
+	for (size_t i=0; i < nseg; i++) {
+		double L = logEnergy_[i+1]-logEnergy_[i];
+		slope_[i] = (logDensity_[i+1]-logDensity_[i])/L;
+		total += std::exp(logDensity_[i] + logEnergy_[i])*L*segment_factor(slope_[i]+1, L);
+		cdf_[i] = total;
+	}
+	BOOST_FOREACH(double &c, cdf_)
+		c /= total;
+	cdf_.back() = 1.;
+	
+	return total;
+}
+
+std::vector<double>
+PiecewisePowerLaw::GetEnergies() const
+{
+	std::vector<double> energies;
+	BOOST_FOREACH(double loge, logEnergy_)
+		energies.push_back(std::exp(loge));
+	return energies;
+}
+
+bool
+PiecewisePowerLaw::operator==(const PiecewisePowerLaw &other) const
+{
+	return (logEnergy_ == other.logEnergy_ && logDensity_ == other.logDensity_);
+}
+
+uint64_t
+PiecewisePowerLaw::Hash() const
+{
+	CacheKey key("PiecewisePowerLaw");
+	key.Add(uint64_t(logEnergy_.size()));
+	BOOST_FOREACH(double loge, logEnergy_)
+		key.Add(loge);
+	BOOST_FOREACH(double f, logDensity_)
+		key.Add(f);
+	
+	return key.GetValue();
+}
+
+double
+PiecewisePowerLaw::operator()(double energy) const
+{
+	return std::exp(GetLog(energy));
+}
+
+double
+PiecewisePowerLaw::GetLog(double energy) const
+{
+	return GetLog(EnergyDistribution::log_value(std::log(energy)));
+}
+
+double
+PiecewisePowerLaw::GetLog(EnergyDistribution::log_value log_energy) const
+{
+	if (!(log_energy >= logEnergy_.front() && log_energy <= logEnergy_.back()))
+		return -std::numeric_limits<double>::infinity();
+	
+	size_t i = std::upper_bound(logEnergy_.begin(), logEnergy_.end()-1, double(log_energy))
+	    - logEnergy_.begin();
+	i = std::max(i, size_t(1)) - 1;
+	
+	return logDensity_[i] + slope_[i]*(log_energy - logEnergy_[i]);
+}
+
+double
+PiecewisePowerLaw::GetLogCumulative(double energy) const
+{
+	const double loge = std::log(energy);
+	if (!(loge > logEnergy_.front()))
+		return -std::numeric_limits<double>::infinity();
+	else if (loge >= logEnergy_.back())
+		return 0.;
+	
+	size_t i = std::upper_bound(logEnergy_.begin(), logEnergy_.end()-1, loge)
+	    - logEnergy_.begin();
+	i = std::max(i, size_t(1)) - 1;
+	
+	// Add the partial integral of segment i to the total below it
+	const double t = loge - logEnergy_[i];
+	const double lo = (i == 0) ? 0 : cdf_[i-1];
+	return std::log(lo + std::exp(logDensity_[i] + logEnergy_[i])*t*segment_factor(slope_[i]+1, t));
+}
+
+double
+PiecewisePowerLaw::Generate(I3RandomService &rng) const
+{
+	return InverseSurvivalFunction(rng.Uniform());
+}
+
+double
+PiecewisePowerLaw::InverseSurvivalFunction(double p) const
+{
+	// Find the segment, then invert the partial integral within it
+	const double u = 1-p;
+	size_t i = std::min(size_t(std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin()),
+	    cdf_.size()-1);
+	const double lo = (i == 0) ? 0 : cdf_[i-1];
+	const double frac = (cdf_[i] > lo) ? (u - lo)/(cdf_[i] - lo) : 0.;
+	
+	const double L = logEnergy_[i+1]-logEnergy_[i];
+	const double a = slope_[i]+1;
+	double t;
+	if (std::abs(a*L) < 1e-8)
+		t = frac*L;
+	else
+		t = std::log1p(frac*std::expm1(a*L))/a;
+	
+	return std::exp(logEnergy_[i] + std::min(std::max(t, 0.), L));
+}
+
 template <typename Archive>
 void
-EnergyDistribution::serialize(Archive &ar __attribute__ ((unused)), unsigned version __attribute__ ((unused)))
-{}
+EnergyDistribution::serialize(Archive &ar, unsigned version)
+{
+	if (version > 1)
+		log_fatal_stream("Version "<<version<<" is from the future");
+	
+	if (version > 0) {
+		ar & make_nvp("MinLogEnergy", minLog_);
+		ar & make_nvp("MaxLogEnergy", maxLog_);
+	}
+}
 	
 template <typename Archive>
 void
 SplineEnergyDistribution::serialize(Archive &ar, unsigned version)
 {
-	if (version > 0)
+	if (version > 1)
 		log_fatal_stream("Version "<<version<<" is from the future");
 	
 	ar & make_nvp("EnergyDistribution", base_object<EnergyDistribution>(*this));
 	ar & make_nvp("SingleEnergy", singles_);
 	ar & make_nvp("BundleEnergy", bundles_);
+	// Before version 1 the energy range was not stored, so it can only
+	// have been the full extent of the fit
+	if (version < 1)
+		ResetEnergyRange();
 }
 
 template <typename Archive>
@@ -342,9 +657,27 @@ OffsetPowerLaw::serialize(Archive &ar, unsigned version)
 	*this = OffsetPowerLaw(gamma_, offset_, emin_, emax_);
 }
 
+template <typename Archive>
+void
+PiecewisePowerLaw::serialize(Archive &ar, unsigned version)
+{
+	if (version > 0)
+		log_fatal_stream("Version "<<version<<" is from the future");
+	
+	ar & make_nvp("LogEnergy", logEnergy_);
+	ar & make_nvp("LogDensity", logDensity_);
+	
+	// The stored densities are already normalized. Normalizing them again
+	// would change them in the last bits, and with them operator==() and
+	// Hash().
+	if (Archive::is_loading::value)
+		UpdateSegments();
+}
+
 }
 
 I3_SERIALIZABLE(I3MuonGun::EnergyDistribution);
 I3_SERIALIZABLE(I3MuonGun::SplineEnergyDistribution);
 I3_SERIALIZABLE(I3MuonGun::BMSSEnergyDistribution);
 I3_SERIALIZABLE(I3MuonGun::OffsetPowerLaw);
+I3_SERIALIZABLE(I3MuonGun::PiecewisePowerLaw);
@@ -7,11 +7,38 @@
  */
 
 #include <MuonGun/ExtrudedPolygon.h>
+#include <MuonGun/NormalizationCache.h>
+#include <boost/foreach.hpp>
 
 namespace I3MuonGun {
 
 ExtrudedPolygon::~ExtrudedPolygon() {}
 
+bool
+ExtrudedPolygon::operator==(const SamplingSurface &s) const
+{
+	const ExtrudedPolygon *other = dynamic_cast<const ExtrudedPolygon*>(&s);
+	if (!other)
+		return false;
+	else
+		return (GetX() == other->GetX() && GetY() == other->GetY()
+		    && GetZ() == other->GetZ());
+}
+
+uint64_t
+ExtrudedPolygon::Hash() const
+{
+	CacheKey key("ExtrudedPolygon");
+	BOOST_FOREACH(double x, GetX())
+		key.Add(x);
+	BOOST_FOREACH(double y, GetY())
+		key.Add(y);
+	BOOST_FOREACH(double z, GetZ())
+		key.Add(z);
+	
+	return key.GetValue();
+}
+
 template <typename Archive>
 void
 ExtrudedPolygon::serialize(Archive &ar, unsigned version)
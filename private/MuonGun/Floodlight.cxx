@@ -3,6 +3,7 @@
 #include <MuonGun/I3MuonGun.h>
 #include <MuonGun/EnergyDependentSurfaceInjector.h>
 #include <MuonGun/Cylinder.h>
+#include <MuonGun/NormalizationCache.h>
 #include <dataclasses/I3Position.h>
 #include <dataclasses/I3Direction.h>
 #include <dataclasses/physics/I3Particle.h>
@@ -64,8 +65,16 @@ Floodlight::IsCompatible(GenerationProbabilityConstPtr o) const
 		    && *energyGenerator_ == *(other->energyGenerator_));
 }
 
+uint64_t
+Floodlight::Hash() const
+{
+	return CacheKey("Floodlight").Add(surface_->Hash())
+	    .Add(zenith_range_.first).Add(zenith_range_.second)
+	    .Add(energyGenerator_->Hash()).GetValue();
+}
+
 void
-Floodlight::Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle __attribute__((unused))) const
+Floodlight::Generate(I3RandomService &rng, I3MCTree &tree, BundleSpec &bundle __attribute__((unused))) const
 {
 	I3Direction dir;
 	I3Position pos;
@@ -86,18 +95,42 @@ Floodlight::Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &
 	I3MCTreeUtils::AppendChild(tree, primary, muon);
 }
 
+void
+Floodlight::GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const
+{
+	I3Direction dir;
+	I3Position pos;
+	batch.reserve(batch.size()+n, batch.radius.size()+n);
+	for (size_t i=0; i < n; i++) {
+		surface_->SampleImpactRay(pos, dir, rng, zenith_range_.first, zenith_range_.second);
+		batch.AddBundle(pos, dir);
+		batch.AddMuon(0., energyGenerator_->Generate(rng));
+	}
+}
+
+bool
+Floodlight::Covers(const BundleKinematics &kinematics) const
+{
+	const BundleSpec &bundle = kinematics.GetBundle();
+	const double ct = kinematics.GetCosZenith();
+	
+	return bundle.size() == 1
+	    && ct >= zenith_range_.first && ct <= zenith_range_.second
+	    && std::isfinite(energyGenerator_->GetLog(bundle.GetEnergy(0)));
+}
+
 double
-Floodlight::GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const
+Floodlight::GetLogGenerationProbability(const BundleKinematics &kinematics) const
 {
-	std::pair<double, double> steps = surface_->GetIntersection(axis.GetPos(), axis.GetDir());
+	const BundleSpec &bundle = kinematics.GetBundle();
 	// Bail if the axis doesn't intersect the surface, or there's more than 1 muon.
-	double ct = std::cos(axis.GetDir().GetZenith());
-	if (!std::isfinite(steps.first) || bundle.size() != 1
+	double ct = kinematics.GetCosZenith();
+	if (!std::isfinite(kinematics.GetEntry(surface_)) || bundle.size() != 1
 	    || ct < zenith_range_.first
 	    || ct > zenith_range_.second)
 		return -std::numeric_limits<double>::infinity();
 	
-	return energyGenerator_->GetLog(bundle.front().energy) - log_acceptance_;
+	return energyGenerator_->GetLog(bundle.GetEnergy(0)) - log_acceptance_;
 }
 
 }
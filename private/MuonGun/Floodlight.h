@@ -13,10 +13,16 @@ public:
 	Floodlight(SamplingSurfacePtr, boost::shared_ptr<OffsetPowerLaw>, double cosMin=-1, double cosMax=1);
 	
 	// Generator Interface
-	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const;
+	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleSpec &bundle) const;
+	using Generator::Generate;
+	using Generator::GenerateBatch;
+	virtual void GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const;
 	virtual GenerationProbabilityPtr Clone() const;
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const;
-	virtual double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	virtual uint64_t Hash() const;
+	virtual bool Covers(const BundleKinematics &kinematics) const;
+	virtual double GetLogGenerationProbability(const BundleKinematics &kinematics) const;
+	using GenerationProbability::GetLogGenerationProbability;
 	virtual SamplingSurfaceConstPtr GetInjectionSurface() const { return surface_; }
 	
 private:
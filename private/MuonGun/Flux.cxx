@@ -7,6 +7,7 @@
  */
 
 #include <MuonGun/Flux.h>
+#include <MuonGun/NormalizationCache.h>
 #include <icetray/I3Units.h>
 #include <icetray/I3Logging.h>
 #include <limits>
@@ -29,6 +30,11 @@ bool Flux::operator==(const Flux &other) const
 	    && maxMultiplicity_ == other.maxMultiplicity_);
 }
 
+uint64_t Flux::Hash() const
+{
+	return CacheKey("Flux").Add(minMultiplicity_).Add(maxMultiplicity_).GetValue();
+}
+
 BMSSFlux::BMSSFlux() : k0a_(7.2e-3), k0b_(-1.927), k1a_(-0.581), k1b_(0.034),
     v0a_(0.01041), v0b_(0.09912), v0c_(2.712), v1a_(0.01615), v1b_(0.6010)
 {}
@@ -52,6 +58,11 @@ bool BMSSFlux::operator==(const Flux &other) const
 	return Flux::operator==(other) && dynamic_cast<const BMSSFlux*>(&other);
 }
 
+uint64_t BMSSFlux::Hash() const
+{
+	return CacheKey("BMSSFlux").Add(Flux::Hash()).GetValue();
+}
+
 SplineFlux::SplineFlux(const std::string &singles, const std::string &bundles)
     : singles_(singles), bundles_(bundles)
 {
@@ -82,6 +93,12 @@ bool SplineFlux::operator==(const Flux &o) const
 		return (singles_ == other->singles_ && bundles_ == other->bundles_);
 }
 
+uint64_t SplineFlux::Hash() const
+{
+	return CacheKey("SplineFlux").Add(Flux::Hash())
+	    .Add(singles_.Hash()).Add(bundles_.Hash()).GetValue();
+}
+
 template <typename Archive>
 void
 Flux::serialize(Archive &ar, unsigned version)
@@ -7,14 +7,30 @@
  */
 
 #include <MuonGun/Generator.h>
+#include <MuonGun/I3MuonGun.h>
+#include <MuonGun/BundleRecord.h>
 #include <MuonGun/SamplingSurface.h>
+#include <MuonGun/NormalizationCache.h>
+#include <MuonGun/ThreadPool.h>
+#include <MuonGun/CounterRandomService.h>
+#include <MuonGun/QuasiRandomService.h>
+#include <MuonGun/ThinningFunction.h>
 
 #include <icetray/I3Module.h>
 #include <dataclasses/physics/I3MCTreeUtils.h>
 #include <dataclasses/I3Double.h>
+#include <dataclasses/I3Vector.h>
 #include <phys-services/I3RandomService.h>
+#include <phys-services/I3GSLRandomService.h>
 #include <boost/make_shared.hpp>
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <future>
+#include <limits>
 
 
 namespace I3MuonGun {
@@ -22,6 +38,190 @@ namespace I3MuonGun {
 GenerationProbability::~GenerationProbability() {}
 Generator::~Generator() {}
 
+BundleSpec::BundleSpec(const BundleConfiguration &entries) : maxEnergy_(0)
+{
+	reserve(entries.size());
+	BOOST_FOREACH(const BundleEntry &entry, entries)
+		push_back(entry);
+}
+
+BundleConfiguration
+BundleSpec::GetEntries() const
+{
+	return BundleConfiguration(begin(), end());
+}
+
+void
+BundleSpec::reserve(size_t n)
+{
+	radius_.reserve(n);
+	energy_.reserve(n);
+	omitted_.reserve(n);
+}
+
+void
+BundleSpec::clear()
+{
+	radius_.clear();
+	energy_.clear();
+	omitted_.clear();
+	maxEnergy_ = 0;
+}
+
+void
+BundleSpec::push_back(const BundleEntry &entry)
+{
+	radius_.push_back(entry.radius);
+	energy_.push_back(entry.energy);
+	omitted_.push_back(entry.omitted);
+	maxEnergy_ = std::max(maxEnergy_, entry.energy);
+}
+
+void
+BundleSpec::Omit(size_t i, double bound)
+{
+	const double energy = energy_[i];
+	energy_[i] = bound;
+	omitted_[i] = true;
+	if (energy == maxEnergy_ && bound < energy)
+		maxEnergy_ = *std::max_element(energy_.begin(), energy_.end());
+}
+
+void
+BundleSpec::sort()
+{
+	const size_t n = size();
+	boost::container::small_vector<size_t, 8> order(n);
+	for (size_t i=0; i < n; i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(),
+	    [this](size_t a, size_t b) { return energy_[b] < energy_[a]; });
+	
+	BundleSpec sorted;
+	sorted.reserve(n);
+	BOOST_FOREACH(size_t i, order)
+		sorted.push_back((*this)[i]);
+	*this = std::move(sorted);
+}
+
+bool
+BundleSpec::operator==(const BundleSpec &other) const
+{
+	return radius_ == other.radius_ && energy_ == other.energy_ && omitted_ == other.omitted_;
+}
+
+BundleKinematics::BundleKinematics(const I3Particle &axis, const BundleSpec &bundle)
+    : axis_(&axis), bundle_(&bundle), cosZenith_(std::cos(axis.GetDir().GetZenith())),
+    entry_(NAN), depth_(NAN)
+{
+	logEnergy_.reserve(bundle.size());
+	BOOST_FOREACH(double energy, bundle.GetEnergies())
+		logEnergy_.push_back(std::log(energy));
+}
+
+void
+BundleKinematics::Intersect(SamplingSurfaceConstPtr surface) const
+{
+	// Holding on to the surface guarantees that a matching pointer
+	// really is the same surface
+	if (surface == surface_ || (surface_ && *surface == *surface_))
+		return;
+	surface_ = surface;
+	entry_ = surface->GetIntersection(axis_->GetPos(), axis_->GetDir()).first;
+	depth_ = I3MuonGun::GetDepth(axis_->GetPos().GetZ() + entry_*axis_->GetDir().GetZ());
+}
+
+double
+BundleKinematics::GetEntry(SamplingSurfaceConstPtr surface) const
+{
+	Intersect(surface);
+	return entry_;
+}
+
+double
+BundleKinematics::GetDepth(SamplingSurfaceConstPtr surface) const
+{
+	Intersect(surface);
+	return depth_;
+}
+
+void
+BundleBatch::clear()
+{
+	x.clear(); y.clear(); z.clear(); zenith.clear(); azimuth.clear();
+	multiplicity.clear();
+	offsets.assign(1, 0);
+	radius.clear(); energy.clear();
+}
+
+void
+BundleBatch::reserve(size_t bundles, size_t muons)
+{
+	x.reserve(bundles); y.reserve(bundles); z.reserve(bundles);
+	zenith.reserve(bundles); azimuth.reserve(bundles);
+	multiplicity.reserve(bundles);
+	offsets.reserve(bundles+1);
+	radius.reserve(muons); energy.reserve(muons);
+}
+
+void
+BundleBatch::AddBundle(const I3Position &pos, const I3Direction &dir)
+{
+	x.push_back(pos.GetX());
+	y.push_back(pos.GetY());
+	z.push_back(pos.GetZ());
+	zenith.push_back(dir.GetZenith());
+	azimuth.push_back(dir.GetAzimuth());
+	multiplicity.push_back(0);
+	offsets.push_back(offsets.back());
+}
+
+void
+BundleBatch::AddMuon(double r, double e)
+{
+	radius.push_back(r);
+	energy.push_back(e);
+	multiplicity.back()++;
+	offsets.back()++;
+}
+
+void
+Generator::GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const
+{
+	batch.reserve(batch.size()+n, batch.radius.size()+n);
+	for (size_t i=0; i < n; i++) {
+		I3MCTree mctree;
+		BundleSpec bundlespec;
+		Generate(rng, mctree, bundlespec);
+		
+		const I3MCTree::const_iterator primary = mctree.begin();
+		batch.AddBundle(primary->GetPos(), primary->GetDir());
+		if (bundlespec.empty()) {
+			// Not every generator reports the bundle it drew
+			BOOST_FOREACH(const I3Particle &track, I3MCTreeUtils::GetDaughters(mctree, *primary))
+				bundlespec.push_back(BundleEntry(0., track.GetEnergy()));
+		}
+		for (size_t j=0; j < bundlespec.size(); j++)
+			batch.AddMuon(bundlespec.GetRadius(j), bundlespec.GetEnergy(j));
+	}
+}
+
+void
+Generator::Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const
+{
+	BundleSpec bundlespec;
+	Generate(rng, tree, bundlespec);
+	bundle = bundlespec.GetEntries();
+}
+
+BundleBatch
+Generator::GenerateBatch(I3RandomService &rng, size_t n) const
+{
+	BundleBatch batch;
+	GenerateBatch(rng, n, batch);
+	return batch;
+}
+
 template <typename Archive>
 void
 GenerationProbability::serialize(Archive &ar, unsigned version)
@@ -44,13 +244,25 @@ Generator::serialize(Archive &ar, unsigned version)
 }
 
 double
-GenerationProbability::GetLogGeneratedEvents(const I3Particle &axis, const BundleConfiguration &bundle) const
+GenerationProbability::GetLogGeneratedEvents(const I3Particle &axis, const BundleSpec &bundle) const
+{
+	return GetLogGeneratedEvents(BundleKinematics(axis, bundle));
+}
+
+double
+GenerationProbability::GetLogGeneratedEvents(const BundleKinematics &kinematics) const
 {
-	return std::log(double(numEvents_)) + GetLogGenerationProbability(axis, bundle);
+	return std::log(double(numEvents_)) + GetLogGenerationProbability(kinematics);
 }
 
 double
-GenerationProbability::GetGeneratedEvents(const I3Particle &axis, const BundleConfiguration &bundle) const
+GenerationProbability::GetLogGenerationProbability(const I3Particle &axis, const BundleSpec &bundle) const
+{
+	return GetLogGenerationProbability(BundleKinematics(axis, bundle));
+}
+
+double
+GenerationProbability::GetGeneratedEvents(const I3Particle &axis, const BundleSpec &bundle) const
 {
 	return numEvents_*std::exp(GetLogGenerationProbability(axis, bundle));
 }
@@ -64,13 +276,48 @@ GenerationProbabilityCollection::GenerationProbabilityCollection(GenerationProba
 void
 GenerationProbabilityCollection::push_back(const GenerationProbabilityPtr &other)
 {
-	BOOST_FOREACH(value_type &p, *this)
+	// The index is not serialized, and members may have been added or
+	// removed through the std::vector interface since it was built
+	if (index_.size() != size()) {
+		index_.clear();
+		for (size_t i=0; i < size(); i++)
+			index_.insert(std::make_pair((*this)[i] ? (*this)[i]->Hash() : 0, i));
+	}
+	
+	// Only members with the same hash can be compatible
+	const uint64_t hash = other->Hash();
+	typedef std::unordered_multimap<uint64_t, size_t>::const_iterator iterator;
+	std::pair<iterator, iterator> candidates = index_.equal_range(hash);
+	for (iterator it = candidates.first; it != candidates.second; it++) {
+		value_type &p = (*this)[it->second];
 		if (p && p->IsCompatible(other)) {
 			p = p->Clone();
 			p->SetTotalEvents(p->GetTotalEvents() + other->GetTotalEvents());
 			return;
 		}
+	}
+	if (pool_)
+		other->Prepare();
 	std::vector<GenerationProbabilityPtr>::push_back(other);
+	index_.insert(std::make_pair(hash, size()-1));
+}
+
+uint64_t
+GenerationProbabilityCollection::Hash() const
+{
+	// Combine the members in an order-independent way, weighted by the
+	// fraction of events each one contributes
+	double total = 0;
+	BOOST_FOREACH(const value_type &p, *this)
+		if (p)
+			total += p->GetTotalEvents();
+	uint64_t hash = CacheKey("GenerationProbabilityCollection").GetValue();
+	BOOST_FOREACH(const value_type &p, *this)
+		if (p)
+			hash += CacheKey("Member").Add(p->Hash())
+			    .Add(p->GetTotalEvents()/total).GetValue();
+	
+	return hash;
 }
 
 bool
@@ -79,23 +326,133 @@ GenerationProbabilityCollection::IsCompatible(GenerationProbabilityConstPtr) con
 	log_fatal("I should never be called.");
 }
 
-double
-GenerationProbabilityCollection::GetLogGenerationProbability(const I3Particle &axis,
-    const BundleConfiguration &bundle) const
+namespace {
+
+// Accumulates log(sum(exp(x))) one term at a time, without overflowing
+class log_sum_exp {
+public:
+	log_sum_exp() : max_(-std::numeric_limits<double>::infinity()), sum_(0) {}
+	
+	void add(double v)
+	{
+		if (v == -std::numeric_limits<double>::infinity())
+			return;
+		if (v > max_) {
+			sum_ = sum_*std::exp(max_-v) + 1.;
+			max_ = v;
+		} else {
+			sum_ += std::exp(v-max_);
+		}
+	}
+	void add(const log_sum_exp &other)
+	{
+		if (other.max_ == -std::numeric_limits<double>::infinity())
+			return;
+		if (other.max_ > max_) {
+			sum_ = sum_*std::exp(max_-other.max_) + other.sum_;
+			max_ = other.max_;
+		} else {
+			sum_ += other.sum_*std::exp(other.max_-max_);
+		}
+	}
+	double value() const { return max_ + std::log(sum_); }
+private:
+	double max_, sum_;
+};
+
+// Members evaluated per task when the collection is evaluated in parallel
+const size_t collection_chunk = 16;
+
+}
+
+bool
+GenerationProbability::Covers(const BundleKinematics &) const
+{
+	return true;
+}
+
+void
+GenerationProbability::Prepare() const
+{}
+
+uint64_t
+GenerationProbability::Hash() const
+{
+	return CacheKey("GenerationProbability").GetValue();
+}
+
+bool
+GenerationProbabilityCollection::Covers(const BundleKinematics &kinematics) const
+{
+	BOOST_FOREACH(const value_type &p, *this)
+		if (p && p->Covers(kinematics))
+			return true;
+	return false;
+}
+
+void
+GenerationProbabilityCollection::Prepare() const
 {
-	// Collect log probabilities from members
-	std::vector<double> values(this->size(), -std::numeric_limits<double>::infinity());
 	BOOST_FOREACH(const value_type &p, *this)
 		if (p)
-			values.push_back(p->GetLogGeneratedEvents(axis, bundle));
+			p->Prepare();
+}
+
+void
+GenerationProbabilityCollection::SetNumThreads(unsigned nthreads)
+{
+	if (nthreads == 0) {
+		pool_.reset();
+	} else {
+		// The members will be evaluated on several threads at once
+		Prepare();
+		pool_ = boost::make_shared<ThreadPool>(nthreads);
+	}
+}
+
+unsigned
+GenerationProbabilityCollection::GetNumThreads() const
+{
+	return pool_ ? unsigned(pool_->GetSize()) : 0u;
+}
+
+double
+GenerationProbabilityCollection::GetLogGenerationProbability(const BundleKinematics &kinematics) const
+{
+	// Sum the generated events from members that could have generated
+	// this bundle. They share the geometry in *kinematics*.
+	if (!pool_ || size() < 2*collection_chunk) {
+		log_sum_exp total;
+		BOOST_FOREACH(const value_type &p, *this)
+			if (p && p->Covers(kinematics))
+				total.add(p->GetLogGeneratedEvents(kinematics));
+		return total.value();
+	}
 	
-	// Calculate log(sum(exp)) in a numerically stable way
-	double bias = *std::max_element(values.begin(), values.end());
-	double prob = 0.;
-	BOOST_FOREACH(double v, values)
-		prob += std::exp(v-bias);
+	// Intersect the common injection surface once, then give each task its
+	// own copy of the kinematics to update
+	BOOST_FOREACH(const value_type &p, *this)
+		if (p) {
+			kinematics.GetEntry(p->GetInjectionSurface());
+			break;
+		}
+	const size_t nchunks = (size() + collection_chunk-1)/collection_chunk;
+	boost::container::small_vector<log_sum_exp, 32> partial(nchunks);
+	pool_->ParallelFor(nchunks, [&](size_t c)
+	{
+		BundleKinematics local(kinematics);
+		const size_t end = std::min(size(), (c+1)*collection_chunk);
+		for (size_t i = c*collection_chunk; i < end; i++) {
+			const value_type &p = (*this)[i];
+			if (p && p->Covers(local))
+				partial[c].add(p->GetLogGeneratedEvents(local));
+		}
+	});
 	
-	return bias + std::log(prob);
+	log_sum_exp total;
+	BOOST_FOREACH(const log_sum_exp &part, partial)
+		total.add(part);
+	return total.value();
 }
 
 SamplingSurfaceConstPtr
@@ -174,7 +531,7 @@ operator+(GenerationProbabilityPtr p1, GenerationProbabilityPtr p2)
 		return c1;
 	} else if (c2) {
 		c2 = boost::make_shared<GenerationProbabilityCollection>(*c2);
-		c2->push_back(c1);
+		c2->push_back(p1);
 		return c2;
 	} else if (p1->IsCompatible(p2)) {
 		// If the two elements are identical, just scale up.
@@ -222,27 +579,108 @@ Generator::CreateParallelTrack(double radius, double azimuth,
 	return track;
 }
 
+bool
+Generator::HitsTarget(const I3MCTree &tree, const I3Surfaces::Surface &target)
+{
+	BOOST_FOREACH(const I3Particle &track, std::make_pair(tree.begin(), tree.end())) {
+		// NaN if the ray misses entirely
+		if (target.GetIntersection(track.GetPos(), track.GetDir()).second > 0)
+			return true;
+	}
+	return false;
+}
+
 /**
  * @brief Interface between Generator and IceTray
  */
 class GeneratorModule : public I3Module {
 public:
-	GeneratorModule(const I3Context &ctx) : I3Module(ctx), maxEvents_(0), numEvents_(0)
+	GeneratorModule(const I3Context &ctx) : I3Module(ctx), maxEvents_(0), numEvents_(0),
+	    nThreads_(0), queueDepth_(0), eventStreams_(false), runNumber_(0), firstEvent_(0),
+	    qmcDimensions_(0), numDiscarded_(0), numThinned_(0)
 	{
 		AddOutBox("OutBox");
 		AddParameter("Generator", "Muon bundle generator", generator_);
+		AddParameter("NThreads", "Number of background threads to generate "
+		    "events on. If 0, generate each event when it is requested. "
+		    "Otherwise, each event is generated from its own random stream, "
+		    "seeded from the RandomService in event order, so the output does "
+		    "not depend on the number of threads.", nThreads_);
+		AddParameter("QueueDepth", "Maximum number of events to generate ahead "
+		    "of the one being emitted when NThreads > 0. If 0, use 4*NThreads.",
+		    queueDepth_);
+		AddParameter("EventRandomStreams", "Generate each event from a "
+		    "counter-based random stream keyed by (RunNumber, event index) "
+		    "instead of the RandomService. Any event can then be regenerated "
+		    "on its own, and the output is identical for any NThreads.",
+		    eventStreams_);
+		AddParameter("RunNumber", "Key for EventRandomStreams", runNumber_);
+		AddParameter("FirstEvent", "Index of the first event in the campaign "
+		    "for EventRandomStreams, e.g. from ShardPlan", firstEvent_);
+		AddParameter("QuasiRandomDimensions", "If nonzero, drive each event "
+		    "with one point of a scrambled Sobol sequence with this many "
+		    "dimensions (see QuasiRandomService), falling back to the "
+		    "RandomService for any further numbers", qmcDimensions_);
+		AddParameter("TargetSurface", "If set, discard bundles whose axis and "
+		    "muons all miss this surface instead of emitting them. Discarded "
+		    "bundles still count toward the number of generated events, so "
+		    "weights remain correct.", target_);
+		AddParameter("Thinning", "If set, keep each bundle with the probability "
+		    "given by this ThinningFunction, and store the inverse of that "
+		    "probability under ThinningWeight. WeightCalculatorModule "
+		    "includes it in the weight automatically.", thinning_);
+		AddParameter("ThinningWeight", "Name to store the inverse of the "
+		    "probability to survive Thinning under", "MuonGunThinningWeight");
+		AddParameter("BundleRecord", "Name to store a BundleRecord of each "
+		    "bundle under, for WeightCalculatorModule to weight it without "
+		    "harvesting the I3MCTree. Set to an empty string to store none.",
+		    "MuonGunBundle");
 		
 		mctreeName_ = "I3MCTree";
+		omittedName_ = "MuonGunOmittedMuons";
 	}
 	
 	void Configure()
 	{
 		GetParameter("Generator", generator_);
+		GetParameter("NThreads", nThreads_);
+		GetParameter("QueueDepth", queueDepth_);
+		GetParameter("EventRandomStreams", eventStreams_);
+		GetParameter("RunNumber", runNumber_);
+		GetParameter("FirstEvent", firstEvent_);
+		GetParameter("QuasiRandomDimensions", qmcDimensions_);
+		GetParameter("TargetSurface", target_);
+		GetParameter("Thinning", thinning_);
+		GetParameter("BundleRecord", recordName_);
+		GetParameter("ThinningWeight", weightName_);
+		if (thinning_ && weightName_.empty())
+			log_fatal("Thinning needs a ThinningWeight to store the "
+			    "compensating weight under");
 		
 		rng_ = context_.Get<I3RandomServicePtr>();
-		if (!rng_)
+		if (!rng_ && !eventStreams_)
 			log_fatal("No RandomService configured!");
 		maxEvents_ = size_t(std::floor(generator_->GetTotalEvents()));
+		if (!recordName_.empty())
+			generatorHash_ = BundleRecord::GetGeneratorHash(*generator_);
+		
+		if (qmcDimensions_ > 0) {
+			if (nThreads_ > 0 || eventStreams_)
+				log_fatal("QuasiRandomDimensions can't be combined with "
+				    "NThreads or EventRandomStreams");
+			if (!rng_)
+				log_fatal("No RandomService configured!");
+			qrng_ = boost::make_shared<QuasiRandomService>(qmcDimensions_, rng_);
+		}
+		
+		if (nThreads_ > 0) {
+			if (queueDepth_ == 0)
+				queueDepth_ = 4*nThreads_;
+			// Fill in lazy normalizations before more than one thread
+			// can touch them
+			generator_->Prepare();
+			pool_.reset(new ThreadPool(nThreads_));
+		}
 		
 		firstFrame_ = true;
 	}
@@ -256,29 +694,213 @@ public:
 			PushFrame(sframe);
 		}
 		
-		I3MCTreePtr mctree = boost::make_shared<I3MCTree>();
-		BundleConfiguration bundlespec;
-		
-		generator_->Generate(*rng_, *mctree, bundlespec);
+		// Bundles that miss the target surface or lose at roulette count
+		// toward the total, but are never emitted
+		Event event;
+		while (numEvents_ < maxEvents_) {
+			event = NextEvent();
+			numEvents_++;
+			if (!event.mctree) {
+				numDiscarded_++;
+				continue;
+			}
+			if (thinning_)
+				Thin(event);
+			if (event.mctree)
+				break;
+			numThinned_++;
+		}
+		if (!event.mctree) {
+			RequestSuspension();
+			return;
+		}
 		
-		frame->Put(mctreeName_, mctree);
+		frame->Put(mctreeName_, event.mctree);
+		if (thinning_)
+			frame->Put(weightName_, boost::make_shared<I3Double>(event.weight));
+		// Record muons that were left out of the tree for being below the
+		// generator's energy threshold, so that they can be weighted
+		I3VectorDoubleDoublePtr omitted;
+		BOOST_FOREACH(const BundleEntry &entry, event.bundlespec) {
+			if (!entry.omitted)
+				continue;
+			if (!omitted)
+				omitted = boost::make_shared<I3VectorDoubleDouble>();
+			omitted->push_back(std::make_pair(entry.radius, entry.energy));
+		}
+		if (omitted)
+			frame->Put(omittedName_, omitted);
+		if (!recordName_.empty())
+			frame->Put(recordName_, MakeRecord(event));
 		
 		PushFrame(frame);
-		if (++numEvents_ >= maxEvents_)
+		if (numEvents_ >= maxEvents_)
 			RequestSuspension();
 	}
 	
 	void Finish();
 private:
+	struct Event {
+		Event() : weight(1.), logGenerationProbability(NAN) {}
+		I3MCTreePtr mctree;
+		BundleSpec bundlespec;
+		/** The stream the event was generated from */
+		I3RandomServicePtr rng;
+		double weight;
+		/** Log of the per-event generation probability, if already known */
+		double logGenerationProbability;
+	};
+	
+	/**
+	 * Log of the probability per generated event, i.e. without the
+	 * factor of GetTotalEvents()
+	 */
+	static double
+	GetLogGenerationProbability(const GenerationProbability &generator,
+	    const I3MCTree &mctree, const BundleSpec &bundlespec)
+	{
+		return generator.GetLogGeneratedEvents(*mctree.begin(), bundlespec)
+		    - std::log(generator.GetTotalEvents());
+	}
+	
+	BundleRecordPtr MakeRecord(const Event &event) const
+	{
+		BundleRecordPtr record =
+		    boost::make_shared<BundleRecord>(*event.mctree->begin(), event.bundlespec);
+		record->generatorHash = generatorHash_;
+		record->logGenerationProbability = std::isnan(event.logGenerationProbability) ?
+		    GetLogGenerationProbability(*generator_, *event.mctree, event.bundlespec) :
+		    event.logGenerationProbability;
+		
+		return record;
+	}
+	
+	/**
+	 * Generate the next event. Its tree is null if it missed the target
+	 * surface.
+	 */
+	Event NextEvent()
+	{
+		Event event;
+		if (pool_) {
+			Schedule();
+			event = queue_.front().get();
+			queue_.pop_front();
+			return event;
+		}
+		
+		event.mctree = boost::make_shared<I3MCTree>();
+		if (qrng_) {
+			qrng_->NextPoint();
+			event.rng = qrng_;
+		} else {
+			event.rng = eventStreams_ ? GetEventRandom(numEvents_) : rng_;
+		}
+		generator_->Generate(*event.rng, *event.mctree, event.bundlespec);
+		if (target_ && !Generator::HitsTarget(*event.mctree, *target_))
+			event.mctree.reset();
+		
+		return event;
+	}
+	
+	/**
+	 * Play Russian roulette with the event, dropping its tree if it loses.
+	 * The thinning function may be implemented in Python, so this has to
+	 * run on the IceTray thread.
+	 */
+	void Thin(Event &event)
+	{
+		double p = thinning_->GetKeepProbability(*event.mctree->begin(), event.bundlespec);
+		if (!(p > 0))
+			log_fatal("Keep probability must be > 0 (got %g), otherwise the "
+			    "weights can't make up for the thinned events", p);
+		if (p >= 1)
+			return;
+		if (event.rng->Uniform() < p)
+			event.weight = 1./p;
+		else
+			event.mctree.reset();
+	}
+	
+	/**
+	 * Get a private random stream for the given event. If not using
+	 * EventRandomStreams, this draws a seed from the shared RandomService,
+	 * and so must be called on the IceTray thread, in event order.
+	 */
+	I3RandomServicePtr GetEventRandom(size_t index)
+	{
+		if (eventStreams_)
+			return boost::make_shared<CounterRandomService>(runNumber_, firstEvent_ + index);
+		else
+			return boost::make_shared<I3GSLRandomService>(
+			    rng_->Integer(std::numeric_limits<uint32_t>::max()));
+	}
+	
+	/** Top up the queue of pending events */
+	void Schedule()
+	{
+		while (queue_.size() < queueDepth_ && numEvents_ + queue_.size() < maxEvents_) {
+			I3RandomServicePtr rng = GetEventRandom(numEvents_ + queue_.size());
+			boost::shared_ptr<std::promise<Event> > result =
+			    boost::make_shared<std::promise<Event> >();
+			queue_.push_back(result->get_future());
+			GeneratorConstPtr generator(generator_);
+			I3Surfaces::SurfaceConstPtr target(target_);
+			pool_->Submit([generator, target, rng, result]()
+			{
+				try {
+					Event event;
+					event.mctree = boost::make_shared<I3MCTree>();
+					event.rng = rng;
+					generator->Generate(*rng, *event.mctree, event.bundlespec);
+					if (target && !Generator::HitsTarget(*event.mctree, *target))
+						event.mctree.reset();
+					else
+						event.logGenerationProbability = GetLogGenerationProbability(
+						    *generator, *event.mctree, event.bundlespec);
+					result->set_value(event);
+				} catch (...) {
+					result->set_exception(std::current_exception());
+				}
+			});
+		}
+	}
+	
 	GeneratorPtr generator_;
 	I3RandomServicePtr rng_;
 	size_t maxEvents_, numEvents_;
-	std::string mctreeName_;
+	std::string mctreeName_, omittedName_, weightName_, recordName_;
+	uint64_t generatorHash_;
 	bool firstFrame_;
+	
+	unsigned nThreads_;
+	unsigned queueDepth_;
+	boost::scoped_ptr<ThreadPool> pool_;
+	std::deque<std::future<Event> > queue_;
+	
+	bool eventStreams_;
+	unsigned runNumber_;
+	uint64_t firstEvent_;
+	
+	unsigned qmcDimensions_;
+	QuasiRandomServicePtr qrng_;
+	
+	I3Surfaces::SurfacePtr target_;
+	ThinningFunctionPtr thinning_;
+	size_t numDiscarded_, numThinned_;
 };
 
 // Out-of-line virtual method definition to force the vtable into this translation unit
-void GeneratorModule::Finish() {}
+void GeneratorModule::Finish()
+{
+	// Wait for any events still in flight before the generator goes away
+	queue_.clear();
+	pool_.reset();
+	if (target_)
+		log_info_stream(numDiscarded_ << " of " << numEvents_ << " bundles missed the target surface");
+	if (thinning_)
+		log_info_stream(numThinned_ << " of " << numEvents_ << " bundles were thinned away");
+}
 
 }
 
@@ -9,6 +9,7 @@
 #include <MuonGun/I3MuonGun.h>
 #include <MuonGun/NaturalRateInjector.h>
 #include <MuonGun/Cylinder.h>
+#include <MuonGun/NormalizationCache.h>
 #include <dataclasses/I3Constants.h>
 
 #include <boost/bind.hpp>
@@ -39,7 +40,7 @@ template <typename Archive>
 void
 NaturalRateInjector::serialize(Archive &ar, unsigned version)
 {
-	if (version > 0)
+	if (version > 2)
 		log_fatal_stream("Version "<<version<<" is from the future");
 	
 	ar & make_nvp("Generator", base_object<Generator>(*this));
@@ -48,9 +49,23 @@ NaturalRateInjector::serialize(Archive &ar, unsigned version)
 	ar & make_nvp("Flux", flux_);
 	ar & make_nvp("EnergyRadiusDistribution", energyDistribution_);
 	ar & make_nvp("TotalRate", totalRate_);
+	if (version > 0) {
+		ar & make_nvp("CosZenithMin", zenithRange_.first);
+		ar & make_nvp("CosZenithMax", zenithRange_.second);
+		ar & make_nvp("AzimuthMin", azimuthRange_.first);
+		ar & make_nvp("AzimuthMax", azimuthRange_.second);
+	} else {
+		zenithRange_ = std::make_pair(0., 1.);
+		azimuthRange_ = std::make_pair(0., 2*M_PI);
+	}
+	if (version > 1)
+		ar & make_nvp("MuonEnergyThreshold", threshold_);
+	else
+		threshold_ = 0.;
 }
 
 NaturalRateInjector::NaturalRateInjector()
+    : zenithRange_(0., 1.), azimuthRange_(0., 2*M_PI), threshold_(0.)
 {
 	SetSurface(boost::make_shared<Cylinder>(1600, 800));
 	
@@ -65,6 +80,7 @@ NaturalRateInjector::NaturalRateInjector()
 
 NaturalRateInjector::NaturalRateInjector(SamplingSurfacePtr surface, FluxPtr flux,
     EnergyDistributionPtr edist)
+    : zenithRange_(0., 1.), azimuthRange_(0., 2*M_PI), threshold_(0.)
 {
 	SetSurface(surface);
 	SetFlux(flux);
@@ -85,7 +101,18 @@ NaturalRateInjector::IsCompatible(GenerationProbabilityConstPtr o) const
 	if (!other)
 		return false;
 	return (*surface_ == *(other->surface_) && *flux_ == *(other->flux_)
-	    && *energyDistribution_ == *(other->energyDistribution_));
+	    && *energyDistribution_ == *(other->energyDistribution_)
+	    && zenithRange_ == other->zenithRange_ && azimuthRange_ == other->azimuthRange_
+	    && threshold_ == other->threshold_);
+}
+
+uint64_t
+NaturalRateInjector::Hash() const
+{
+	return CacheKey("NaturalRateInjector").Add(surface_->Hash()).Add(flux_->Hash())
+	    .Add(energyDistribution_->Hash())
+	    .Add(zenithRange_.first).Add(zenithRange_.second)
+	    .Add(azimuthRange_.first).Add(azimuthRange_.second).Add(threshold_).GetValue();
 }
 
 void
@@ -104,52 +131,124 @@ NaturalRateInjector::SetFlux(FluxPtr p)
 	totalRate_ = NAN;
 }
 
+void
+NaturalRateInjector::SetZenithRange(double cosMin, double cosMax)
+{
+	if (!(cosMin >= 0 && cosMin < cosMax && cosMax <= 1))
+		log_fatal("Zenith range must satisfy 0 <= cosMin < cosMax <= 1");
+	zenithRange_ = std::make_pair(cosMin, cosMax);
+	totalRate_ = NAN;
+}
+
+void
+NaturalRateInjector::SetAzimuthRange(double min, double max)
+{
+	if (!(min >= 0 && min < max && max <= 2*M_PI))
+		log_fatal("Azimuth range must satisfy 0 <= min < max <= 2 pi");
+	azimuthRange_ = std::make_pair(min, max);
+	totalRate_ = NAN;
+}
+
+bool
+NaturalRateInjector::InRange(const I3Direction &dir) const
+{
+	const double ct = std::cos(dir.GetZenith()), az = dir.GetAzimuth();
+	return (ct >= zenithRange_.first && ct <= zenithRange_.second
+	    && az >= azimuthRange_.first && az <= azimuthRange_.second);
+}
+
+bool
+NaturalRateInjector::Covers(const BundleKinematics &kinematics) const
+{
+	return InRange(kinematics.GetAxis().GetDir());
+}
+
 void
 NaturalRateInjector::SetEnergyDistribution(EnergyDistributionPtr e)
 {
 	assert(e);
 	
-	double norm = e->Integrate(surface_->GetMinDepth(), 1., flux_->GetMinMultiplicity(), 0, 300, e->GetMin(), e->GetMax());
+	// Distributions renormalize themselves when their energy range is
+	// narrowed, so this should only fail for a broken parameterization
+	const double depth = surface_->GetMinDepth();
+	const unsigned m = flux_->GetMinMultiplicity();
+	CacheKey key("EnergyNorm");
+	key.Add(e).Add(depth).Add(m);
+	double norm = NormalizationCache::GetInstance().Get(key, [&]()
+	{
+		return e->Integrate(depth, 1., m, 0, 300, e->GetMin(), e->GetMax());
+	});
 	if (std::abs(norm-1) > 1e-1)
 		log_fatal_stream("The provided energy distribution is not normalized "
-		    "(integrates to "<<norm<<"). This could be because the minimum and "
-		    "maximum energies were changed from their defaults.");
+		    "(integrates to "<<norm<<").");
 	energyDistribution_ = e;
 }
 
 
+void
+NaturalRateInjector::SetMuonEnergyThreshold(double threshold)
+{
+	if (!(threshold >= 0))
+		log_fatal("Muon energy threshold must be >= 0");
+	threshold_ = threshold;
+}
+
+void
+NaturalRateInjector::Prepare() const
+{
+	GetTotalRate();
+}
+
 double
 NaturalRateInjector::GetTotalRate() const
 {
 	if (std::isnan(totalRate_) && surface_ && flux_) {
-		totalRate_ = 0;
-		for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++) {
-			totalRate_ += surface_->IntegrateFlux(boost::bind(boost::cref(*flux_), _1, _2, m));
-		}
+		CacheKey key("TotalRate");
+		key.Add(surface_).Add(flux_).Add(zenithRange_.first).Add(zenithRange_.second);
+		// The surface is azimuthally symmetric, so the azimuth range simply
+		// scales the rate
+		totalRate_ = NormalizationCache::GetInstance().Get(key, [this]()
+		{
+			double rate = 0;
+			for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++)
+				rate += surface_->IntegrateFlux(boost::bind(boost::cref(*flux_), _1, _2, m),
+				    zenithRange_.first, zenithRange_.second);
+			return rate;
+		})*(azimuthRange_.second-azimuthRange_.first)/(2*M_PI);
 	}
 	return totalRate_;
 }
 
 void
-NaturalRateInjector::GenerateAxis(I3RandomService &rng, std::pair<I3Particle, unsigned> &axis) const
+NaturalRateInjector::SampleAxis(I3RandomService &rng, I3Position &pos, I3Direction &dir, unsigned &m) const
 {
 	// Choose a direction and impact position from a uniform flux through
 	// the sampling surface, then pick a multiplicity. Accept zenith angles
 	// and multiplicities at a rate proportional to the flux at the chosen
 	// depth.
-	I3Direction dir;
-	I3Position pos;
-	unsigned m;
 	double flux;
-	// For any sane distribution the maximum flux is for single vertical muons
-	// at minimum depth
-	double maxflux = (*flux_)(surface_->GetMinDepth(), 1., flux_->GetMinMultiplicity());
-	do {
-		surface_->SampleImpactRay(pos, dir, rng);
+	// For any sane distribution the maximum flux is for single muons at
+	// minimum depth and the most vertical allowed zenith angle
+	double maxflux = (*flux_)(surface_->GetMinDepth(), zenithRange_.second, flux_->GetMinMultiplicity());
+	while (true) {
+		surface_->SampleImpactRay(pos, dir, rng, zenithRange_.first, zenithRange_.second);
+		if (!InRange(dir))
+			continue;
 		m = rng.Integer(flux_->GetMaxMultiplicity() - flux_->GetMinMultiplicity())
 		    + flux_->GetMinMultiplicity();
 		flux = (*flux_)(GetDepth(pos.GetZ()), cos(dir.GetZenith()), m);
-	} while (rng.Uniform(0., maxflux) > flux);
+		if (rng.Uniform(0., maxflux) <= flux)
+			break;
+	}
+}
+
+void
+NaturalRateInjector::GenerateAxis(I3RandomService &rng, std::pair<I3Particle, unsigned> &axis) const
+{
+	I3Direction dir;
+	I3Position pos;
+	unsigned m;
+	SampleAxis(rng, pos, dir, m);
 	
 	axis.first.SetPos(pos);
 	axis.first.SetDir(dir);
@@ -163,7 +262,7 @@ NaturalRateInjector::GenerateAxis(I3RandomService &rng, std::pair<I3Particle, un
 void
 NaturalRateInjector::FillMCTree(I3RandomService &rng,
     const std::pair<I3Particle, unsigned> &axis,
-    I3MCTree &mctree, BundleConfiguration &bundlespec) const
+    I3MCTree &mctree, BundleSpec &bundlespec) const
 {
 	const I3Particle &primary = axis.first;
 	I3MCTreeUtils::AddPrimary(mctree, primary);
@@ -172,8 +271,13 @@ NaturalRateInjector::FillMCTree(I3RandomService &rng,
 	
 	unsigned m = axis.second;
 	auto tracks = energyDistribution_->Generate(rng, h, coszen, m, m);
+	bundlespec.reserve(tracks.size());
 	for (auto &radius_energy : tracks) {
 		I3Particle track = CreateParallelTrack(radius_energy.first, rng.Uniform(0., 2*M_PI), *surface_, primary);
+		if (radius_energy.second < threshold_) {
+			bundlespec.push_back(BundleEntry(radius_energy.first, threshold_, true));
+			continue;
+		}
 		track.SetEnergy(radius_energy.second);
 		I3MCTreeUtils::AppendChild(mctree, primary, track);
 		bundlespec.push_back(BundleEntry(radius_energy.first, radius_energy.second));
@@ -181,32 +285,54 @@ NaturalRateInjector::FillMCTree(I3RandomService &rng,
 }
 
 void
-NaturalRateInjector::Generate(I3RandomService &rng, I3MCTree &mctree, BundleConfiguration &bundlespec) const
+NaturalRateInjector::Generate(I3RandomService &rng, I3MCTree &mctree, BundleSpec &bundlespec) const
 {
 	std::pair<I3Particle, unsigned> axis;
 	GenerateAxis(rng, axis);
 	FillMCTree(rng, axis, mctree, bundlespec);
 }
 
+void
+NaturalRateInjector::GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const
+{
+	I3Direction dir;
+	I3Position pos;
+	unsigned m;
+	for (size_t i=0; i < n; i++) {
+		SampleAxis(rng, pos, dir, m);
+		batch.AddBundle(pos, dir);
+		auto tracks = energyDistribution_->Generate(rng, GetDepth(pos.GetZ()), cos(dir.GetZenith()), m, m);
+		for (auto &radius_energy : tracks) {
+			// Draw (and discard) the azimuth about the axis so that the
+			// random sequence stays in step with Generate()
+			rng.Uniform(0., 2*M_PI);
+			batch.AddMuon(radius_energy.first, radius_energy.second);
+		}
+	}
+}
+
 double
-NaturalRateInjector::GetLogGenerationProbability(const I3Particle &axis,
-    const BundleConfiguration &bundlespec) const
+NaturalRateInjector::GetLogGenerationProbability(const BundleKinematics &kinematics) const
 {
-	std::pair<double, double> steps = surface_->GetIntersection(axis.GetPos(), axis.GetDir());
-	// This shower axis doesn't intersect the sampling surface. Bail.
-	if (!std::isfinite(steps.first))
+	const BundleSpec &bundlespec = kinematics.GetBundle();
+	// This shower axis doesn't intersect the sampling surface, or points
+	// in a direction we never generate. Bail.
+	if (!std::isfinite(kinematics.GetEntry(surface_)) || !InRange(kinematics.GetAxis().GetDir()))
 		return -std::numeric_limits<double>::infinity();
 	
-	double h = GetDepth(axis.GetPos().GetZ() + steps.first*axis.GetDir().GetZ());
-	double coszen = cos(axis.GetDir().GetZenith());
-	unsigned m = static_cast<unsigned>(bundlespec.size());
+	double h = kinematics.GetDepth(surface_);
+	double coszen = kinematics.GetCosZenith();
+	unsigned m = kinematics.GetMultiplicity();
 
 	// We used the flux to do rejection sampling in depth, zenith, and
 	// multiplicity. Evaluate the properly-normalized PDF here.
 	double logprob = flux_->GetLog(h, coszen, m) - std::log(GetTotalRate());
-	BOOST_FOREACH(const BundleEntry &track, bundlespec) {
-		logprob += energyDistribution_->GetLog(h, coszen, m, track.radius,
-		    EnergyDistribution::log_value(std::log(track.energy)));
+	for (unsigned i=0; i < m; i++) {
+		EnergyDistribution::log_value loge(kinematics.GetLogEnergy(i));
+		if (bundlespec.IsOmitted(i))
+			logprob += energyDistribution_->GetLogCumulative(h, coszen, m, bundlespec.GetRadius(i), loge);
+		else
+			logprob += energyDistribution_->GetLog(h, coszen, m, bundlespec.GetRadius(i), loge);
 	}
 	
 	return logprob;
@@ -38,10 +38,17 @@ public:
 	    EnergyDistributionPtr edist);
 	
 	// Generator Interface
-	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const;
+	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleSpec &bundle) const;
+	using Generator::Generate;
+	using Generator::GenerateBatch;
+	virtual void GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const;
 	virtual GenerationProbabilityPtr Clone() const;
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const;
-	virtual double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	virtual uint64_t Hash() const;
+	virtual bool Covers(const BundleKinematics &kinematics) const;
+	virtual void Prepare() const;
+	virtual double GetLogGenerationProbability(const BundleKinematics &kinematics) const;
+	using GenerationProbability::GetLogGenerationProbability;
 	virtual SamplingSurfaceConstPtr GetInjectionSurface() const { return surface_; }
 	
 	void SetSurface(SamplingSurfacePtr p);
@@ -50,9 +57,37 @@ public:
 	void SetFlux(FluxPtr p);
 	FluxPtr GetFlux() { return flux_; }
 	
+	/**
+	 * Only generate bundles whose axes have cos(zenith) in [cosMin, cosMax]
+	 * (default [0, 1])
+	 */
+	void SetZenithRange(double cosMin, double cosMax);
+	std::pair<double, double> GetZenithRange() const { return zenithRange_; }
+	/**
+	 * Only generate bundles whose axes have azimuth in [min, max]
+	 * (default [0, 2 pi])
+	 */
+	void SetAzimuthRange(double min, double max);
+	std::pair<double, double> GetAzimuthRange() const { return azimuthRange_; }
+	
+	/**
+	 * Set the distribution muon radii and energies are drawn from. Its
+	 * energy range may be narrowed (see EnergyDistribution::SetMin()), in
+	 * which case only bundles whose muons all fall inside the range are
+	 * generated.
+	 */
 	void SetEnergyDistribution(EnergyDistributionPtr e);
 	EnergyDistributionPtr GetEnergyDistribution() { return energyDistribution_; }
 	
+	/**
+	 * Omit muons with energies below *threshold* from the I3MCTree, so
+	 * that they never have to be propagated. They are still counted in the
+	 * bundle multiplicity, and are reported in the BundleSpec
+	 * with the omitted flag set and the threshold as their energy.
+	 */
+	void SetMuonEnergyThreshold(double threshold);
+	double GetMuonEnergyThreshold() const { return threshold_; }
+	
 	/**
 	 * Integrate the configured flux over the sampling surface, summing over
 	 * all allowed multiplicities.
@@ -68,11 +103,19 @@ protected:
 	 * The shower axis and multiplcity are filled into the *axis*
 	 */
 	void GenerateAxis(I3RandomService &rng, std::pair<I3Particle, unsigned> &axis) const;
+	/**
+	 * Draw an impact point, direction, and multiplicity without
+	 * filling them into an I3Particle
+	 */
+	void SampleAxis(I3RandomService &rng, I3Position &pos, I3Direction &dir, unsigned &m) const;
 	/**
 	 * Distribute the given number of muons in the transverse plane
 	 * and draw an energy for each
 	 */
-	void FillMCTree(I3RandomService &rng, const std::pair<I3Particle, unsigned> &axis, I3MCTree &, BundleConfiguration &) const;
+	void FillMCTree(I3RandomService &rng, const std::pair<I3Particle, unsigned> &axis, I3MCTree &, BundleSpec &) const;
+	
+	/** Is the direction inside the configured zenith and azimuth ranges? */
+	bool InRange(const I3Direction &dir) const;
 
 private:
 	friend class icecube::serialization::access;
@@ -85,12 +128,14 @@ protected:
 	EnergyDistributionPtr energyDistribution_;
 	
 	mutable double totalRate_;
+	std::pair<double, double> zenithRange_, azimuthRange_;
+	double threshold_;
 
 };
 
 }
 
-I3_CLASS_VERSION(I3MuonGun::NaturalRateInjector, 0);
+I3_CLASS_VERSION(I3MuonGun::NaturalRateInjector, 2);
 
 #endif
 
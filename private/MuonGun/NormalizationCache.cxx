@@ -0,0 +1,184 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/NormalizationCache.h>
+#include <icetray/I3Logging.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+namespace I3MuonGun {
+
+namespace {
+
+// 64-bit FNV-1a. Unlike std::hash, this is guaranteed to give the same
+// answer in every process, which is what makes the on-disk cache work.
+const uint64_t fnv_offset = 14695981039346656037ULL;
+const uint64_t fnv_prime = 1099511628211ULL;
+
+}
+
+CacheKey::CacheKey(const std::string &tag) : hash_(fnv_offset)
+{
+	Add(tag);
+}
+
+CacheKey&
+CacheKey::Add(const void *data, size_t size)
+{
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+	for (size_t i=0; i < size; i++) {
+		hash_ ^= bytes[i];
+		hash_ *= fnv_prime;
+	}
+
+	return *this;
+}
+
+CacheKey&
+CacheKey::Add(const std::string &bytes)
+{
+	uint64_t size = bytes.size();
+	Add(&size, sizeof(size));
+	return Add(bytes.data(), bytes.size());
+}
+
+CacheKey&
+CacheKey::Add(double value)
+{
+	// -0 == 0, so they must hash the same
+	if (value == 0)
+		value = 0;
+	return Add(&value, sizeof(value));
+}
+
+CacheKey&
+CacheKey::Add(unsigned value)
+{
+	return Add(&value, sizeof(value));
+}
+
+CacheKey&
+CacheKey::Add(uint64_t value)
+{
+	return Add(&value, sizeof(value));
+}
+
+NormalizationCache::NormalizationCache()
+{
+	if (const char *dir = getenv("MUONGUN_NORMALIZATION_CACHE"))
+		directory_ = dir;
+}
+
+NormalizationCache&
+NormalizationCache::GetInstance()
+{
+	static NormalizationCache instance;
+	return instance;
+}
+
+void
+NormalizationCache::SetDirectory(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	directory_ = path;
+}
+
+std::string
+NormalizationCache::GetDirectory() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return directory_;
+}
+
+void
+NormalizationCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	values_.clear();
+}
+
+std::string
+NormalizationCache::GetPath(const std::string &directory, CacheKey::value_type key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.norm", (unsigned long long)key);
+	return directory + "/" + name;
+}
+
+bool
+NormalizationCache::Load(const std::string &directory, CacheKey::value_type key, double &value)
+{
+	std::ifstream f(GetPath(directory, key).c_str());
+	std::string repr;
+	if (!(f >> repr))
+		return false;
+	// Values are stored as hexadecimal floats, so they round-trip exactly
+	char *end;
+	value = strtod(repr.c_str(), &end);
+	return (*end == '\0');
+}
+
+void
+NormalizationCache::Store(const std::string &directory, CacheKey::value_type key, double value)
+{
+	// Write to a temporary file and move it into place so that concurrent
+	// jobs (or threads) sharing a cache directory never see a partially
+	// written entry.
+	std::string path = GetPath(directory, key);
+	std::ostringstream tmp;
+	tmp << path << "." << getpid() << "." << std::this_thread::get_id() << ".tmp";
+	{
+		FILE *f = fopen(tmp.str().c_str(), "w");
+		if (!f) {
+			log_warn("Can't write to normalization cache '%s'", directory.c_str());
+			return;
+		}
+		fprintf(f, "%a\n", value);
+		fclose(f);
+	}
+	if (rename(tmp.str().c_str(), path.c_str()) != 0) {
+		log_warn("Can't write to normalization cache '%s'", directory.c_str());
+		remove(tmp.str().c_str());
+	}
+}
+
+double
+NormalizationCache::Get(const CacheKey &key, boost::function<double ()> compute)
+{
+	const CacheKey::value_type k = key.GetValue();
+	std::string directory;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::map<CacheKey::value_type, double>::const_iterator it = values_.find(k);
+		if (it != values_.end())
+			return it->second;
+		directory = directory_;
+	}
+
+	// Touch the disk and integrate without holding the lock; at worst the
+	// same value is computed (and stored) twice.
+	double value;
+	bool found = !directory.empty() && Load(directory, k, value);
+	if (!found)
+		value = compute();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		values_[k] = value;
+	}
+	if (!found && !directory.empty() && std::isfinite(value))
+		Store(directory, k, value);
+
+	return value;
+}
+
+}
@@ -0,0 +1,115 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_NORMALIZATIONCACHE_H_INCLUDED
+#define I3MUONGUN_NORMALIZATIONCACHE_H_INCLUDED
+
+#include <icetray/serialization.h>
+#include <archive/portable_binary_archive.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/type_traits/remove_const.hpp>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <sstream>
+#include <stdint.h>
+
+namespace I3MuonGun {
+
+/**
+ * @brief A content hash identifying the inputs to a normalization integral
+ *
+ * Objects are hashed via their serialized representation, so two
+ * generators that were configured identically (or deserialized from the
+ * same frame) produce the same key in any process.
+ */
+class CacheKey {
+public:
+	typedef uint64_t value_type;
+
+	/** @param[in] tag the name of the quantity being computed */
+	explicit CacheKey(const std::string &tag);
+
+	/** Mix in the serialized representation of an object */
+	template <typename T>
+	CacheKey& Add(const boost::shared_ptr<T> &object)
+	{
+		typedef typename boost::remove_const<T>::type U;
+		boost::shared_ptr<U> p = boost::const_pointer_cast<U>(object);
+		std::ostringstream buf;
+		Serialize(buf, p);
+		return Add(buf.str());
+	}
+	CacheKey& Add(const std::string &bytes);
+	CacheKey& Add(double value);
+	CacheKey& Add(unsigned value);
+	CacheKey& Add(uint64_t value);
+	CacheKey& Add(const void *data, size_t size);
+
+	value_type GetValue() const { return hash_; }
+private:
+	template <typename T>
+	static void Serialize(std::ostream &, const boost::shared_ptr<T> &);
+
+	value_type hash_;
+};
+
+template <typename T>
+void
+CacheKey::Serialize(std::ostream &os, const boost::shared_ptr<T> &object)
+{
+	icecube::archive::portable_binary_oarchive ar(os);
+	ar << icecube::serialization::make_nvp("Object", object);
+}
+
+/**
+ * @brief A process-wide cache of expensive normalization integrals
+ *
+ * Generators that need to integrate their flux or energy distribution
+ * look up the result here before doing the work. Results are kept in
+ * memory for the lifetime of the process, and if a cache directory is set
+ * (either with SetDirectory() or via the MUONGUN_NORMALIZATION_CACHE
+ * environment variable) also written to disk, so that e.g. weighting jobs
+ * that deserialize the same generator do not have to repeat the integration.
+ */
+class NormalizationCache {
+public:
+	static NormalizationCache& GetInstance();
+
+	/**
+	 * @brief Look up a cached value
+	 *
+	 * @param[in] key     content hash of the inputs
+	 * @param[in] compute function that calculates the value on a cache miss
+	 */
+	double Get(const CacheKey &key, boost::function<double ()> compute);
+
+	/** Persist cached values in the given directory (empty to disable) */
+	void SetDirectory(const std::string &path);
+	std::string GetDirectory() const;
+
+	/** Forget all values held in memory */
+	void Clear();
+private:
+	NormalizationCache();
+	NormalizationCache(const NormalizationCache&);
+
+	static std::string GetPath(const std::string &directory, CacheKey::value_type);
+	static bool Load(const std::string &directory, CacheKey::value_type, double &);
+	static void Store(const std::string &directory, CacheKey::value_type, double);
+
+	mutable std::mutex mutex_;
+	std::map<CacheKey::value_type, double> values_;
+	std::string directory_;
+};
+
+}
+
+#endif // I3MUONGUN_NORMALIZATIONCACHE_H_INCLUDED
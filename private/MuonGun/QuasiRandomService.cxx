@@ -0,0 +1,284 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/QuasiRandomService.h>
+#include <dataclasses/physics/I3MCTree.h>
+#include <dataclasses/physics/I3MCTreeUtils.h>
+
+#include <cmath>
+
+namespace I3MuonGun {
+
+namespace {
+
+const unsigned bits = 32;
+
+// Primitive polynomials and initial direction numbers for dimensions 2-21,
+// from S. Joe and F. Y. Kuo, "Constructing Sobol sequences with better
+// two-dimensional projections", SIAM J. Sci. Comput. 30, 2635 (2008)
+// (new-joe-kuo-6.21201). Each row is the degree s, the coefficients a, and
+// s initial values m_i.
+struct sobol_init {
+	unsigned s, a;
+	unsigned m[7];
+};
+
+const sobol_init joe_kuo[] = {
+	{1,  0, {1}},
+	{2,  1, {1, 3}},
+	{3,  1, {1, 3, 1}},
+	{3,  2, {1, 1, 1}},
+	{4,  1, {1, 1, 3, 3}},
+	{4,  4, {1, 3, 5, 13}},
+	{5,  2, {1, 1, 5, 5, 17}},
+	{5,  4, {1, 1, 5, 5, 5}},
+	{5,  7, {1, 1, 7, 11, 19}},
+	{5, 11, {1, 1, 5, 1, 1}},
+	{5, 13, {1, 1, 1, 3, 11}},
+	{5, 14, {1, 3, 5, 5, 31}},
+	{6,  1, {1, 3, 3, 9, 7, 49}},
+	{6, 13, {1, 1, 1, 15, 21, 21}},
+	{6, 16, {1, 3, 1, 13, 27, 49}},
+	{6, 19, {1, 1, 1, 15, 7, 5}},
+	{6, 22, {1, 3, 1, 15, 13, 25}},
+	{6, 25, {1, 1, 5, 5, 19, 61}},
+	{7,  1, {1, 3, 7, 11, 23, 15, 103}},
+	{7,  4, {1, 3, 7, 13, 13, 15, 69}},
+};
+
+std::vector<uint32_t>
+direction_numbers(unsigned dim)
+{
+	std::vector<uint32_t> v(bits);
+	if (dim == 0) {
+		// van der Corput sequence
+		for (unsigned j=0; j < bits; j++)
+			v[j] = uint32_t(1) << (bits-1-j);
+		return v;
+	}
+	const sobol_init &init = joe_kuo[dim-1];
+	const unsigned s = init.s;
+	for (unsigned j=0; j < s && j < bits; j++)
+		v[j] = init.m[j] << (bits-1-j);
+	for (unsigned j=s; j < bits; j++) {
+		v[j] = v[j-s] ^ (v[j-s] >> s);
+		for (unsigned k=1; k < s; k++)
+			if ((init.a >> (s-1-k)) & 1)
+				v[j] ^= v[j-k];
+	}
+	return v;
+}
+
+inline unsigned
+parity(uint32_t x)
+{
+	x ^= x >> 16;
+	x ^= x >> 8;
+	x ^= x >> 4;
+	x ^= x >> 2;
+	x ^= x >> 1;
+	return x & 1;
+}
+
+inline uint32_t
+random_bits(I3RandomService &rng)
+{
+	// Two draws, since Integer() can't return all 32 bits at once
+	return (uint32_t(rng.Integer(1u << 16)) << 16) | uint32_t(rng.Integer(1u << 16));
+}
+
+}
+
+unsigned
+QuasiRandomService::GetMaxDimensions()
+{
+	return 1 + sizeof(joe_kuo)/sizeof(joe_kuo[0]);
+}
+
+QuasiRandomService::QuasiRandomService(unsigned dimensions, I3RandomServicePtr rng)
+    : rng_(rng), index_(0), coordinate_(dimensions)
+{
+	if (!rng_)
+		log_fatal("QuasiRandomService needs a pseudo-random service");
+	if (dimensions == 0 || dimensions > GetMaxDimensions())
+		log_fatal("Number of dimensions must be between 1 and %u", GetMaxDimensions());
+	
+	for (unsigned d=0; d < dimensions; d++) {
+		std::vector<uint32_t> v = direction_numbers(d);
+		// Linear matrix scramble: digit k of the output is digit k of the
+		// input plus a random combination of the more significant digits.
+		// This is a random lower-triangular matrix with a unit diagonal,
+		// so the result is still a (t,s)-sequence.
+		std::vector<uint32_t> rows(bits);
+		for (unsigned k=0; k < bits; k++) {
+			uint32_t self = uint32_t(1) << (bits-1-k);
+			uint32_t above = ~((self << 1) - 1);
+			rows[k] = self | (random_bits(*rng_) & above);
+		}
+		for (unsigned j=0; j < bits; j++) {
+			uint32_t scrambled = 0;
+			for (unsigned k=0; k < bits; k++)
+				scrambled |= parity(rows[k] & v[j]) << (bits-1-k);
+			v[j] = scrambled;
+		}
+		directions_.push_back(v);
+		shift_.push_back(random_bits(*rng_));
+	}
+	point_ = shift_;
+}
+
+QuasiRandomService::~QuasiRandomService() {}
+
+void
+QuasiRandomService::SetPoint(uint64_t index)
+{
+	// The i-th point in Gray-code order is the XOR of the direction numbers
+	// for the set bits of i ^ (i >> 1)
+	const uint64_t gray = index ^ (index >> 1);
+	for (unsigned d=0; d < directions_.size(); d++) {
+		uint32_t x = shift_[d];
+		for (unsigned j=0; j < bits; j++)
+			if ((gray >> j) & 1)
+				x ^= directions_[d][j];
+		point_[d] = x;
+	}
+	index_ = index+1;
+	coordinate_ = 0;
+}
+
+void
+QuasiRandomService::NextPoint()
+{
+	if (index_ == 0) {
+		SetPoint(0);
+		return;
+	}
+	// Consecutive Gray codes differ in the lowest zero bit of the
+	// previous index
+	uint64_t n = index_-1;
+	unsigned c = 0;
+	while (n & 1) {
+		n >>= 1;
+		c++;
+	}
+	if (c >= bits)
+		log_fatal("Exhausted the Sobol sequence");
+	for (unsigned d=0; d < directions_.size(); d++)
+		point_[d] ^= directions_[d][c];
+	index_++;
+	coordinate_ = 0;
+}
+
+double
+QuasiRandomService::NextCoordinate()
+{
+	if (coordinate_ < point_.size())
+		// Center in the cell so that the result is in (0,1)
+		return (double(point_[coordinate_++]) + 0.5)/4294967296.;
+	else
+		return rng_->Uniform();
+}
+
+double
+QuasiRandomService::Uniform(double x1)
+{
+	return x1*NextCoordinate();
+}
+
+double
+QuasiRandomService::Uniform(double x1, double x2)
+{
+	return x1 + (x2-x1)*NextCoordinate();
+}
+
+unsigned int
+QuasiRandomService::Integer(unsigned int imax)
+{
+	return std::min(unsigned(imax*NextCoordinate()), imax-1);
+}
+
+double
+QuasiRandomService::Exp(double tau)
+{
+	return -tau*std::log(NextCoordinate());
+}
+
+int
+QuasiRandomService::Binomial(int ntot, double prob)
+{
+	return rng_->Binomial(ntot, prob);
+}
+
+int
+QuasiRandomService::Poisson(double mean)
+{
+	return rng_->Poisson(mean);
+}
+
+double
+QuasiRandomService::PoissonD(double mean)
+{
+	return rng_->PoissonD(mean);
+}
+
+double
+QuasiRandomService::Gaus(double mean, double stddev)
+{
+	return rng_->Gaus(mean, stddev);
+}
+
+I3FrameObjectPtr
+QuasiRandomService::GetState() const
+{
+	return rng_->GetState();
+}
+
+void
+QuasiRandomService::RestoreState(I3FrameObjectConstPtr state)
+{
+	rng_->RestoreState(state);
+}
+
+RQMCEstimate
+EstimateRQMC(const Generator &generator,
+    boost::function<double (const I3Particle&, const BundleSpec&)> f,
+    size_t points, unsigned scrambles, unsigned dimensions, I3RandomServicePtr rng)
+{
+	if (scrambles < 2)
+		log_fatal("Need at least 2 scrambles to estimate an error");
+	if (points == 0)
+		log_fatal("Need at least 1 point per scramble");
+	
+	std::vector<double> means;
+	for (unsigned s=0; s < scrambles; s++) {
+		QuasiRandomService qrng(dimensions, rng);
+		double sum = 0;
+		for (size_t i=0; i < points; i++) {
+			I3MCTree mctree;
+			BundleSpec bundlespec;
+			qrng.NextPoint();
+			generator.Generate(qrng, mctree, bundlespec);
+			sum += f(*I3MCTreeUtils::GetPrimaries(mctree).begin(), bundlespec);
+		}
+		means.push_back(sum/points);
+	}
+	
+	RQMCEstimate estimate;
+	estimate.mean = 0;
+	for (unsigned s=0; s < scrambles; s++)
+		estimate.mean += means[s];
+	estimate.mean /= scrambles;
+	double var = 0;
+	for (unsigned s=0; s < scrambles; s++)
+		var += (means[s]-estimate.mean)*(means[s]-estimate.mean);
+	estimate.error = std::sqrt(var/(scrambles-1)/scrambles);
+	
+	return estimate;
+}
+
+}
@@ -0,0 +1,114 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_QUASIRANDOMSERVICE_H_INCLUDED
+#define I3MUONGUN_QUASIRANDOMSERVICE_H_INCLUDED
+
+#include <MuonGun/Generator.h>
+#include <phys-services/I3RandomService.h>
+#include <boost/function.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+namespace I3MuonGun {
+
+/**
+ * @brief A randomized quasi-Monte Carlo sequence
+ *
+ * QuasiRandomService hands out the coordinates of one point of a scrambled
+ * Sobol sequence (Joe & Kuo direction numbers, with a random linear matrix
+ * scramble and digital shift) per event. Call NextPoint() before generating
+ * each event; the first *dimensions* calls to Uniform() or Integer() then
+ * return successive coordinates of that point, and anything beyond that is
+ * drawn from the pseudo-random fallback service.
+ *
+ * Since each scrambled point is uniformly distributed on the unit
+ * hypercube, every event is an exact sample from the generator's
+ * distribution; only the correlations between events change. Estimates
+ * made from one scramble converge faster than with pseudo-random numbers
+ * for smooth integrands, but their error can only be estimated by repeating
+ * them with independent scrambles (see EstimateRQMC()).
+ *
+ * For Floodlight, the coordinates are used for zenith, azimuth,
+ * impact position, and energy, in that order. Rejection steps (e.g. in
+ * StaticSurfaceInjector) consume extra coordinates, so give a few more
+ * dimensions than the generator needs in the best case.
+ */
+class QuasiRandomService : public I3RandomService {
+public:
+	/**
+	 * @param[in] dimensions number of coordinates per point (at most
+	 *                       GetMaxDimensions())
+	 * @param[in] rng        pseudo-random service used to choose the
+	 *                       scramble and to supply any further numbers
+	 */
+	QuasiRandomService(unsigned dimensions, I3RandomServicePtr rng);
+	virtual ~QuasiRandomService();
+	
+	/** @brief Advance to the next point of the sequence */
+	void NextPoint();
+	/** @brief Jump to the given point of the sequence */
+	void SetPoint(uint64_t index);
+	
+	unsigned GetDimensions() const { return unsigned(directions_.size()); }
+	static unsigned GetMaxDimensions();
+	
+	virtual double Uniform(double x1 = 1);
+	virtual double Uniform(double x1, double x2);
+	virtual unsigned int Integer(unsigned int imax);
+	virtual double Exp(double tau);
+	
+	// These draw from the fallback service
+	virtual int Binomial(int ntot, double prob);
+	virtual int Poisson(double mean);
+	virtual double PoissonD(double mean);
+	virtual double Gaus(double mean, double stddev);
+	
+	/** @returns the state of the fallback service */
+	virtual I3FrameObjectPtr GetState() const;
+	virtual void RestoreState(I3FrameObjectConstPtr state);
+private:
+	double NextCoordinate();
+	
+	I3RandomServicePtr rng_;
+	std::vector<std::vector<uint32_t> > directions_;
+	std::vector<uint32_t> shift_, point_;
+	uint64_t index_;
+	unsigned coordinate_;
+};
+
+I3_POINTER_TYPEDEFS(QuasiRandomService);
+
+/** @brief A randomized quasi-Monte Carlo estimate and its standard error */
+struct RQMCEstimate {
+	double mean, error;
+};
+
+/**
+ * @brief Estimate the mean of a function over a generator's distribution
+ *
+ * Draw *points* events with each of *scrambles* independently scrambled
+ * Sobol sequences, and average *f* over each. The spread between the
+ * scrambles gives the error of the combined mean.
+ *
+ * @param[in] generator  the distribution to sample from
+ * @param[in] f          function of the bundle axis and configuration
+ * @param[in] points     number of points per scramble (ideally a power of 2)
+ * @param[in] scrambles  number of independent scrambles (at least 2)
+ * @param[in] dimensions number of quasi-random coordinates per event
+ * @param[in] rng        pseudo-random service for the scrambles and any
+ *                       coordinates beyond *dimensions*
+ */
+RQMCEstimate EstimateRQMC(const Generator &generator,
+    boost::function<double (const I3Particle&, const BundleSpec&)> f,
+    size_t points, unsigned scrambles, unsigned dimensions, I3RandomServicePtr rng);
+
+}
+
+#endif // I3MUONGUN_QUASIRANDOMSERVICE_H_INCLUDED
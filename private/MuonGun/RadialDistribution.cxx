@@ -7,6 +7,7 @@
  */
 
 #include <MuonGun/RadialDistribution.h>
+#include <MuonGun/NormalizationCache.h>
 #include <phys-services/I3RandomService.h>
 #include <icetray/I3Units.h>
 
@@ -14,6 +15,12 @@ namespace I3MuonGun {
 
 RadialDistribution::~RadialDistribution() {}
 
+uint64_t
+RadialDistribution::Hash() const
+{
+	return CacheKey("RadialDistribution").GetValue();
+}
+
 double
 RadialDistribution::operator()(double depth, double cos_theta,
     unsigned N, double radius) const
@@ -97,6 +104,12 @@ BMSSRadialDistribution::operator==(const RadialDistribution &o) const
 	return dynamic_cast<const BMSSRadialDistribution*>(&o);
 }
 
+uint64_t
+BMSSRadialDistribution::Hash() const
+{
+	return CacheKey("BMSSRadialDistribution").GetValue();
+}
+
 SplineRadialDistribution::SplineRadialDistribution(const std::string &path)
     : spline_(path) {}
 
@@ -147,6 +160,12 @@ SplineRadialDistribution::operator==(const RadialDistribution &o) const
 		return (spline_ == other->spline_);
 }
 
+uint64_t
+SplineRadialDistribution::Hash() const
+{
+	return CacheKey("SplineRadialDistribution").Add(spline_.Hash()).GetValue();
+}
+
 template <typename Archive>
 void
 RadialDistribution::serialize(Archive &ar __attribute__((unused)), unsigned __attribute__((unused)))
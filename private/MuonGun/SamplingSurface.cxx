@@ -7,6 +7,7 @@
  */
 
 #include <MuonGun/SamplingSurface.h>
+#include <MuonGun/NormalizationCache.h>
 #include <icetray/I3Logging.h>
 
 namespace I3MuonGun {
@@ -23,6 +24,12 @@ SamplingSurface::serialize(Archive &ar, unsigned version)
 
 SamplingSurface::~SamplingSurface() {}
 
+uint64_t
+SamplingSurface::Hash() const
+{
+	return CacheKey("SamplingSurface").GetValue();
+}
+
 }
 
 I3_SERIALIZABLE(I3MuonGun::SamplingSurface);
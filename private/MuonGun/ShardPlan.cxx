@@ -0,0 +1,97 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/ShardPlan.h>
+#include <icetray/I3Logging.h>
+
+#include <boost/foreach.hpp>
+
+namespace I3MuonGun {
+
+namespace {
+
+// SplitMix64 finalizer, used to decorrelate the per-shard seeds
+uint64_t
+mix(uint64_t z)
+{
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+}
+
+ShardPlan::ShardPlan(GenerationProbabilityConstPtr generator, uint64_t numEvents,
+    unsigned numShards, uint32_t seed) : generator_(generator), numEvents_(numEvents)
+{
+	if (!generator_)
+		log_fatal("No generator given");
+	if (numShards == 0)
+		log_fatal("Need at least one shard");
+	
+	// The first (numEvents % numShards) shards get one extra event
+	const uint64_t base = numEvents/numShards, extra = numEvents % numShards;
+	uint64_t first = 0;
+	for (unsigned i=0; i < numShards; i++) {
+		Shard shard;
+		shard.index = i;
+		shard.firstEvent = first;
+		shard.numEvents = base + (i < extra ? 1 : 0);
+		shard.seed = uint32_t(mix(mix(seed) ^ i));
+		shards_.push_back(shard);
+		first += shard.numEvents;
+	}
+}
+
+const Shard&
+ShardPlan::GetShard(unsigned index) const
+{
+	if (index >= shards_.size())
+		log_fatal("Shard %u is out of range (the plan has %zu)", index, shards_.size());
+	return shards_[index];
+}
+
+GenerationProbabilityPtr
+ShardPlan::GetGenerator(unsigned index) const
+{
+	GenerationProbabilityPtr generator = generator_->Clone();
+	generator->SetTotalEvents(double(GetShard(index).numEvents));
+	
+	return generator;
+}
+
+GenerationProbabilityPtr
+ShardPlan::GetCombined(const std::vector<unsigned> &indices) const
+{
+	std::vector<bool> seen(shards_.size(), false);
+	uint64_t numEvents = 0;
+	BOOST_FOREACH(unsigned i, indices) {
+		const Shard &shard = GetShard(i);
+		if (seen[i])
+			log_fatal("Shard %u appears more than once", i);
+		seen[i] = true;
+		numEvents += shard.numEvents;
+	}
+	
+	GenerationProbabilityPtr generator = generator_->Clone();
+	generator->SetTotalEvents(double(numEvents));
+	
+	return generator;
+}
+
+GenerationProbabilityPtr
+ShardPlan::GetCombined() const
+{
+	GenerationProbabilityPtr generator = generator_->Clone();
+	generator->SetTotalEvents(double(numEvents_));
+	
+	return generator;
+}
+
+}
@@ -0,0 +1,80 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_SHARDPLAN_H_INCLUDED
+#define I3MUONGUN_SHARDPLAN_H_INCLUDED
+
+#include <MuonGun/Generator.h>
+
+#include <vector>
+#include <stdint.h>
+
+namespace I3MuonGun {
+
+/**
+ * @brief One job's share of a generation campaign
+ */
+struct Shard {
+	/** Position of the shard in the campaign */
+	unsigned index;
+	/**
+	 * Index of the first event in the campaign. Pass this as FirstEvent
+	 * to GeneratorModule with EventRandomStreams=True to make the shard
+	 * part of one reproducible campaign-wide sequence.
+	 */
+	uint64_t firstEvent;
+	/** Number of events to generate */
+	uint64_t numEvents;
+	/** Seed for a conventional random number service */
+	uint32_t seed;
+};
+
+/**
+ * @brief Deterministically divide a generation campaign into jobs
+ *
+ * Events are split as evenly as possible, and each shard's position in the
+ * campaign depends only on the total number of events, the number of shards,
+ * and the base seed, so the plan can be recomputed anywhere. Since all
+ * shards draw from the same distribution, the generation probability for any
+ * subset of them is simply the distribution scaled to the number of events
+ * in those shards.
+ */
+class ShardPlan {
+public:
+	/**
+	 * @param[in] generator distribution to draw from (the number of events
+	 *                      it was scaled to is ignored)
+	 * @param[in] numEvents total number of events in the campaign
+	 * @param[in] numShards number of jobs to split the campaign into
+	 * @param[in] seed      base seed from which per-shard seeds are derived
+	 */
+	ShardPlan(GenerationProbabilityConstPtr generator, uint64_t numEvents,
+	    unsigned numShards, uint32_t seed=0);
+	
+	size_t GetNumShards() const { return shards_.size(); }
+	uint64_t GetTotalEvents() const { return numEvents_; }
+	const Shard& GetShard(unsigned index) const;
+	
+	/** @brief Get the distribution to generate shard *index* from */
+	GenerationProbabilityPtr GetGenerator(unsigned index) const;
+	/**
+	 * @brief Get the combined generation probability for the given shards,
+	 *        e.g. the ones that have finished so far
+	 */
+	GenerationProbabilityPtr GetCombined(const std::vector<unsigned> &indices) const;
+	/** @brief Get the generation probability for the full campaign */
+	GenerationProbabilityPtr GetCombined() const;
+private:
+	GenerationProbabilityConstPtr generator_;
+	uint64_t numEvents_;
+	std::vector<Shard> shards_;
+};
+
+}
+
+#endif // I3MUONGUN_SHARDPLAN_H_INCLUDED
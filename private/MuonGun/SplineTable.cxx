@@ -1,8 +1,10 @@
 #include <cerrno>
 #include <stdexcept>
 #include <MuonGun/SplineTable.h>
+#include <MuonGun/NormalizationCache.h>
 #include <icetray/I3Logging.h>
 #include <serialization/binary_object.hpp>
+#include <boost/container/small_vector.hpp>
 
 extern "C" {
 	#include <photospline/bspline.h>
@@ -13,6 +15,7 @@ namespace I3MuonGun {
 SplineTable::SplineTable() : bias_(0)
 {
   memset(&table_, 0, sizeof(struct splinetable));
+  UpdateHash();
 }
 
 SplineTable::SplineTable(const std::string &path)
@@ -21,6 +24,24 @@ SplineTable::SplineTable(const std::string &path)
 		throw std::runtime_error("Couldn't read spline table " + path);
 	if (splinetable_read_key(&table_, SPLINETABLE_DOUBLE, "BIAS", &bias_))
 		bias_ = 0;
+	UpdateHash();
+}
+
+void
+SplineTable::UpdateHash()
+{
+	CacheKey key("SplineTable");
+	key.Add(bias_).Add(unsigned(table_.ndim));
+	size_t size = 1;
+	for (int i=0; i < table_.ndim; i++) {
+		key.Add(unsigned(table_.order[i])).Add(unsigned(table_.nknots[i]))
+		    .Add(table_.extents[i][0]).Add(table_.extents[i][1])
+		    .Add(unsigned(table_.naxes[i]));
+		size *= size_t(table_.naxes[i]);
+	}
+	if (table_.ndim > 0)
+		key.Add(table_.coefficients, size*sizeof(*table_.coefficients));
+	hash_ = key.GetValue();
 }
 
 SplineTable::~SplineTable()
@@ -31,7 +52,8 @@ SplineTable::~SplineTable()
 bool
 SplineTable::operator==(const SplineTable &other) const
 {
-	if (bias_ != other.bias_)
+	// Tables with different hashes certainly differ
+	if (hash_ != other.hash_ || bias_ != other.bias_)
 		return false;
 	// Same dimensions
 	if (table_.ndim != other.table_.ndim)
@@ -62,7 +84,9 @@ SplineTable::operator==(const SplineTable &other) const
 int
 SplineTable::Eval(double *coordinates, double *result) const
 {
-	std::vector<int> centers(unsigned(table_.ndim));
+	// Tables have few enough dimensions that the centers fit on the stack;
+	// this is called for every muon we weight.
+	boost::container::small_vector<int, 8> centers(unsigned(table_.ndim));
 	
 	if (tablesearchcenters(&table_, coordinates, &centers[0]) == 0)
 		*result = ndsplineeval(&table_, coordinates, &centers[0], 0);
@@ -115,6 +139,7 @@ SplineTable::load(Archive &ar, unsigned version)
 	ar & make_nvp("FITSFile", icecube::serialization::make_binary_object(buf.data, buf.size));
 	readsplinefitstable_mem(&buf, &table_);
 	free(buf.data);
+	UpdateHash();
 }
 
 }
@@ -3,6 +3,7 @@
 #define MUONGUN_SPLINETABLE_H_INCLUDED
 
 #include <string>
+#include <stdint.h>
 
 extern "C" {
 	#include <photospline/splinetable.h>
@@ -55,9 +56,17 @@ public:
 	
 	/** @brief Deep comparison */
 	bool operator==(const SplineTable &) const;
+	/**
+	 * @brief A hash of everything operator== compares, calculated once
+	 *        when the table is read
+	 */
+	uint64_t Hash() const { return hash_; }
 private:
+	void UpdateHash();
+	
 	struct splinetable table_;
 	double bias_;
+	uint64_t hash_;
 	
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -9,6 +9,7 @@
 #include <MuonGun/I3MuonGun.h>
 #include <MuonGun/StaticSurfaceInjector.h>
 #include <MuonGun/Cylinder.h>
+#include <MuonGun/NormalizationCache.h>
 #include <dataclasses/I3Constants.h>
 
 #include <boost/bind.hpp>
@@ -39,7 +40,7 @@ template <typename Archive>
 void
 StaticSurfaceInjector::serialize(Archive &ar, unsigned version)
 {
-	if (version > 1)
+	if (version > 5)
 		log_fatal_stream("Version "<<version<<" is from the future");
 	
 	ar & make_nvp("Generator", base_object<Generator>(*this));
@@ -52,12 +53,32 @@ StaticSurfaceInjector::serialize(Archive &ar, unsigned version)
 	}
 	ar & make_nvp("Flux", flux_);
 	ar & make_nvp("EnergySpectrum", energyGenerator_);
+	if (version > 2)
+		ar & make_nvp("EnergyProposal", energyProposal_);
 	ar & make_nvp("RadialDistribution", radialDistribution_);
 	ar & make_nvp("MaxFlux", maxFlux_);
 	ar & make_nvp("TotalRate", totalRate_);
+	if (version > 1)
+		ar & make_nvp("ZenithNorm", zenithNorm_);
+	else
+		zenithNorm_ = NAN;
+	if (version > 3) {
+		ar & make_nvp("CosZenithMin", zenithRange_.first);
+		ar & make_nvp("CosZenithMax", zenithRange_.second);
+		ar & make_nvp("AzimuthMin", azimuthRange_.first);
+		ar & make_nvp("AzimuthMax", azimuthRange_.second);
+	} else {
+		zenithRange_ = std::make_pair(0., 1.);
+		azimuthRange_ = std::make_pair(0., 2*M_PI);
+	}
+	if (version > 4)
+		ar & make_nvp("MuonEnergyThreshold", threshold_);
+	else
+		threshold_ = 0.;
 }
 
 StaticSurfaceInjector::StaticSurfaceInjector()
+    : zenithRange_(0., 1.), azimuthRange_(0., 2*M_PI), threshold_(0.)
 {
 	SetSurface(boost::make_shared<Cylinder>(1600, 800));
 	
@@ -76,6 +97,7 @@ StaticSurfaceInjector::StaticSurfaceInjector()
 
 StaticSurfaceInjector::StaticSurfaceInjector(SamplingSurfacePtr surface, FluxPtr flux,
     boost::shared_ptr<OffsetPowerLaw> edist, RadialDistributionPtr rdist)
+    : zenithRange_(0., 1.), azimuthRange_(0., 2*M_PI), threshold_(0.)
 {
 	SetSurface(surface);
 	SetFlux(flux);
@@ -98,7 +120,21 @@ StaticSurfaceInjector::IsCompatible(GenerationProbabilityConstPtr o) const
 		return false;
 	return (*surface_ == *(other->surface_) && *flux_ == *(other->flux_)
 	    && *radialDistribution_ == *(other->radialDistribution_)
-	    && *energyGenerator_ == *(other->energyGenerator_));
+	    && *energyGenerator_ == *(other->energyGenerator_)
+	    && zenithRange_ == other->zenithRange_ && azimuthRange_ == other->azimuthRange_
+	    && threshold_ == other->threshold_
+	    && (energyProposal_ ? (other->energyProposal_ && *energyProposal_ == *(other->energyProposal_))
+	    : !other->energyProposal_));
+}
+
+uint64_t
+StaticSurfaceInjector::Hash() const
+{
+	return CacheKey("StaticSurfaceInjector").Add(surface_->Hash()).Add(flux_->Hash())
+	    .Add(radialDistribution_->Hash()).Add(energyGenerator_->Hash())
+	    .Add(zenithRange_.first).Add(zenithRange_.second)
+	    .Add(azimuthRange_.first).Add(azimuthRange_.second).Add(threshold_)
+	    .Add(energyProposal_ ? energyProposal_->Hash() : uint64_t(0)).GetValue();
 }
 
 void
@@ -119,6 +155,56 @@ StaticSurfaceInjector::SetFlux(FluxPtr p)
 	CalculateMaxFlux();
 }
 
+void
+StaticSurfaceInjector::SetZenithRange(double cosMin, double cosMax)
+{
+	if (!(cosMin >= 0 && cosMin < cosMax && cosMax <= 1))
+		log_fatal("Zenith range must satisfy 0 <= cosMin < cosMax <= 1");
+	zenithRange_ = std::make_pair(cosMin, cosMax);
+	totalRate_ = NAN;
+	zenithNorm_ = NAN;
+}
+
+void
+StaticSurfaceInjector::SetAzimuthRange(double min, double max)
+{
+	if (!(min >= 0 && min < max && max <= 2*M_PI))
+		log_fatal("Azimuth range must satisfy 0 <= min < max <= 2 pi");
+	azimuthRange_ = std::make_pair(min, max);
+	totalRate_ = NAN;
+}
+
+bool
+StaticSurfaceInjector::InRange(const I3Direction &dir) const
+{
+	const double ct = std::cos(dir.GetZenith()), az = dir.GetAzimuth();
+	return (ct >= zenithRange_.first && ct <= zenithRange_.second
+	    && az >= azimuthRange_.first && az <= azimuthRange_.second);
+}
+
+bool
+StaticSurfaceInjector::Covers(const BundleKinematics &kinematics) const
+{
+	if (!InRange(kinematics.GetAxis().GetDir()))
+		return false;
+	// Every muon that wasn't omitted has an energy in the generated range
+	const BundleSpec &bundlespec = kinematics.GetBundle();
+	for (size_t i=0; i < bundlespec.size(); i++)
+		if (!bundlespec.IsOmitted(i) && !std::isfinite(GetLogEnergyProbability(bundlespec.GetEnergy(i))))
+			return false;
+	
+	return true;
+}
+
+double
+StaticSurfaceInjector::GetLogAcceptance(const SamplingSurface &surface) const
+{
+	// The surface is azimuthally symmetric, so the azimuth range simply
+	// scales the acceptance
+	return std::log(surface.GetAcceptance(zenithRange_.first, zenithRange_.second)
+	    *(azimuthRange_.second-azimuthRange_.first)/(2*M_PI));
+}
+
 void
 StaticSurfaceInjector::CalculateMaxFlux()
 {
@@ -126,14 +212,27 @@ StaticSurfaceInjector::CalculateMaxFlux()
 		maxFlux_ = (*flux_)(surface_->GetMinDepth(), 1., 1u)*surface_->GetMaximumArea();
 }
 
+void
+StaticSurfaceInjector::Prepare() const
+{
+	GetTotalRate();
+	GetZenithNorm();
+}
+
 double
 StaticSurfaceInjector::GetTotalRate() const
 {
 	if (std::isnan(totalRate_) && surface_ && flux_) {
-		totalRate_ = 0;
-		for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++) {
-			totalRate_ += surface_->IntegrateFlux(boost::bind(boost::cref(*flux_), _1, _2, m));
-		}
+		CacheKey key("TotalRate");
+		key.Add(surface_).Add(flux_).Add(zenithRange_.first).Add(zenithRange_.second);
+		totalRate_ = NormalizationCache::GetInstance().Get(key, [this]()
+		{
+			double rate = 0;
+			for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++)
+				rate += surface_->IntegrateFlux(boost::bind(boost::cref(*flux_), _1, _2, m),
+				    zenithRange_.first, zenithRange_.second);
+			return rate;
+		})*(azimuthRange_.second-azimuthRange_.first)/(2*M_PI);
 	}
 	return totalRate_;
 }
@@ -142,34 +241,141 @@ double
 StaticSurfaceInjector::GetZenithNorm() const
 {
 	if (std::isnan(zenithNorm_) && surface_ && flux_) {
-		zenithNorm_ = 0;
-		for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++) {
-			zenithNorm_ += Integrate(boost::bind(boost::cref(*flux_), surface_->GetMinDepth(), _1, m), 0, 1);
-		}
-		zenithNorm_ = std::log(zenithNorm_);
+		CacheKey key("ZenithNorm");
+		key.Add(flux_).Add(surface_->GetMinDepth()).Add(zenithRange_.first).Add(zenithRange_.second);
+		zenithNorm_ = NormalizationCache::GetInstance().Get(key, [this]()
+		{
+			double norm = 0;
+			for (unsigned m = flux_->GetMinMultiplicity(); m <= flux_->GetMaxMultiplicity(); m++)
+				norm += Integrate(boost::bind(boost::cref(*flux_), surface_->GetMinDepth(), _1, m),
+				    zenithRange_.first, zenithRange_.second);
+			return std::log(norm);
+		});
 	}
 	return zenithNorm_;
 }
 
+double
+StaticSurfaceInjector::GenerateEnergy(I3RandomService &rng) const
+{
+	if (energyProposal_)
+		return energyProposal_->Generate(rng);
+	else
+		return energyGenerator_->Generate(rng);
+}
+
+double
+StaticSurfaceInjector::GetLogEnergyProbability(double energy) const
+{
+	if (energyProposal_)
+		return energyProposal_->GetLog(energy);
+	else
+		return energyGenerator_->GetLog(energy);
+}
+
+double
+StaticSurfaceInjector::GetLogEnergyCumulative(double energy) const
+{
+	if (energyProposal_)
+		return energyProposal_->GetLogCumulative(energy);
+	else
+		return energyGenerator_->GetLogCumulative(energy);
+}
+
 void
-StaticSurfaceInjector::GenerateAxis(I3RandomService &rng, std::pair<I3Particle, unsigned> &axis) const
+StaticSurfaceInjector::SetMuonEnergyThreshold(double threshold)
 {
-	// Choose a direction and impact position from a uniform flux through
-	// the sampling surface, then pick a multiplicity. Accept zenith angles
-	// and multiplicities at a rate proportional to the flux at the shallowest depth.
+	if (!(threshold >= 0))
+		log_fatal("Muon energy threshold must be >= 0");
+	threshold_ = threshold;
+}
+
+void
+StaticSurfaceInjector::FitEnergyProposal(const EnergyDistribution &target,
+    I3RandomService &rng, unsigned samples, unsigned knots, double defensive)
+{
+	if (!(defensive > 0 && defensive <= 1))
+		log_fatal("The defensive fraction must be in (0,1]");
+	if (knots < 2)
+		log_fatal("Need at least 2 knots");
+	
+	const double logemin = std::log(energyGenerator_->GetMin());
+	const double logemax = std::log(energyGenerator_->GetMax());
+	std::vector<double> energies(knots), density(knots, 0.);
+	for (unsigned k=0; k < knots; k++)
+		energies[k] = std::exp(logemin + k*(logemax-logemin)/(knots-1));
+	
+	// Average the energy spectrum at the knots over the bundles this
+	// injector produces. Each muon in a bundle counts separately, and the
+	// spectrum at each (depth, zenith, multiplicity, radius) is normalized
+	// on its own so that the result is a shape, not a rate.
 	I3Direction dir;
 	I3Position pos;
 	unsigned m;
+	double muons = 0;
+	std::vector<double> local(knots);
+	for (unsigned i=0; i < samples; i++) {
+		SampleAxis(rng, pos, dir, m);
+		double h = GetDepth(pos.GetZ());
+		double coszen = cos(dir.GetZenith());
+		double radius = (m > 1u) ? radialDistribution_->Generate(rng, h, coszen, m) : 0.;
+		double norm = 0;
+		for (unsigned k=0; k < knots; k++) {
+			local[k] = target(h, coszen, m, radius, energies[k]);
+			if (!std::isfinite(local[k]))
+				local[k] = 0;
+			// Trapezoidal rule in log(E)
+			double w = (k == 0 || k == knots-1) ? 0.5 : 1.;
+			norm += w*local[k]*energies[k];
+		}
+		if (!(norm > 0))
+			continue;
+		norm *= (logemax-logemin)/(knots-1);
+		for (unsigned k=0; k < knots; k++)
+			density[k] += m*local[k]/norm;
+		muons += m;
+	}
+	if (!(muons > 0))
+		log_fatal("The target energy distribution is zero everywhere in [%g, %g]",
+		    energyGenerator_->GetMin(), energyGenerator_->GetMax());
+	
+	std::vector<double> logdensity(knots);
+	for (unsigned k=0; k < knots; k++)
+		logdensity[k] = std::log((1-defensive)*density[k]/muons
+		    + defensive*(*energyGenerator_)(energies[k]));
+	
+	energyProposal_ = boost::make_shared<PiecewisePowerLaw>(energies, logdensity);
+}
+
+void
+StaticSurfaceInjector::SampleAxis(I3RandomService &rng, I3Position &pos, I3Direction &dir, unsigned &m) const
+{
+	// Choose a direction and impact position from a uniform flux through
+	// the sampling surface, then pick a multiplicity. Accept zenith angles
+	// and multiplicities at a rate proportional to the flux at the shallowest depth.
 	double flux;
-	// For any sane distribution the maximum flux is for single vertical muons
-	// at minimum depth
-	double maxflux = (*flux_)(surface_->GetMinDepth(), 1., flux_->GetMinMultiplicity());
-	do {
-		surface_->SampleImpactRay(pos, dir, rng);
+	// For any sane distribution the maximum flux is for single muons at
+	// minimum depth and the most vertical allowed zenith angle
+	double maxflux = (*flux_)(surface_->GetMinDepth(), zenithRange_.second, flux_->GetMinMultiplicity());
+	while (true) {
+		surface_->SampleImpactRay(pos, dir, rng, zenithRange_.first, zenithRange_.second);
+		if (!InRange(dir))
+			continue;
 		m = rng.Integer(flux_->GetMaxMultiplicity() - flux_->GetMinMultiplicity())
 		    + flux_->GetMinMultiplicity();
 		flux = (*flux_)(surface_->GetMinDepth(), cos(dir.GetZenith()), m);
-	} while (rng.Uniform(0., maxflux) > flux);
+		if (rng.Uniform(0., maxflux) <= flux)
+			break;
+	}
+}
+
+void
+StaticSurfaceInjector::GenerateAxis(I3RandomService &rng, std::pair<I3Particle, unsigned> &axis) const
+{
+	I3Direction dir;
+	I3Position pos;
+	unsigned m;
+	SampleAxis(rng, pos, dir, m);
 	
 	axis.first.SetPos(pos);
 	axis.first.SetDir(dir);
@@ -183,7 +389,7 @@ StaticSurfaceInjector::GenerateAxis(I3RandomService &rng, std::pair<I3Particle,
 void
 StaticSurfaceInjector::FillMCTree(I3RandomService &rng,
     const std::pair<I3Particle, unsigned> &axis,
-    I3MCTree &mctree, BundleConfiguration &bundlespec) const
+    I3MCTree &mctree, BundleSpec &bundlespec) const
 {
 	const I3Particle &primary = axis.first;
 	I3MCTreeUtils::AddPrimary(mctree, primary);
@@ -191,6 +397,7 @@ StaticSurfaceInjector::FillMCTree(I3RandomService &rng,
 	double coszen = cos(primary.GetDir().GetZenith());
 	
 	unsigned m = axis.second;
+	bundlespec.reserve(m);
 	for (unsigned i=0; i < m; i++) {
 		double radius = 0., azimuth = 0.;
 		if (m > 1u) {
@@ -200,43 +407,74 @@ StaticSurfaceInjector::FillMCTree(I3RandomService &rng,
 		
 		I3Particle track = CreateParallelTrack(radius, azimuth, *surface_, primary);
 		
-		track.SetEnergy(energyGenerator_->Generate(rng));
+		track.SetEnergy(GenerateEnergy(rng));
+		if (track.GetEnergy() < threshold_) {
+			bundlespec.push_back(BundleEntry(radius, threshold_, true));
+			continue;
+		}
 		I3MCTreeUtils::AppendChild(mctree, primary, track);
 		bundlespec.push_back(BundleEntry(radius, track.GetEnergy()));
 	}
 }
 
 void
-StaticSurfaceInjector::Generate(I3RandomService &rng, I3MCTree &mctree, BundleConfiguration &bundlespec) const
+StaticSurfaceInjector::Generate(I3RandomService &rng, I3MCTree &mctree, BundleSpec &bundlespec) const
 {
 	std::pair<I3Particle, unsigned> axis;
 	GenerateAxis(rng, axis);
 	FillMCTree(rng, axis, mctree, bundlespec);
 }
 
+void
+StaticSurfaceInjector::GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const
+{
+	I3Direction dir;
+	I3Position pos;
+	unsigned m;
+	for (size_t i=0; i < n; i++) {
+		SampleAxis(rng, pos, dir, m);
+		batch.AddBundle(pos, dir);
+		double h = GetDepth(pos.GetZ());
+		double coszen = cos(dir.GetZenith());
+		for (unsigned j=0; j < m; j++) {
+			double radius = 0.;
+			if (m > 1u) {
+				radius = radialDistribution_->Generate(rng, h, coszen, m);
+				// Draw (and discard) the azimuth about the axis so that the
+				// random sequence stays in step with Generate()
+				rng.Uniform(0., 2*M_PI);
+			}
+			batch.AddMuon(radius, GenerateEnergy(rng));
+		}
+	}
+}
+
 double
-StaticSurfaceInjector::GetLogGenerationProbability(const I3Particle &axis,
-    const BundleConfiguration &bundlespec) const
+StaticSurfaceInjector::GetLogGenerationProbability(const BundleKinematics &kinematics) const
 {
-	std::pair<double, double> steps = surface_->GetIntersection(axis.GetPos(), axis.GetDir());
-	// This shower axis doesn't intersect the sampling surface. Bail.
-	if (!std::isfinite(steps.first))
+	const BundleSpec &bundlespec = kinematics.GetBundle();
+	// This shower axis doesn't intersect the sampling surface, or points
+	// in a direction we never generate. Bail.
+	if (!std::isfinite(kinematics.GetEntry(surface_)) || !InRange(kinematics.GetAxis().GetDir()))
 		return -std::numeric_limits<double>::infinity();
 	
-	double h = GetDepth(axis.GetPos().GetZ() + steps.first*axis.GetDir().GetZ());
-	double coszen = cos(axis.GetDir().GetZenith());
-	unsigned m = static_cast<unsigned>(bundlespec.size());
+	double h = kinematics.GetDepth(surface_);
+	double coszen = kinematics.GetCosZenith();
+	unsigned m = kinematics.GetMultiplicity();
 
 	// We used the flux to do rejection sampling in zenith and multiplicity. Evaluate
 	// the properly-normalized PDF here.
 	double logprob = flux_->GetLog(surface_->GetMinDepth(), coszen, m) - GetZenithNorm();
-	BOOST_FOREACH(const BundleEntry &track, bundlespec) {
+	for (unsigned i=0; i < m; i++) {
 		if (m > 1)
-			logprob += radialDistribution_->GetLog(h, coszen, m, track.radius);
-		logprob += energyGenerator_->GetLog(track.energy);
+			logprob += radialDistribution_->GetLog(h, coszen, m, bundlespec.GetRadius(i));
+		if (bundlespec.IsOmitted(i))
+			logprob += GetLogEnergyCumulative(bundlespec.GetEnergy(i));
+		else
+			logprob += GetLogEnergyProbability(bundlespec.GetEnergy(i));
 	}
 	
-	return logprob - std::log(surface_->GetAcceptance());
+	return logprob - GetLogAcceptance(*surface_);
 }
 
 }
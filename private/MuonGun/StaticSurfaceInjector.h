@@ -28,7 +28,9 @@ namespace I3MuonGun {
  * and radial distributions at their natural frequencies on a fixed surface
  * using a brain-dead acceptance/rejection technique. Energies, on the other hand,
  * are sampled from an OffsetPowerLaw, which both boosts efficiency and allows
- * a measure of control over the generated energy distribution.
+ * a measure of control over the generated energy distribution. The power law
+ * can be replaced with a PiecewisePowerLaw that follows a more realistic
+ * spectrum (see FitEnergyProposal()), which reduces the spread of weights.
  */
 class StaticSurfaceInjector : public Generator {
 public:
@@ -37,10 +39,17 @@ public:
 	    boost::shared_ptr<OffsetPowerLaw> edist, RadialDistributionPtr rdist);
 	
 	// Generator Interface
-	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const;
+	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleSpec &bundle) const;
+	using Generator::Generate;
+	using Generator::GenerateBatch;
+	virtual void GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const;
 	virtual GenerationProbabilityPtr Clone() const;
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const;
-	virtual double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	virtual uint64_t Hash() const;
+	virtual bool Covers(const BundleKinematics &kinematics) const;
+	virtual void Prepare() const;
+	virtual double GetLogGenerationProbability(const BundleKinematics &kinematics) const;
+	using GenerationProbability::GetLogGenerationProbability;
 	virtual SamplingSurfaceConstPtr GetInjectionSurface() const { return surface_; }
 	
 	void SetSurface(SamplingSurfacePtr p);
@@ -49,12 +58,61 @@ public:
 	void SetFlux(FluxPtr p);
 	FluxPtr GetFlux() { return flux_; }
 	
+	/**
+	 * Only generate bundles whose axes have cos(zenith) in [cosMin, cosMax]
+	 * (default [0, 1])
+	 */
+	void SetZenithRange(double cosMin, double cosMax);
+	std::pair<double, double> GetZenithRange() const { return zenithRange_; }
+	/**
+	 * Only generate bundles whose axes have azimuth in [min, max]
+	 * (default [0, 2 pi])
+	 */
+	void SetAzimuthRange(double min, double max);
+	std::pair<double, double> GetAzimuthRange() const { return azimuthRange_; }
+	
+	/**
+	 * Omit muons with energies below *threshold* from the I3MCTree, so
+	 * that they never have to be propagated. They are still counted in the
+	 * bundle multiplicity, and are reported in the BundleSpec
+	 * with the omitted flag set and the threshold as their energy.
+	 */
+	void SetMuonEnergyThreshold(double threshold);
+	double GetMuonEnergyThreshold() const { return threshold_; }
+	
 	void SetRadialDistribution(RadialDistributionPtr r) { radialDistribution_ = r; }
 	RadialDistributionPtr GetRadialDistribution() { return radialDistribution_; }
 	
 	void SetEnergyDistribution(boost::shared_ptr<OffsetPowerLaw> e) { energyGenerator_ = e; }
 	boost::shared_ptr<OffsetPowerLaw> GetEnergyDistribution() { return energyGenerator_; }
 	
+	/**
+	 * Draw muon energies from the given distribution instead of the
+	 * OffsetPowerLaw. Pass a null pointer to go back to the power law.
+	 */
+	void SetEnergyProposal(PiecewisePowerLawPtr e) { energyProposal_ = e; }
+	PiecewisePowerLawPtr GetEnergyProposal() { return energyProposal_; }
+	
+	/**
+	 * @brief Fit an energy proposal to the per-muon energy spectrum of
+	 *        a target model
+	 *
+	 * The target is averaged over the depths, zenith angles, multiplicities,
+	 * and radial offsets this injector generates, and tabulated at
+	 * logarithmically spaced energies between the minimum and maximum of
+	 * the OffsetPowerLaw. A fraction of the OffsetPowerLaw is mixed in so that
+	 * the tails of the spectrum are never starved of events.
+	 *
+	 * @param[in] target    the energy distribution that will be used for
+	 *                      weighting
+	 * @param[in] rng       random number generator used to sample bundle axes
+	 * @param[in] samples   number of bundle axes to average over
+	 * @param[in] knots     number of knots in the PiecewisePowerLaw
+	 * @param[in] defensive fraction of the OffsetPowerLaw to mix in
+	 */
+	void FitEnergyProposal(const EnergyDistribution &target, I3RandomService &rng,
+	    unsigned samples=10000, unsigned knots=24, double defensive=0.1);
+	
 	/**
 	 * Integrate the configured flux over the sampling surface, summing over
 	 * all allowed multiplicities.
@@ -70,14 +128,26 @@ protected:
 	 * The shower axis and multiplcity are filled into the *axis*
 	 */
 	void GenerateAxis(I3RandomService &rng, std::pair<I3Particle, unsigned> &axis) const;
+	/**
+	 * Draw an impact point, direction, and multiplicity without
+	 * filling them into an I3Particle
+	 */
+	void SampleAxis(I3RandomService &rng, I3Position &pos, I3Direction &dir, unsigned &m) const;
 	/**
 	 * Distribute the given number of muons in the transverse plane
 	 * and draw an energy for each
 	 */
-	void FillMCTree(I3RandomService &rng, const std::pair<I3Particle, unsigned> &axis, I3MCTree &, BundleConfiguration &) const;
+	void FillMCTree(I3RandomService &rng, const std::pair<I3Particle, unsigned> &axis, I3MCTree &, BundleSpec &) const;
 	
 	void CalculateMaxFlux();
 	
+	/** Draw an energy from the proposal, if set, otherwise the OffsetPowerLaw */
+	double GenerateEnergy(I3RandomService &rng) const;
+	/** Get the log probability density that GenerateEnergy() returns *energy* */
+	double GetLogEnergyProbability(double energy) const;
+	/** Get the log probability that GenerateEnergy() returns less than *energy* */
+	double GetLogEnergyCumulative(double energy) const;
+	
 	/**
 	 * Get the normalization term for relative weighting of zenith
 	 * angles and multiplicities by integrating the flux at the top
@@ -85,6 +155,14 @@ protected:
 	 * allowed multiplicities.
 	 */
 	double GetZenithNorm() const;
+	
+	/** Is the direction inside the configured zenith and azimuth ranges? */
+	bool InRange(const I3Direction &dir) const;
+	/**
+	 * Get the log of the acceptance of the given surface, restricted to
+	 * the configured zenith and azimuth ranges
+	 */
+	double GetLogAcceptance(const SamplingSurface &surface) const;
 
 private:
 	friend class icecube::serialization::access;
@@ -95,16 +173,19 @@ protected:
 	SamplingSurfacePtr surface_;
 	FluxPtr flux_;
 	boost::shared_ptr<OffsetPowerLaw> energyGenerator_;
+	PiecewisePowerLawPtr energyProposal_;
 	RadialDistributionPtr radialDistribution_;
 	
 	double maxFlux_;
 	mutable double totalRate_, zenithNorm_;
+	std::pair<double, double> zenithRange_, azimuthRange_;
+	double threshold_;
 
 };
 
 }
 
-I3_CLASS_VERSION(I3MuonGun::StaticSurfaceInjector, 1);
+I3_CLASS_VERSION(I3MuonGun::StaticSurfaceInjector, 5);
 
 #endif
 
@@ -0,0 +1,41 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/ThinningFunction.h>
+#include <icetray/I3Logging.h>
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace I3MuonGun {
+
+ThinningFunction::~ThinningFunction() {}
+
+EnergyThinning::EnergyThinning(double referenceEnergy, double index, double minProbability)
+    : referenceEnergy_(referenceEnergy), index_(index), minProbability_(minProbability)
+{
+	if (!(referenceEnergy > 0))
+		log_fatal("Reference energy must be > 0");
+	if (!(minProbability > 0 && minProbability <= 1))
+		log_fatal("Minimum keep probability must be in (0, 1]");
+}
+
+double
+EnergyThinning::GetKeepProbability(const I3Particle &, const BundleSpec &bundle) const
+{
+	double energy = 0;
+	for (size_t i=0; i < bundle.size(); i++)
+		if (!bundle.IsOmitted(i))
+			energy += bundle.GetEnergy(i);
+	
+	return std::max(minProbability_,
+	    std::min(1., std::pow(energy/referenceEnergy_, index_)));
+}
+
+}
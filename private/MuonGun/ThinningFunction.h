@@ -0,0 +1,62 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_THINNINGFUNCTION_H_INCLUDED
+#define I3MUONGUN_THINNINGFUNCTION_H_INCLUDED
+
+#include <MuonGun/Generator.h>
+#include <icetray/I3PointerTypedefs.h>
+
+namespace I3MuonGun {
+
+/**
+ * @brief The probability of keeping a generated bundle
+ *
+ * GeneratorModule plays Russian roulette with each bundle it generates:
+ * the bundle is emitted with the probability returned here, and the
+ * inverse of that probability is stored in the frame so that the weights
+ * of the bundles that survive make up for the ones that did not.
+ */
+class ThinningFunction {
+public:
+	virtual ~ThinningFunction();
+	/**
+	 * @param[in] axis   the bundle axis
+	 * @param[in] bundle the radial offset and energy of each muon
+	 * @returns a probability in (0, 1]. Values above 1 are treated as 1.
+	 */
+	virtual double GetKeepProbability(const I3Particle &axis, const BundleSpec &bundle) const = 0;
+};
+
+I3_POINTER_TYPEDEFS(ThinningFunction);
+
+/**
+ * @brief Thin bundles by their total muon energy
+ *
+ * A bundle carrying a total energy @f$ E @f$ in the muons that were not
+ * omitted is kept with probability
+ * @f$ \max(p_{min}, \min(1, (E/E_{ref})^{\gamma})) @f$.
+ */
+class EnergyThinning : public ThinningFunction {
+public:
+	/**
+	 * @param[in] referenceEnergy bundles above this energy are always kept
+	 * @param[in] index           power-law index @f$ \gamma @f$ of the keep
+	 *                            probability below the reference energy
+	 * @param[in] minProbability  lower bound on the keep probability, which
+	 *                            limits the size of the weights
+	 */
+	EnergyThinning(double referenceEnergy, double index=1., double minProbability=1e-3);
+	virtual double GetKeepProbability(const I3Particle &axis, const BundleSpec &bundle) const;
+private:
+	double referenceEnergy_, index_, minProbability_;
+};
+
+}
+
+#endif // I3MUONGUN_THINNINGFUNCTION_H_INCLUDED
@@ -0,0 +1,113 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include <MuonGun/ThreadPool.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace I3MuonGun {
+
+ThreadPool::ThreadPool(unsigned nthreads) : stop_(false)
+{
+	if (nthreads == 0)
+		nthreads = std::max(1u, std::thread::hardware_concurrency());
+	workers_.reserve(nthreads);
+	for (unsigned i=0; i < nthreads; i++)
+		workers_.push_back(std::thread(&ThreadPool::Work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	wakeup_.notify_all();
+	for (std::vector<std::thread>::iterator t = workers_.begin(); t != workers_.end(); t++)
+		t->join();
+}
+
+void
+ThreadPool::Submit(const std::function<void ()> &task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		tasks_.push_back(task);
+	}
+	wakeup_.notify_one();
+}
+
+void
+ThreadPool::Work()
+{
+	while (true) {
+		std::function<void ()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wakeup_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+			if (tasks_.empty())
+				return;
+			task = tasks_.front();
+			tasks_.pop_front();
+		}
+		task();
+	}
+}
+
+namespace {
+
+struct loop_state {
+	loop_state(size_t n, unsigned nworkers) : size(n), next(0), running(nworkers) {}
+	const size_t size;
+	std::atomic<size_t> next;
+	unsigned running;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable done;
+};
+
+}
+
+void
+ThreadPool::ParallelFor(size_t n, const std::function<void (size_t)> &body)
+{
+	if (n == 0)
+		return;
+	const unsigned nworkers = unsigned(std::min(n, GetSize()));
+	std::shared_ptr<loop_state> state = std::make_shared<loop_state>(n, nworkers);
+
+	for (unsigned w=0; w < nworkers; w++) {
+		Submit([state, &body]()
+		{
+			for (size_t i = state->next++; i < state->size; i = state->next++) {
+				try {
+					body(i);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if (!state->error)
+						state->error = std::current_exception();
+					// Skip the remaining iterations
+					state->next = state->size;
+				}
+			}
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (--state->running == 0)
+				state->done.notify_all();
+		});
+	}
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->done.wait(lock, [&state]() { return state->running == 0; });
+	if (state->error)
+		std::rethrow_exception(state->error);
+}
+
+}
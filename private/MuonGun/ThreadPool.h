@@ -0,0 +1,65 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_THREADPOOL_H_INCLUDED
+#define I3MUONGUN_THREADPOOL_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace I3MuonGun {
+
+/**
+ * @brief A fixed-size pool of worker threads
+ *
+ * Tasks are run in the order they were submitted, but may complete in any
+ * order. Anything that touches a shared I3RandomService or an I3Frame must
+ * stay on the calling thread.
+ */
+class ThreadPool {
+public:
+	/**
+	 * @param[in] nthreads number of workers. If 0, use one per hardware
+	 *                     thread.
+	 */
+	explicit ThreadPool(unsigned nthreads=0);
+	~ThreadPool();
+
+	size_t GetSize() const { return workers_.size(); }
+
+	/** @brief Queue a task for execution on the next free worker */
+	void Submit(const std::function<void ()> &task);
+
+	/**
+	 * @brief Call body(i) for every i in [0, n), and wait for all calls
+	 *        to complete
+	 *
+	 * If any call throws, the first exception is rethrown here once all
+	 * workers have stopped.
+	 */
+	void ParallelFor(size_t n, const std::function<void (size_t)> &body);
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void Work();
+
+	std::vector<std::thread> workers_;
+	std::deque<std::function<void ()> > tasks_;
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	bool stop_;
+};
+
+}
+
+#endif // I3MUONGUN_THREADPOOL_H_INCLUDED
@@ -7,9 +7,16 @@
  */
 
 #include <MuonGun/Track.h>
+#include <MuonGun/NormalizationCache.h>
 #include <simclasses/I3MMCTrack.h>
 
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 
 namespace I3MuonGun {
 
@@ -18,14 +25,14 @@ Track::Track(const I3MMCTrack &mmctrack,
     const I3MCTree::sibling_const_iterator &send) : I3Particle(mmctrack.GetI3Particle())
 {
 	// In the beginning, the particle is at its vertex with the given energy
-	checkpoints_.push_back(Checkpoint(0., I3Particle::GetEnergy(), 0u));
-	losses_.push_back(LossSum(checkpoints_.back().length, 0.));
+	AddCheckpoint(0., I3Particle::GetEnergy());
+	AddLoss(0., 0.);
 	if (mmctrack.GetEi() > 0) {
 		// Track started outside the MMC volume; we get an extra
 		// measurement point (but no stochastics)
 		double d = (I3Position(mmctrack.GetXi(), mmctrack.GetYi(),
 		    mmctrack.GetZi())-I3Particle::GetPos()).Magnitude();
-		checkpoints_.push_back(Checkpoint(d, mmctrack.GetEi(), losses_.size()));
+		AddCheckpoint(d, mmctrack.GetEi());
 	}
 	
 	// Sum energy losses between entry and exit
@@ -33,27 +40,65 @@ Track::Track(const I3MMCTrack &mmctrack,
 	BOOST_FOREACH(const I3Particle &p, std::make_pair(sbegin, send)) {
 		elost += p.GetEnergy();
 		double d = (p.GetPos()-I3Particle::GetPos()).Magnitude();
-		losses_.push_back(LossSum(d, elost));
+		AddLoss(d, elost);
 	}
 	
 	if (mmctrack.GetEf() > 0) {
 		// Track made it to the edge of the MMC volume
 		double d = (I3Position(mmctrack.GetXf(), mmctrack.GetYf(),
 		    mmctrack.GetZf())-I3Particle::GetPos()).Magnitude();
-		checkpoints_.push_back(Checkpoint(d, mmctrack.GetEf(), losses_.size()));
-		losses_.push_back(LossSum(checkpoints_.back().length, 0.));
+		AddCheckpoint(d, mmctrack.GetEf());
+		AddLoss(d, 0.);
 	}
 	
-	checkpoints_.push_back(Checkpoint(I3Particle::GetLength(), 0., losses_.size()));
-	losses_.push_back(LossSum(I3Particle::GetLength(), 0.));
+	AddCheckpoint(I3Particle::GetLength(), 0.);
+	AddLoss(I3Particle::GetLength(), 0.);
+}
+
+void
+Track::AddCheckpoint(double length, double energy)
+{
+	checkpointLength_.push_back(length);
+	checkpointEnergy_.push_back(energy);
+	checkpointOffset_.push_back(lossLength_.size());
+}
+
+void
+Track::AddLoss(double length, double energy)
+{
+	lossLength_.push_back(length);
+	lossEnergy_.push_back(energy);
+}
+
+std::vector<Track::Checkpoint>
+Track::GetCheckpoints() const
+{
+	std::vector<Checkpoint> checkpoints;
+	for (size_t i=0; i < checkpointLength_.size(); i++)
+		checkpoints.push_back(Checkpoint(checkpointLength_[i],
+		    checkpointEnergy_[i], checkpointOffset_[i]));
+	return checkpoints;
+}
+
+std::vector<Track::LossSum>
+Track::GetLosses() const
+{
+	std::vector<LossSum> losses;
+	for (size_t i=0; i < lossLength_.size(); i++)
+		losses.push_back(LossSum(lossLength_[i], lossEnergy_[i]));
+	return losses;
 }
 
 namespace {
 
-template <typename T>
-inline bool Sort(const T &a, const T &b)
+// Index of the last element of [first, last) that is smaller than value,
+// or first if there is none
+inline size_t
+last_below(const std::vector<double> &values, size_t first, size_t last, double value)
 {
-	return a.length < b.length;
+	size_t i = std::lower_bound(values.begin()+first, values.begin()+last, value)
+	    - values.begin();
+	return std::max(i, first+1)-1;
 }
 
 }
@@ -67,23 +112,84 @@ Track::GetEnergy(double length) const
 		return GetEnergy();
 	// Find an energy checkpoint. The above if() guarantees that
 	// that both cp and cp+1 are valid.
-	std::vector<Checkpoint>::const_iterator cp =
-	    std::max(std::lower_bound(checkpoints_.begin(), checkpoints_.end(),
-	    Checkpoint(length), Sort<Checkpoint>)-1, checkpoints_.begin());
-	// Store iterators the mark the records of stochastic losses
-	// between the checkpoints
-	std::vector<LossSum>::const_iterator l1(losses_.begin()+(cp->offset > 0 ? cp->offset-1 : 0)),
-	    l2(losses_.begin()+(cp+1)->offset);
+	size_t cp = last_below(checkpointLength_, 0, checkpointLength_.size(), length);
 	// Find the cumulative energy loss since the last checkpoint
-	std::vector<LossSum>::const_iterator ls = std::max(std::lower_bound(l1, l2,
-	    LossSum(length), Sort<LossSum>)-1, l1);
+	size_t ls = last_below(lossLength_, checkpointOffset_[cp] > 0 ? checkpointOffset_[cp]-1 : 0,
+	    checkpointOffset_[cp+1], length);
+	
+	return GetEnergy(length, cp, ls);
+}
 
+double
+Track::GetEnergy(double length, size_t cp, size_t ls) const
+{
+	// The last record of stochastic losses before the next checkpoint
+	const size_t last = checkpointOffset_[cp+1]-1;
+	
 	// Estimate continuous loss rate
-	double conti_rate = (cp->energy - (cp+1)->energy - (l2-1)->energy)
-	    /((cp+1)->length - cp->length);
+	double conti_rate = (checkpointEnergy_[cp] - checkpointEnergy_[cp+1] - lossEnergy_[last])
+	    /(checkpointLength_[cp+1] - checkpointLength_[cp]);
+	
+	i3_assert(lossEnergy_[ls] <= checkpointEnergy_[cp] && "sum of losses is smaller than energy at last checkpoint");
+	return checkpointEnergy_[cp] - lossEnergy_[ls] - conti_rate*(length-checkpointLength_[cp]);
+}
+
+std::vector<double>
+Track::GetEnergy(const std::vector<double> &lengths) const
+{
+	std::vector<double> energies;
+	energies.reserve(lengths.size());
+	
+	// Positions of the checkpoint and loss sum for the last length. As
+	// long as the lengths increase, these only ever move forward.
+	size_t cp = 0, ls = 0;
+	double previous = -std::numeric_limits<double>::infinity();
+	BOOST_FOREACH(double length, lengths) {
+		if (!std::isfinite(length) || length >= GetLength()) {
+			energies.push_back(0.);
+			continue;
+		} else if (length <= 0) {
+			energies.push_back(GetEnergy());
+			continue;
+		}
+		if (length < previous)
+			cp = ls = 0;
+		previous = length;
+		
+		while (checkpointLength_[cp+1] < length)
+			cp++;
+		const size_t first = checkpointOffset_[cp] > 0 ? checkpointOffset_[cp]-1 : 0;
+		const size_t last = checkpointOffset_[cp+1];
+		ls = std::max(ls, first);
+		while (ls+1 < last && lossLength_[ls+1] < length)
+			ls++;
+		
+		energies.push_back(GetEnergy(length, cp, ls));
+	}
+	
+	return energies;
+}
+
+std::vector<I3Position>
+Track::GetPos(const std::vector<double> &lengths) const
+{
+	std::vector<I3Position> positions;
+	positions.reserve(lengths.size());
+	BOOST_FOREACH(double length, lengths)
+		positions.push_back(GetPos(length));
+	
+	return positions;
+}
+
+std::vector<double>
+Track::GetTime(const std::vector<double> &lengths) const
+{
+	std::vector<double> times;
+	times.reserve(lengths.size());
+	BOOST_FOREACH(double length, lengths)
+		times.push_back(GetTime(length));
 	
-	i3_assert(ls->energy <= cp->energy && "sum of losses is smaller than energy at last checkpoint");
-	return cp->energy - ls->energy - conti_rate*(length-cp->length);
+	return times;
 }
 
 I3Position
@@ -135,6 +241,29 @@ equivalent(const I3Particle &p1, const I3Particle &p2)
         && (p1.GetPos() == p2.GetPos()) && (p1.GetDir() == p2.GetDir());
 }
 
+/**
+ * Hash of the properties compared by equivalent(). The direction enters
+ * through the zenith and azimuth that I3Direction::operator== compares,
+ * since the Cartesian components of equal directions may differ in the
+ * last bit, and NaNs are folded together, since I3Position and
+ * I3Direction may compare them equal.
+ */
+inline uint64_t
+equivalence_hash(const I3Particle &p)
+{
+    const I3Position &pos = p.GetPos();
+    const I3Direction &dir = p.GetDir();
+    const double values[] = { p.GetEnergy(), pos.GetX(), pos.GetY(), pos.GetZ(),
+        dir.GetZenith(), dir.GetAzimuth() };
+    CacheKey key("Particle");
+    key.Add(unsigned(p.GetType()));
+    BOOST_FOREACH(double value, values)
+        key.Add(std::isnan(value) ? NAN : value);
+    return key.GetValue();
+}
+
+typedef std::unordered_map<uint64_t, std::vector<I3MCTree::const_iterator> > equivalence_index;
+
 }
 
 std::list<Track>
@@ -143,15 +272,31 @@ Track::Harvest(const I3MCTree &mctree, const I3MMCTrackList &mmctracks)
     std::list<Track> tracks;
     I3MCTree::const_iterator p = mctree.end();
     I3MCTree::sibling_const_iterator daughters = mctree.end_sibling();
+    // Particles in tree order, grouped by equivalence_hash(). Built only
+    // if a lookup by particle ID fails.
+    equivalence_index index;
+    bool indexed = false;
     BOOST_FOREACH(const I3MMCTrack &mmctrack, mmctracks) {
         // For each track, find the particle it corresponds to
         p = mctree.find(mmctrack.GetI3Particle());
         // The above search will fail if particle IDs were not originally
-        // unique. Fall back to linear search.
+        // unique. Fall back to searching by value.
         if (p == mctree.end() || !equivalent(*p, mmctrack.GetI3Particle())) {
-            for (p = mctree.begin(); p != mctree.end(); p++) {
-                if (equivalent(*p, mmctrack.GetI3Particle()))
-                    break;
+            if (!indexed) {
+                for (I3MCTree::const_iterator node = mctree.begin(); node != mctree.end(); node++)
+                    index[equivalence_hash(*node)].push_back(node);
+                indexed = true;
+            }
+            p = mctree.end();
+            equivalence_index::const_iterator bucket =
+                index.find(equivalence_hash(mmctrack.GetI3Particle()));
+            if (bucket != index.end()) {
+                BOOST_FOREACH(const I3MCTree::const_iterator &node, bucket->second) {
+                    if (equivalent(*node, mmctrack.GetI3Particle())) {
+                        p = node;
+                        break;
+                    }
+                }
             }
         }
         if (p != mctree.end()) {
@@ -170,4 +315,71 @@ Track::Harvest(const I3MCTree &mctree, const I3MMCTrackList &mmctracks)
 	return tracks;
 }
 
+namespace {
+
+/*
+ * Tracks harvested from frame objects that are still alive, keyed on the
+ * addresses of the objects. The entries hold only weak references to the
+ * frame objects, so they neither keep frames alive nor match an object
+ * that happens to reuse the address of an expired one. Nothing is evicted
+ * while its frame objects are alive, however many frames a module holds
+ * back; expired entries are swept out whenever the cache has doubled in
+ * size since the last sweep.
+ */
+struct harvest_cache_entry {
+	boost::weak_ptr<const I3MCTree> mctree;
+	boost::weak_ptr<const I3MMCTrackList> mmctracks;
+	boost::shared_ptr<const std::list<Track> > tracks;
+	
+	bool expired() const { return mctree.expired() || mmctracks.expired(); }
+};
+
+typedef std::map<std::pair<const I3MCTree*, const I3MMCTrackList*>,
+    harvest_cache_entry> harvest_cache_type;
+
+const size_t harvest_cache_min_sweep = 16;
+std::mutex harvest_cache_mutex;
+harvest_cache_type harvest_cache;
+size_t harvest_cache_sweep = harvest_cache_min_sweep;
+
+}
+
+boost::shared_ptr<const std::list<Track> >
+Track::Harvest(I3MCTreeConstPtr mctree, boost::shared_ptr<const I3MMCTrackList> mmctracks)
+{
+	if (!mctree || !mmctracks)
+		log_fatal("Need both an I3MCTree and an I3MMCTrackList");
+	
+	const harvest_cache_type::key_type key(mctree.get(), mmctracks.get());
+	{
+		std::lock_guard<std::mutex> lock(harvest_cache_mutex);
+		harvest_cache_type::const_iterator entry = harvest_cache.find(key);
+		if (entry != harvest_cache.end() && entry->second.mctree.lock() == mctree
+		    && entry->second.mmctracks.lock() == mmctracks)
+			return entry->second.tracks;
+	}
+	
+	// Harvest outside the lock so that different frames can be harvested
+	// in parallel. Two threads may occasionally harvest the same frame;
+	// the results are identical, so it doesn't matter which one is kept.
+	harvest_cache_entry entry;
+	entry.mctree = mctree;
+	entry.mmctracks = mmctracks;
+	entry.tracks = boost::make_shared<const std::list<Track> >(Harvest(*mctree, *mmctracks));
+	
+	std::lock_guard<std::mutex> lock(harvest_cache_mutex);
+	harvest_cache[key] = entry;
+	if (harvest_cache.size() >= harvest_cache_sweep) {
+		for (harvest_cache_type::iterator it = harvest_cache.begin(); it != harvest_cache.end(); ) {
+			if (it->second.expired())
+				harvest_cache.erase(it++);
+			else
+				it++;
+		}
+		harvest_cache_sweep = std::max(harvest_cache_min_sweep, 2*harvest_cache.size());
+	}
+	
+	return entry.tracks;
+}
+
 };
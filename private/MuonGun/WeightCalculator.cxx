@@ -8,6 +8,7 @@
 
 #include <MuonGun/WeightCalculator.h>
 #include <MuonGun/Generator.h>
+#include <MuonGun/BundleRecord.h>
 #include <MuonGun/SamplingSurface.h>
 #include <MuonGun/Cylinder.h>
 #include <MuonGun/Flux.h>
@@ -15,35 +16,65 @@
 #include <MuonGun/EnergyDistribution.h>
 #include <MuonGun/I3MuonGun.h>
 #include <MuonGun/Track.h>
+#include <MuonGun/ThreadPool.h>
 #include <boost/foreach.hpp>
 
 #include <icetray/I3Module.h>
 #include <dataclasses/physics/I3MCTreeUtils.h>
 #include <dataclasses/I3Double.h>
+#include <dataclasses/I3Vector.h>
+#include <dataclasses/I3Map.h>
 #include <simclasses/I3MMCTrack.h>
 #include <phys-services/I3Calculator.h>
 #include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/python.hpp>
 #include <boost/numeric/ublas/vector.hpp>
 
+#include <deque>
+#include <future>
+
 namespace I3MuonGun {
 
 double
-WeightCalculator::GetWeight(const I3Particle &axis, const BundleConfiguration &bundlespec) const
+WeightCalculator::GetWeight(const I3Particle &axis, const BundleSpec &bundlespec) const
+{
+	return GetWeight(BundleKinematics(axis, bundlespec));
+}
+
+double
+WeightCalculator::GetWeight(const I3Particle &axis, const BundleSpec &bundlespec,
+    double logGeneratedEvents) const
+{
+	return GetWeight(BundleKinematics(axis, bundlespec), logGeneratedEvents);
+}
+
+double
+WeightCalculator::GetWeight(const BundleKinematics &kinematics) const
+{
+	return GetWeight(kinematics, generator_->GetLogGeneratedEvents(kinematics));
+}
+
+double
+WeightCalculator::GetWeight(const BundleKinematics &kinematics, double logGeneratedEvents) const
 {
-	std::pair<double, double> steps = surface_->GetIntersection(axis.GetPos(), axis.GetDir());
 	// This shower axis doesn't intersect the sampling surface. Bail.
-	if (!std::isfinite(steps.first))
+	if (!std::isfinite(kinematics.GetEntry(surface_)))
 		return 0.;
 	
-	double h = GetDepth(axis.GetPos().GetZ() + steps.first*axis.GetDir().GetZ());
-	double coszen = cos(axis.GetDir().GetZenith());
-	unsigned m = unsigned(bundlespec.size());
+	const BundleSpec &bundlespec = kinematics.GetBundle();
+	double h = kinematics.GetDepth(surface_);
+	double coszen = kinematics.GetCosZenith();
+	unsigned m = kinematics.GetMultiplicity();
 	
-	double rate = flux_->GetLog(h, coszen, m) - generator_->GetLogGeneratedEvents(axis, bundlespec);
+	double rate = flux_->GetLog(h, coszen, m) - logGeneratedEvents;
 	
-	BOOST_FOREACH(const BundleEntry &track, bundlespec){
-		double logprob = energy_->GetLog(h, coszen, m, track.radius,
-		    EnergyDistribution::log_value(std::log(track.energy)));
+	for (unsigned i=0; i < m; i++) {
+		// Omitted muons are only known to be below some energy
+		EnergyDistribution::log_value loge(kinematics.GetLogEnergy(i));
+		double logprob = bundlespec.IsOmitted(i) ?
+		    energy_->GetLogCumulative(h, coszen, m, bundlespec.GetRadius(i), loge) :
+		    energy_->GetLog(h, coszen, m, bundlespec.GetRadius(i), loge);
 		if (!std::isfinite(logprob)){
                     log_warn("Log Energy weight of a least one muon is -inf, weight will be 0!");
                 }
@@ -53,6 +84,141 @@ WeightCalculator::GetWeight(const I3Particle &axis, const BundleConfiguration &b
 	return std::exp(rate);
 }
 
+namespace {
+
+// Bundles weighted per task: enough to make the cost of handing out tasks
+// negligible, few enough to keep the threads evenly loaded
+const size_t batch_chunk = 512;
+
+void
+get_bundle(const BundleBatch &batch, size_t i, I3Particle &axis, BundleSpec &bundlespec)
+{
+	axis.SetPos(batch.x[i], batch.y[i], batch.z[i]);
+	axis.SetDir(batch.zenith[i], batch.azimuth[i]);
+	bundlespec.clear();
+	for (uint64_t j=batch.offsets[i]; j < batch.offsets[i+1]; j++)
+		bundlespec.push_back(BundleEntry(batch.radius[j], batch.energy[j]));
+}
+
+// Call weigh(i, kinematics) for every bundle in the batch, spread over
+// nthreads threads
+void
+for_each_bundle(const BundleBatch &batch, const GenerationProbability &generator,
+    unsigned nthreads, const std::function<void (size_t, const BundleKinematics&)> &weigh)
+{
+	const size_t n = batch.size();
+	if (batch.x.size() != n || batch.y.size() != n || batch.z.size() != n
+	    || batch.zenith.size() != n || batch.azimuth.size() != n
+	    || batch.offsets.size() != n+1 || batch.offsets.back() != batch.radius.size()
+	    || batch.energy.size() != batch.radius.size())
+		log_fatal("Inconsistent BundleBatch");
+	if (n == 0)
+		return;
+	
+	const size_t nchunks = (n + batch_chunk-1)/batch_chunk;
+	if (nthreads == 0)
+		nthreads = std::max(1u, std::thread::hardware_concurrency());
+	nthreads = unsigned(std::min(size_t(nthreads), nchunks));
+	
+	std::function<void (size_t)> chunk = [&](size_t c)
+	{
+		I3Particle axis;
+		BundleSpec bundlespec;
+		const size_t end = std::min(n, (c+1)*batch_chunk);
+		for (size_t i = c*batch_chunk; i < end; i++) {
+			get_bundle(batch, i, axis, bundlespec);
+			weigh(i, BundleKinematics(axis, bundlespec));
+		}
+	};
+	
+	if (nthreads <= 1) {
+		for (size_t c=0; c < nchunks; c++)
+			chunk(c);
+	} else {
+		// Fill in lazy normalizations before more than one thread can
+		// touch them
+		generator.Prepare();
+		ThreadPool pool(nthreads);
+		pool.ParallelFor(nchunks, chunk);
+	}
+}
+
+}
+
+void
+WeightCalculator::GetWeights(const BundleBatch &batch, std::vector<double> &weights,
+    unsigned nthreads) const
+{
+	weights.resize(batch.size());
+	for_each_bundle(batch, *generator_, nthreads, [&](size_t i, const BundleKinematics &kinematics)
+	{
+		weights[i] = GetWeight(kinematics);
+	});
+}
+
+std::vector<double>
+WeightCalculator::GetWeights(const BundleBatch &batch, unsigned nthreads) const
+{
+	std::vector<double> weights;
+	GetWeights(batch, weights, nthreads);
+	return weights;
+}
+
+MultiModelWeightCalculator::MultiModelWeightCalculator(const std::vector<BundleModel> &models,
+    GenerationProbabilityPtr g) : generator_(g)
+{
+	if (models.empty())
+		log_fatal("No flux models configured!");
+	if (!generator_)
+		log_fatal("No generator configured!");
+	BOOST_FOREACH(const BundleModel &model, models)
+		models_.push_back(WeightCalculator(model, g));
+}
+
+std::vector<double>
+MultiModelWeightCalculator::GetWeights(const I3Particle &axis, const BundleSpec &bundlespec) const
+{
+	std::vector<double> weights(models_.size());
+	GetWeights(BundleKinematics(axis, bundlespec), &weights[0]);
+	return weights;
+}
+
+void
+MultiModelWeightCalculator::GetWeights(const BundleKinematics &kinematics, double *weights) const
+{
+	GetWeights(kinematics, generator_->GetLogGeneratedEvents(kinematics), weights);
+}
+
+void
+MultiModelWeightCalculator::GetWeights(const BundleKinematics &kinematics,
+    double logGeneratedEvents, double *weights) const
+{
+	// The models share a sampling surface, so the kinematics intersect
+	// it only once
+	for (size_t k=0; k < models_.size(); k++)
+		weights[k] = models_[k].GetWeight(kinematics, logGeneratedEvents);
+}
+
+void
+MultiModelWeightCalculator::GetWeights(const BundleBatch &batch, std::vector<double> &weights,
+    unsigned nthreads) const
+{
+	const size_t nmodels = models_.size();
+	weights.resize(batch.size()*nmodels);
+	for_each_bundle(batch, *generator_, nthreads, [&](size_t i, const BundleKinematics &kinematics)
+	{
+		GetWeights(kinematics, &weights[i*nmodels]);
+	});
+}
+
+std::vector<double>
+MultiModelWeightCalculator::GetWeights(const BundleBatch &batch, unsigned nthreads) const
+{
+	std::vector<double> weights;
+	GetWeights(batch, weights, nthreads);
+	return weights;
+}
+
 // Possibly throw-away utility function: "track" muons to a fixed surface using the
 // same method as WeightCalculatorModule
 std::vector<I3Particle>
@@ -66,7 +232,7 @@ GetMuonsAtSurface(I3FramePtr frame, I3Surfaces::SurfaceConstPtr surface)
 		log_fatal("I3MCTree missing!");
 	if (!mmctracks)
 		log_fatal("I3MMCTrackList missing!");
-	BOOST_FOREACH(const Track &track, Track::Harvest(*mctree, *mmctracks)) {
+	BOOST_FOREACH(const Track &track, *Track::Harvest(mctree, mmctracks)) {
 		std::pair<double, double> steps =
 		    surface->GetIntersection(track.GetPos(), track.GetDir());
 		double energy = track.GetEnergy(steps.first);
@@ -133,21 +299,63 @@ MuonBundleConverter::CreateDescription(const I3MCTree&)
 	desc->AddField<uint32_t>("multiplicity", "", "Number of muons in the bundle");
 	desc->AddField<float>("depth", "km", "Vertical depth of intersection with the sampling surface");
 	desc->AddField<float>("cos_theta", "", "Cosine of the shower zenith angle");
-	desc->AddField<float>("energy", "GeV", "Muon energy at sampling surface",
-	    maxMultiplicity_);
-	desc->AddField<float>("radius", "m", "Perpendicular distance from of track "
-	    "from the bundle axis at the sampling surface", maxMultiplicity_);
+	if (maxMultiplicity_ > 0) {
+		desc->AddField<float>("energy", "GeV", "Muon energy at sampling surface",
+		    maxMultiplicity_);
+		desc->AddField<float>("radius", "m", "Perpendicular distance from of track "
+		    "from the bundle axis at the sampling surface", maxMultiplicity_);
+	}
 	
 	return desc;
 }
 
 size_t
-MuonBundleConverter::FillRows(const I3MCTree &mctree, I3TableRowPtr rows)
+MuonBundleConverter::Convert(I3FrameObjectConstPtr object, I3TableRowPtr rows, I3FramePtr frame)
+{
+	// Hold on to the frame's pointer to the tree, so that FillRows() can
+	// use the harvest cache
+	mctree_ = boost::dynamic_pointer_cast<const I3MCTree>(object);
+	size_t nrows = I3ConverterImplementation<I3MCTree>::Convert(object, rows, frame);
+	mctree_.reset();
+	
+	return nrows;
+}
+
+void
+MuonBundleConverter::GetMuons(const I3MCTree &mctree, std::vector<float> &energies,
+    std::vector<float> &radii)
 {
 	I3MMCTrackListConstPtr mmctracks = currentFrame_->Get<I3MMCTrackListConstPtr>("MMCTrackList");
 	if (!mmctracks)
 		log_fatal("I3MMCTrackList missing!");
 	
+	// Share the harvest with other consumers of the frame if we were handed
+	// the frame's own copy of the tree
+	boost::shared_ptr<const std::list<Track> > tracks;
+	if (mctree_ && mctree_.get() == &mctree)
+		tracks = Track::Harvest(mctree_, mmctracks);
+	else
+		tracks = boost::make_shared<const std::list<Track> >(Track::Harvest(mctree, *mmctracks));
+	log_trace("%zu total tracks", tracks->size());
+	
+	const I3MCTree::const_iterator primary = mctree.begin();
+	energies.clear();
+	radii.clear();
+	BOOST_FOREACH(const Track &track, *tracks) {
+		std::pair<double, double> steps =
+		    surface_->GetIntersection(track.GetPos(), track.GetDir());
+		float energy = float(track.GetEnergy(steps.first));
+		log_trace("energy after %f m: %.1e", steps.first, energy);
+		if (energy > 0) {
+			energies.push_back(energy);
+			radii.push_back(float(GetRadius(*primary, track.GetPos(steps.first))));
+		}
+	}
+}
+
+size_t
+MuonBundleConverter::FillRows(const I3MCTree &mctree, I3TableRowPtr rows)
+{
 	const I3MCTree::const_iterator primary = mctree.begin();
 	std::pair<double, double> primary_steps =
 	    surface_->GetIntersection(primary->GetPos(), primary->GetDir());
@@ -156,42 +364,331 @@ MuonBundleConverter::FillRows(const I3MCTree &mctree, I3TableRowPtr rows)
 		rows->Set<float>("cos_theta", float(cos(primary->GetDir().GetZenith())));
 	}
 	
-	uint32_t m = 0;
-	float *energies = rows->GetPointer<float>("energy");
-	float *radii = rows->GetPointer<float>("radius");
+	std::vector<float> energies, radii;
+	GetMuons(mctree, energies, radii);
+	if (maxMultiplicity_ > 0) {
+		const size_t m = std::min(energies.size(), maxMultiplicity_);
+		std::copy(energies.begin(), energies.begin()+m, rows->GetPointer<float>("energy"));
+		std::copy(radii.begin(), radii.begin()+m, rows->GetPointer<float>("radius"));
+	}
 	
-	log_trace("%zu total tracks", Track::Harvest(mctree, *mmctracks).size());
+	rows->Set("multiplicity", uint32_t(energies.size()));
 	
-	BOOST_FOREACH(const Track &track, Track::Harvest(mctree, *mmctracks)) {
-		std::pair<double, double> steps =
-		    surface_->GetIntersection(track.GetPos(), track.GetDir());
-		float energy = float(track.GetEnergy(steps.first));
-		log_trace("energy after %f m: %.1e", steps.first, energy);
-		if (energy > 0) {
-			if (m < maxMultiplicity_) {
-				energies[m] = energy;
-				radii[m] = float(GetRadius(*primary, track.GetPos(steps.first)));
-			}
-			m++;
+	return 1;
+}
+
+BundleMuonConverter::BundleMuonConverter(SamplingSurfaceConstPtr surface)
+    : MuonBundleConverter(0, surface)
+{}
+
+I3TableRowDescriptionPtr
+BundleMuonConverter::CreateDescription(const I3MCTree&)
+{
+	I3TableRowDescriptionPtr desc(new I3TableRowDescription());
+	desc->isMultiRow_ = true;
+	
+	desc->AddField<uint32_t>("vector_index", "", "Index of the muon in the bundle");
+	desc->AddField<float>("energy", "GeV", "Muon energy at sampling surface");
+	desc->AddField<float>("radius", "m", "Perpendicular distance from of track "
+	    "from the bundle axis at the sampling surface");
+	
+	return desc;
+}
+
+size_t
+BundleMuonConverter::FillRows(const I3MCTree &mctree, I3TableRowPtr rows)
+{
+	std::vector<float> energies, radii;
+	GetMuons(mctree, energies, radii);
+	
+	// The writer allocated the default single row; see the class
+	// documentation for why GetNumberOfRows() isn't overridden
+	rows->SetNumberOfRows(energies.size());
+	for (size_t i=0; i < energies.size(); i++) {
+		rows->SetCurrentRow(i);
+		rows->Set<uint32_t>("vector_index", uint32_t(i));
+		rows->Set<float>("energy", energies[i]);
+		rows->Set<float>("radius", radii[i]);
+	}
+	
+	return energies.size();
+}
+
+namespace {
+
+/*
+ * Take the bundle from a BundleRecord. Returns the log of the number of
+ * events generated by *generator* if the record came from (a multiple of)
+ * it, and NaN otherwise.
+ */
+double
+ReadBundle(const BundleRecord &record, const GenerationProbability &generator,
+    uint64_t generatorHash, I3Particle &axis, BundleSpec &bundlespec)
+{
+	axis = record.GetAxis();
+	bundlespec = record.GetBundle();
+	if (record.generatorHash == generatorHash && std::isfinite(record.logGenerationProbability))
+		return record.logGenerationProbability + std::log(generator.GetTotalEvents());
+	else
+		return NAN;
+}
+
+/*
+ * Harvest the muons in the bundle from the I3MCTree, with their energies
+ * at the point where the bundle axis enters the sampling surface.
+ */
+void
+HarvestBundle(I3MCTreeConstPtr mctreePtr, I3MMCTrackListConstPtr mmctracks,
+    I3VectorDoubleDoubleConstPtr omitted, const SamplingSurface &surface,
+    I3Particle &axis, BundleSpec &bundlespec)
+{
+	// First, harvest the muons in the bundle at their points of injection, storing
+	// everything that's necessary to estimate the energy lost up to an arbitrary point
+	const I3MCTree &mctree = *mctreePtr;
+	const I3MCTree::const_iterator primary = mctree.begin();
+	std::pair<double, double> steps =
+	    surface.GetIntersection(primary->GetPos(), primary->GetDir());
+	axis = *primary;
+	bundlespec.clear();
+	
+	if (mmctracks) {
+		BOOST_FOREACH(const Track &track, *Track::Harvest(mctreePtr, mmctracks)) {
+			// Omit secondary muons
+			boost::optional<I3Particle> parent = mctree.parent(track);
+			if (parent && parent->GetType() == I3Particle::NuclInt)
+				continue;
+			bundlespec.push_back(BundleEntry(
+			    GetRadius(*primary, track.GetPos(steps.first)), track.GetEnergy(steps.first)));
+		}
+	} else {
+		// log_warn("No MMCTrackList found in the frame! Assuming that everything starts on the sampling surface...");
+		BOOST_FOREACH(const I3Particle &track, std::make_pair(mctree.begin(), mctree.end())) {
+			if (track.GetType() == I3Particle::MuMinus || track.GetType() == I3Particle::MuPlus)
+				bundlespec.push_back(BundleEntry(
+				    GetRadius(*primary, track.GetPos()), track.GetEnergy()));
 		}
 	}
+	// Muons the generator left out for being below its energy threshold
+	if (omitted) {
+		typedef std::pair<double, double> radius_bound;
+		BOOST_FOREACH(const radius_bound &muon, *omitted)
+			bundlespec.push_back(BundleEntry(muon.first, muon.second, true));
+	}
+}
+
+/*
+ * The frame objects needed to weight a bundle. Getting them out of the
+ * frame may deserialize them, so this has to happen on the IceTray thread,
+ * but they can be used on any thread afterwards.
+ */
+struct FrameBundle {
+	FrameBundle(const I3Frame &frame, const std::string &recordName,
+	    const std::string &thinningName) : thinning(1.)
+	{
+		if (!recordName.empty())
+			record = frame.Get<BundleRecordConstPtr>(recordName);
+		if (!record) {
+			mctree = frame.Get<I3MCTreeConstPtr>();
+			if (!mctree)
+				log_fatal("I3MCTree missing!");
+			mmctracks = frame.Get<I3MMCTrackListConstPtr>("MMCTrackList");
+			omitted = frame.Get<I3VectorDoubleDoubleConstPtr>("MuonGunOmittedMuons");
+		}
+		// Make up for bundles that GeneratorModule thinned away
+		if (!thinningName.empty())
+			if (I3DoubleConstPtr weight = frame.Get<I3DoubleConstPtr>(thinningName))
+				thinning = weight->value;
+	}
 	
-	rows->Set("multiplicity", m);
+	/*
+	 * Fill in the bundle. Returns the log of the number of events generated
+	 * by *generator* if it is already known, and NaN otherwise.
+	 */
+	double Get(const GenerationProbability &generator, uint64_t generatorHash,
+	    I3Particle &axis, BundleSpec &bundlespec) const
+	{
+		if (record)
+			return ReadBundle(*record, generator, generatorHash, axis, bundlespec);
+		HarvestBundle(mctree, mmctracks, omitted, *generator.GetInjectionSurface(),
+		    axis, bundlespec);
+		return NAN;
+	}
 	
-	return 1;
+	BundleRecordConstPtr record;
+	I3MCTreeConstPtr mctree;
+	I3MMCTrackListConstPtr mmctracks;
+	I3VectorDoubleDoubleConstPtr omitted;
+	double thinning;
+};
+
+const char *bundle_record_description = "Name of the BundleRecord stored by "
+    "GeneratorModule. If present, the bundle is taken from it "
+    "instead of the I3MCTree, along with its generation probability "
+    "if Generator is (a multiple of) the one that made it. Set to "
+    "an empty string to always use the I3MCTree.";
+
+const char *thinning_weight_description = "Name of the weight stored by "
+    "GeneratorModule for bundles that survived thinning. If present, "
+    "it is multiplied into the weight. Set to an empty string to "
+    "ignore it.";
+
 }
 
+/**
+ * @brief Common parts of the weighting modules
+ *
+ * Takes the bundle from each DAQ frame and stores the weight calculated
+ * by the derived class. If NThreads > 0, DAQ frames are held back while
+ * their weights are calculated on a pool of threads, and all frames are
+ * emitted in the order they arrived.
+ */
+class WeightModule : public I3Module {
+public:
+	WeightModule(const I3Context &ctx) : I3Module(ctx), nThreads_(0), queueDepth_(0),
+	    numWeighing_(0)
+	{
+		AddOutBox("OutBox");
+		AddParameter("BundleRecord", bundle_record_description, "MuonGunBundle");
+		AddParameter("ThinningWeight", thinning_weight_description, "MuonGunThinningWeight");
+		AddParameter("NThreads", "Number of threads to calculate weights on. "
+		    "If 0, calculate the weight of each frame on the IceTray thread "
+		    "as it arrives.", nThreads_);
+		AddParameter("QueueDepth", "Maximum number of DAQ frames to hold "
+		    "back while their weights are calculated when NThreads > 0. "
+		    "If 0, use 4*NThreads.", queueDepth_);
+	}
+	
+	/** Called by derived classes once the generator is configured */
+	void Configure()
+	{
+		GetParameter("BundleRecord", recordName_);
+		GetParameter("ThinningWeight", thinningName_);
+		GetParameter("NThreads", nThreads_);
+		GetParameter("QueueDepth", queueDepth_);
+		
+		generatorHash_ = BundleRecord::GetGeneratorHash(GetGenerationProbability());
+		if (nThreads_ > 0) {
+			if (queueDepth_ == 0)
+				queueDepth_ = 4*nThreads_;
+			// Fill in lazy normalizations before more than one thread
+			// can touch them
+			GetGenerationProbability().Prepare();
+			pool_.reset(new ThreadPool(nThreads_));
+		}
+	}
+	
+	void Process()
+	{
+		if (!pool_) {
+			I3Module::Process();
+			return;
+		}
+		
+		I3FramePtr frame = PopFrame();
+		if (!frame)
+			return;
+		Pending pending;
+		pending.frame = frame;
+		if (frame->GetStop() == I3Frame::DAQ) {
+			boost::shared_ptr<const FrameBundle> bundle =
+			    boost::make_shared<FrameBundle>(*frame, recordName_, thinningName_);
+			boost::shared_ptr<std::promise<I3FrameObjectPtr> > result =
+			    boost::make_shared<std::promise<I3FrameObjectPtr> >();
+			pending.weight = result->get_future();
+			std::function<void ()> task = [this, bundle, result]()
+			{
+				try {
+					result->set_value(Weigh(*bundle));
+				} catch (...) {
+					result->set_exception(std::current_exception());
+				}
+			};
+			pool_->Submit(task);
+			numWeighing_++;
+		}
+		queue_.push_back(std::move(pending));
+		
+		Emit(queueDepth_);
+	}
+	
+	void DAQ(I3FramePtr frame)
+	{
+		frame->Put(GetName(), Weigh(FrameBundle(*frame, recordName_, thinningName_)));
+		PushFrame(frame);
+	}
+	
+	void Finish()
+	{
+		// Flush everything still held back
+		Emit(0);
+		pool_.reset();
+	}
+protected:
+	virtual const GenerationProbability& GetGenerationProbability() const = 0;
+	/**
+	 * Calculate the object to store in the frame. This may be called on
+	 * several threads at once.
+	 */
+	virtual I3FrameObjectPtr CalculateWeight(const BundleKinematics &kinematics,
+	    double logGeneratedEvents, double thinning) const = 0;
+private:
+	struct Pending {
+		I3FramePtr frame;
+		/** The weight to store in the frame, if it is a DAQ frame */
+		std::future<I3FrameObjectPtr> weight;
+	};
+	
+	I3FrameObjectPtr Weigh(const FrameBundle &bundle) const
+	{
+		I3Particle axis;
+		BundleSpec bundlespec;
+		double logGeneratedEvents = bundle.Get(GetGenerationProbability(), generatorHash_,
+		    axis, bundlespec);
+		
+		return CalculateWeight(BundleKinematics(axis, bundlespec), logGeneratedEvents,
+		    bundle.thinning);
+	}
+	
+	/**
+	 * Emit frames from the front of the queue until no more than *depth*
+	 * DAQ frames are left in it, or the next one has to wait for its
+	 * weight
+	 */
+	void Emit(size_t depth)
+	{
+		while (!queue_.empty() && (numWeighing_ > depth || !queue_.front().weight.valid())) {
+			Pending &pending = queue_.front();
+			if (pending.weight.valid()) {
+				pending.frame->Put(GetName(), pending.weight.get());
+				numWeighing_--;
+			}
+			PushFrame(pending.frame);
+			queue_.pop_front();
+		}
+	}
+	
+	std::string recordName_, thinningName_;
+	uint64_t generatorHash_;
+	
+	unsigned nThreads_;
+	unsigned queueDepth_;
+	boost::scoped_ptr<ThreadPool> pool_;
+	std::deque<Pending> queue_;
+	size_t numWeighing_;
+};
+
 /**
  * @brief Interface between WeightCalculator and IceTray
  *
  * WeightCalculatorModule handles the details of extracting energies and
- * radial offsets of muons from an I3MCTree and MMCTrackList.
+ * radial offsets of muons from an I3MCTree and MMCTrackList. Frames from
+ * GeneratorModule carry a BundleRecord with the same information, which is
+ * used instead when present.
  */
-class WeightCalculatorModule : public I3Module, protected WeightCalculator {
+class WeightCalculatorModule : public WeightModule, protected WeightCalculator {
 public:
-	WeightCalculatorModule(const I3Context &ctx) : I3Module(ctx)
+	WeightCalculatorModule(const I3Context &ctx) : WeightModule(ctx)
 	{
-		AddOutBox("OutBox");
 		AddParameter("Model", "Muon flux model for which to calculate a weight", boost::shared_ptr<BundleModel>());
 		AddParameter("Generator", "Generation spectrum for the bundles to be weighted", generator_);
 	}
@@ -214,53 +711,98 @@ public:
 		surface_ = generator_->GetInjectionSurface();
 		if (!surface_)
 			log_fatal("No surface configured!");
+		
+		WeightModule::Configure();
 	}
 	
-	void DAQ(I3FramePtr frame)
+	void Finish();
+protected:
+	const GenerationProbability& GetGenerationProbability() const { return *generator_; }
+	
+	I3FrameObjectPtr CalculateWeight(const BundleKinematics &kinematics,
+	    double logGeneratedEvents, double thinning) const
 	{
-		// First, harvest the muons in the bundle at their points of injection, storing
-		// everything that's necessary to estimate the energy lost up to an arbitrary point
-		I3MCTreeConstPtr mctree = frame->Get<I3MCTreeConstPtr>();
-		I3MMCTrackListConstPtr mmctracks = frame->Get<I3MMCTrackListConstPtr>("MMCTrackList");
-		if (!mctree)
-			log_fatal("I3MCTree missing!");
-		// if (!mmctracks)
-		// 	log_fatal("I3MMCTrackList missing!");
+		double weight = std::isfinite(logGeneratedEvents) ?
+		    GetWeight(kinematics, logGeneratedEvents) : GetWeight(kinematics);
 		
-		const I3MCTree::const_iterator primary = mctree->begin();
-		std::pair<double, double> steps =
-		    surface_->GetIntersection(primary->GetPos(), primary->GetDir());
-		BundleConfiguration bundlespec;
+		return boost::make_shared<I3Double>(thinning*weight);
+	}
+};
+
+// Out-of-line virtual method definition to force the vtable into this translation unit
+void WeightCalculatorModule::Finish() { WeightModule::Finish(); }
+
+/**
+ * @brief Interface between MultiModelWeightCalculator and IceTray
+ *
+ * Like WeightCalculatorModule, but stores an I3MapStringDouble with one
+ * weight for each of the named models.
+ */
+class MultiModelWeightCalculatorModule : public WeightModule {
+public:
+	MultiModelWeightCalculatorModule(const I3Context &ctx) : WeightModule(ctx)
+	{
+		AddParameter("Models", "A dict of muon flux models for which to "
+		    "calculate weights, keyed by the name to store each weight under",
+		    boost::python::dict());
+		AddParameter("Generator", "Generation spectrum for the bundles to be weighted",
+		    GenerationProbabilityPtr());
+	}
+	
+	void Configure()
+	{
+		boost::python::dict models;
+		GenerationProbabilityPtr generator;
+		GetParameter("Models", models);
+		GetParameter("Generator", generator);
 		
-		if (mmctracks) {
-			std::list<Track> tracks = Track::Harvest(*mctree, *mmctracks);
-			BOOST_FOREACH(const Track &track, tracks) {
-				// Omit secondary muons
-				boost::optional<I3Particle> parent = mctree->parent(track);
-				if (parent && parent->GetType() == I3Particle::NuclInt)
-					continue;
-				bundlespec.push_back(BundleEntry(
-				    GetRadius(*primary, track.GetPos(steps.first)), track.GetEnergy(steps.first)));
-			}
-		} else {
-			// log_warn("No MMCTrackList found in the frame! Assuming that everything starts on the sampling surface...");
-			BOOST_FOREACH(const I3Particle &track, std::make_pair(mctree->begin(), mctree->end())) {
-				if (track.GetType() == I3Particle::MuMinus || track.GetType() == I3Particle::MuPlus)
-					bundlespec.push_back(BundleEntry(
-					    GetRadius(*primary, track.GetPos()), track.GetEnergy()));
-			}
+		std::vector<BundleModel> bundleModels;
+		boost::python::list keys = models.keys();
+		for (int i=0; i < boost::python::len(keys); i++) {
+			names_.push_back(boost::python::extract<std::string>(keys[i]));
+			bundleModels.push_back(boost::python::extract<BundleModel>(models[keys[i]]));
 		}
+		if (bundleModels.empty())
+			log_fatal("No flux models configured!");
+		if (!generator)
+			log_fatal("No generator configured!");
+		if (!generator->GetInjectionSurface())
+			log_fatal("No surface configured!");
 		
-		frame->Put(GetName(), boost::make_shared<I3Double>(GetWeight(*primary, bundlespec)));
-		PushFrame(frame);
+		generator_ = generator;
+		calculator_.reset(new MultiModelWeightCalculator(bundleModels, generator));
+		
+		WeightModule::Configure();
 	}
 	
 	void Finish();
+protected:
+	const GenerationProbability& GetGenerationProbability() const { return *generator_; }
+	
+	I3FrameObjectPtr CalculateWeight(const BundleKinematics &kinematics,
+	    double logGeneratedEvents, double thinning) const
+	{
+		boost::container::small_vector<double, 8> values(names_.size());
+		if (std::isfinite(logGeneratedEvents))
+			calculator_->GetWeights(kinematics, logGeneratedEvents, &values[0]);
+		else
+			calculator_->GetWeights(kinematics, &values[0]);
+		
+		I3MapStringDoublePtr weights = boost::make_shared<I3MapStringDouble>();
+		for (size_t k=0; k < names_.size(); k++)
+			(*weights)[names_[k]] = thinning*values[k];
+		
+		return weights;
+	}
+private:
+	std::vector<std::string> names_;
+	GenerationProbabilityConstPtr generator_;
+	boost::scoped_ptr<MultiModelWeightCalculator> calculator_;
 };
 
-// Out-of-line virtual method definition to force the vtable into this translation unit
-void WeightCalculatorModule::Finish() {}
+void MultiModelWeightCalculatorModule::Finish() { WeightModule::Finish(); }
 
 }
 
 I3_MODULE(I3MuonGun::WeightCalculatorModule);
+I3_MODULE(I3MuonGun::MultiModelWeightCalculatorModule);
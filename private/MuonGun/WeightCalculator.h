@@ -64,7 +64,37 @@ public:
 	 *                   in the bundle
 	 * @returns a weight in units of @f$ [s^{-1}] @f$
 	 */
-	double GetWeight(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	double GetWeight(const I3Particle &axis, const BundleSpec &bundle) const;
+	/**
+	 * Calculate a weight as above, with a generation probability that
+	 * is already known, e.g. from a BundleRecord
+	 *
+	 * @param[in] logGeneratedEvents the value of
+	 *            GenerationProbability::GetLogGeneratedEvents(axis, bundle)
+	 */
+	double GetWeight(const I3Particle &axis, const BundleSpec &bundle,
+	    double logGeneratedEvents) const;
+	/**
+	 * Calculate a weight from kinematics that were already calculated,
+	 * and share them with the generation probability
+	 */
+	double GetWeight(const BundleKinematics &kinematics) const;
+	double GetWeight(const BundleKinematics &kinematics, double logGeneratedEvents) const;
+	
+	/**
+	 * Calculate weights for many bundles at once, spread over a pool of
+	 * threads. This is equivalent to calling GetWeight() on each bundle
+	 * in turn, but much faster for large batches.
+	 *
+	 * @param[in]  batch    The bundles to weight
+	 * @param[out] weights  Resized to batch.size(), and filled with the
+	 *                      weight of each bundle
+	 * @param[in]  nthreads Number of threads to use. If 0, use one per
+	 *                      hardware thread.
+	 */
+	void GetWeights(const BundleBatch &batch, std::vector<double> &weights,
+	    unsigned nthreads=0) const;
+	std::vector<double> GetWeights(const BundleBatch &batch, unsigned nthreads=0) const;
 	 
 	SamplingSurfaceConstPtr GetSurface() { return surface_; }
 	void SetSurface(SamplingSurfacePtr s) { surface_ = s; }
@@ -78,15 +108,105 @@ protected:
 	GenerationProbabilityConstPtr generator_;
 };
 
+/**
+ * @brief Utility class to calculate weights for muon bundles under several
+ *        flux models at once
+ *
+ * The kinematics of the bundle and its generation probability don't depend
+ * on the flux model, so they are calculated once per bundle and shared
+ * between the models.
+ */
+class MultiModelWeightCalculator {
+public:
+	/**
+	 * @param[in] models Target models of the muon flux
+	 * @param[in] g      Generation scheme according to which the
+	 *                   events were generated.
+	 */
+	MultiModelWeightCalculator(const std::vector<BundleModel> &models, GenerationProbabilityPtr g);
+	
+	size_t GetNumModels() const { return models_.size(); }
+	
+	/**
+	 * Calculate the weight of a bundle under each of the models
+	 *
+	 * @returns one weight per model, in units of @f$ [s^{-1}] @f$
+	 */
+	std::vector<double> GetWeights(const I3Particle &axis, const BundleSpec &bundle) const;
+	/**
+	 * Calculate the weight of a bundle under each of the models, and store
+	 * them in the GetNumModels() elements starting at *weights*
+	 */
+	void GetWeights(const BundleKinematics &kinematics, double *weights) const;
+	void GetWeights(const BundleKinematics &kinematics, double logGeneratedEvents,
+	    double *weights) const;
+	
+	/**
+	 * Calculate weights for a batch of bundles, as in
+	 * WeightCalculator::GetWeights()
+	 *
+	 * @param[out] weights Resized to batch.size() rows of GetNumModels()
+	 *                     weights each
+	 */
+	void GetWeights(const BundleBatch &batch, std::vector<double> &weights,
+	    unsigned nthreads=0) const;
+	std::vector<double> GetWeights(const BundleBatch &batch, unsigned nthreads=0) const;
+	
+	SamplingSurfaceConstPtr GetSurface() const { return generator_->GetInjectionSurface(); }
+private:
+	std::vector<WeightCalculator> models_;
+	GenerationProbabilityConstPtr generator_;
+};
+
+/**
+ * @brief Book the parameters needed to weight a muon bundle
+ *
+ * Writes one row per event with the multiplicity of the bundle and the
+ * energies and radial offsets of up to maxMultiplicity muons at the
+ * sampling surface. With maxMultiplicity=0 the muons are left out
+ * entirely, so that they can be booked with BundleMuonConverter instead.
+ */
 class MuonBundleConverter : public I3ConverterImplementation<I3MCTree> {
 public:
 	MuonBundleConverter(size_t maxMultiplicity=25, SamplingSurfaceConstPtr surface=SamplingSurfaceConstPtr());
 	I3TableRowDescriptionPtr CreateDescription(const I3MCTree&);
 	size_t FillRows(const I3MCTree&, I3TableRowPtr);
+	
+	using I3ConverterImplementation<I3MCTree>::Convert;
+	size_t Convert(I3FrameObjectConstPtr, I3TableRowPtr, I3FramePtr);
+protected:
+	/**
+	 * Get the energies and radial offsets of the muons that reach the
+	 * sampling surface, in the order they appear in the I3MCTree
+	 */
+	void GetMuons(const I3MCTree&, std::vector<float> &energies, std::vector<float> &radii);
 private:
 	SET_LOGGER("I3MuonGun::WeightCalculator");
 	size_t maxMultiplicity_;
 	SamplingSurfaceConstPtr surface_;
+	// The tree being converted, if it came with a shared pointer
+	I3MCTreeConstPtr mctree_;
+};
+
+/**
+ * @brief Book the muons of a bundle, one row per muon
+ *
+ * The companion of MuonBundleConverter with maxMultiplicity=0. Each event
+ * gets as many rows as MuonBundleConverter counts in its multiplicity
+ * column, with the energy and radial offset of each muon, so that no muons
+ * are lost and no space is wasted on small bundles. Bundles without muons
+ * at the sampling surface get no rows.
+ *
+ * The number of rows depends on the I3MMCTrackList as well as on the
+ * I3MCTree, and tableio hands the frame to the converter only in Convert().
+ * Rather than overriding GetNumberOfRows(), which sees only the tree,
+ * FillRows() sizes the rows itself once it has found the muons.
+ */
+class BundleMuonConverter : public MuonBundleConverter {
+public:
+	BundleMuonConverter(SamplingSurfaceConstPtr surface=SamplingSurfaceConstPtr());
+	I3TableRowDescriptionPtr CreateDescription(const I3MCTree&);
+	size_t FillRows(const I3MCTree&, I3TableRowPtr);
 };
 
 }
@@ -60,6 +60,7 @@ void register_EnergyDistribution()
 	class_<SplineEnergyDistribution, boost::shared_ptr<SplineEnergyDistribution>,
 	    bases<EnergyDistribution> >("SplineEnergyDistribution",
 	    init<const std::string&, const std::string&>((arg("singles"), "bundles")))
+	    .add_property("truncated", &SplineEnergyDistribution::IsTruncated)
 	;
 	
 	class_<BMSSEnergyDistribution, boost::shared_ptr<BMSSEnergyDistribution>,
@@ -77,5 +78,17 @@ void register_EnergyDistribution()
 	    DEF("__call__", &OffsetPowerLaw::operator(), (arg("energy")))
 	    .def("generate", &OffsetPowerLaw::Generate)
 	    DEF("isf", &OffsetPowerLaw::InverseSurvivalFunction, (arg("p")))
+	    DEF("log_cdf", &OffsetPowerLaw::GetLogCumulative, (arg("energy")))
+	;
+	
+	class_<PiecewisePowerLaw, PiecewisePowerLawPtr>("PiecewisePowerLaw",
+	    init<const std::vector<double>&, const std::vector<double>&>((arg("energies"), "log_density")))
+	    DEF("__call__", &PiecewisePowerLaw::operator(), (arg("energy")))
+	    .def("generate", &PiecewisePowerLaw::Generate)
+	    DEF("isf", &PiecewisePowerLaw::InverseSurvivalFunction, (arg("p")))
+	    DEF("log_cdf", &PiecewisePowerLaw::GetLogCumulative, (arg("energy")))
+	    .add_property("energies", &PiecewisePowerLaw::GetEnergies)
+	    .add_property("log_density", make_function(&PiecewisePowerLaw::GetLogDensity,
+	        return_value_policy<copy_const_reference>()))
 	;
 }
@@ -7,10 +7,84 @@
  */
 
 #include <MuonGun/Generator.h>
+#include <MuonGun/BundleRecord.h>
 #include <MuonGun/SamplingSurface.h>
+#include <MuonGun/ShardPlan.h>
+#include <MuonGun/ThinningFunction.h>
 #include <dataclasses/physics/I3Particle.h>
 #include <icetray/python/dataclass_suite.hpp>
+#include <icetray/python/gil_holder.hpp>
 #include <serialization/list.hpp>
+#include <boost/python/stl_iterator.hpp>
+#include <phys-services/I3RandomService.h>
+
+#ifdef USE_NUMPY
+#if BOOST_VERSION < 106300
+#include <boost/numpy.hpp>
+#define BOOST_NUMPY boost::numpy
+#else
+#include <boost/python/numpy.hpp>
+#define BOOST_NUMPY boost::python::numpy
+#endif // BOOST_VERSION < 106300
+
+namespace {
+
+template <typename T>
+boost::python::object
+to_ndarray(const std::vector<T> &values)
+{
+	using namespace BOOST_NUMPY;
+	ndarray array = zeros(boost::python::make_tuple(values.size()), dtype::get_builtin<T>());
+	std::copy(values.begin(), values.end(), reinterpret_cast<T*>(array.get_data()));
+	return array;
+}
+
+// Return the columns of a BundleBatch as a dict of Numpy arrays
+boost::python::dict
+GenerateBatch(const I3MuonGun::Generator &self, I3RandomService &rng, size_t n)
+{
+	I3MuonGun::BundleBatch batch = self.GenerateBatch(rng, n);
+	boost::python::dict columns;
+	columns["x"] = to_ndarray(batch.x);
+	columns["y"] = to_ndarray(batch.y);
+	columns["z"] = to_ndarray(batch.z);
+	columns["zenith"] = to_ndarray(batch.zenith);
+	columns["azimuth"] = to_ndarray(batch.azimuth);
+	columns["multiplicity"] = to_ndarray(batch.multiplicity);
+	columns["offsets"] = to_ndarray(batch.offsets);
+	columns["radius"] = to_ndarray(batch.radius);
+	columns["energy"] = to_ndarray(batch.energy);
+	
+	return columns;
+}
+
+}
+#endif // USE_NUMPY
+
+namespace I3MuonGun {
+
+class PyThinningFunction : public ThinningFunction, public boost::python::wrapper<ThinningFunction> {
+public:
+	double GetKeepProbability(const I3Particle &axis, const BundleSpec &bundle) const
+	{
+		detail::gil_holder lock;
+		return get_override("GetKeepProbability")(axis, bundle);
+	}
+};
+
+}
+
+static I3MuonGun::BundleEntry
+GetBundleEntry(const I3MuonGun::BundleSpec &self, int i)
+{
+	if (i < 0)
+		i += int(self.size());
+	if (i < 0 || size_t(i) >= self.size()) {
+		PyErr_SetString(PyExc_IndexError, "Index out of range");
+		boost::python::throw_error_already_set();
+	}
+	return self[i];
+}
 
 static I3MuonGun::SamplingSurfacePtr
 GetInjectionSurface(const I3MuonGun::GenerationProbability &self)
@@ -18,6 +92,30 @@ GetInjectionSurface(const I3MuonGun::GenerationProbability &self)
 	return boost::const_pointer_cast<I3MuonGun::SamplingSurface>(self.GetInjectionSurface());
 }
 
+static I3MuonGun::GenerationProbabilityPtr
+GetCombined(const I3MuonGun::ShardPlan &self, boost::python::object indices)
+{
+	if (indices.ptr() == Py_None)
+		return self.GetCombined();
+	std::vector<unsigned> shards;
+	boost::python::stl_input_iterator<unsigned> it(indices), end;
+	std::copy(it, end, std::back_inserter(shards));
+	return self.GetCombined(shards);
+}
+
+static bool
+Covers(const I3MuonGun::GenerationProbability &self, const I3Particle &axis,
+    const I3MuonGun::BundleSpec &bundle)
+{
+	return self.Covers(I3MuonGun::BundleKinematics(axis, bundle));
+}
+
+static size_t
+GetCollectionSize(const I3MuonGun::GenerationProbabilityCollection &self)
+{
+	return self.size();
+}
+
 void register_Generator()
 {
 	using namespace I3MuonGun;
@@ -31,20 +129,115 @@ void register_Generator()
 	    .def("__mul__",  (GenerationProbabilityPtr (*)(GenerationProbabilityPtr, double))(&operator*))
 	    .def("__rmul__", (GenerationProbabilityPtr (*)(GenerationProbabilityPtr, double))(&operator*))
 	    .def("__imul__", (GenerationProbabilityPtr (*)(GenerationProbabilityPtr, double))(&operator*=))
+	    .def("covers", &Covers, (arg("axis"), "bundle"),
+	        "Could this scheme have generated the given bundle at all?")
+	    .def("prepare", &GenerationProbability::Prepare,
+	        "Compute lazily evaluated normalizations, e.g. before using the "
+	        "scheme on several threads")
 	;
 	implicitly_convertible<GenerationProbabilityPtr, GenerationProbabilityConstPtr>();
 	register_pointer_conversions<GenerationProbability>();
 	
+	class_<GenerationProbabilityCollection, bases<GenerationProbability>,
+	    boost::shared_ptr<GenerationProbabilityCollection>, boost::noncopyable>(
+	    "GenerationProbabilityCollection", no_init)
+	    .def("__len__", &GetCollectionSize)
+	    .add_property("nthreads", &GenerationProbabilityCollection::GetNumThreads,
+	        &GenerationProbabilityCollection::SetNumThreads,
+	        "Number of threads to evaluate members on (0 for serial evaluation)")
+	;
+	
 	class_<Generator, bases<GenerationProbability, I3FrameObject>, boost::noncopyable>("Generator", no_init)
+#ifdef USE_NUMPY
+	    .def("generate_batch", &GenerateBatch, (arg("rng"), "n"),
+	        "Generate n bundles without building I3MCTrees. Returns a dict of "
+	        "arrays; the radii and energies of bundle i are in the slice "
+	        "offsets[i]:offsets[i+1].")
+#endif
+	    .def("hits_target", &Generator::HitsTarget, (arg("tree"), "target"),
+	        "Does the bundle axis or any muon in the tree reach the target surface?")
+	    .staticmethod("hits_target")
 	;
 	register_pointer_conversions<Generator>();
 	
-	class_<BundleEntry>("BundleEntry", init<double, double>())
+	class_<Shard>("Shard", no_init)
+	    .def_readonly("index", &Shard::index)
+	    .def_readonly("first_event", &Shard::firstEvent)
+	    .def_readonly("nevents", &Shard::numEvents)
+	    .def_readonly("seed", &Shard::seed)
+	;
+	
+	class_<ShardPlan>("ShardPlan", "Deterministically divide a generation "
+	    "campaign into jobs.", init<GenerationProbabilityConstPtr, uint64_t, unsigned, uint32_t>(
+	    (arg("generator"), "nevents", "nshards", arg("seed")=0)))
+	    .def("__len__", &ShardPlan::GetNumShards)
+	    .def("__getitem__", &ShardPlan::GetShard, return_internal_reference<>())
+	    .add_property("total_events", &ShardPlan::GetTotalEvents)
+	    .def("generator", &ShardPlan::GetGenerator, arg("index"),
+	        "Get the distribution to generate the given shard from")
+	    .def("combined", &GetCombined, (arg("self"), arg("shards")=object()),
+	        "Get the generation probability for the given shards (by default, "
+	        "all of them). This is cheap, and can be used to weight a partial "
+	        "campaign.")
+	;
+	
+	class_<BundleEntry>("BundleEntry", init<double, double, optional<bool> >())
 	    .def_readwrite("radius", &BundleEntry::radius)
 	    .def_readwrite("energy", &BundleEntry::energy)
+	    .def_readwrite("omitted", &BundleEntry::omitted)
 	;
 	
 	class_<BundleConfiguration, boost::shared_ptr<BundleConfiguration> >("BundleConfiguration")
 	    .def(list_indexing_suite<BundleConfiguration>())
 	;
+	
+	class_<BundleSpec, boost::shared_ptr<BundleSpec> >("BundleSpec",
+	    "The radial offset and energy of each muon in a bundle, stored as parallel arrays")
+	    .def(init<const BundleConfiguration&>(arg("entries")))
+	    .def("__len__", &BundleSpec::size)
+	    .def("__getitem__", &GetBundleEntry)
+	    .def("__iter__", range(&BundleSpec::begin, &BundleSpec::end))
+	    .def("append", &BundleSpec::push_back)
+	    .def("sort", &BundleSpec::sort)
+	    .add_property("entries", &BundleSpec::GetEntries)
+	    .add_property("multiplicity", &BundleSpec::GetMultiplicity)
+	    .add_property("max_energy", &BundleSpec::GetMaxEnergy)
+	    .def(self == self)
+	;
+	implicitly_convertible<BundleConfiguration, BundleSpec>();
+	
+	class_<BundleRecord, BundleRecordPtr, bases<I3FrameObject> >("BundleRecord",
+	    "The axis, muons, and generation probability of a bundle from GeneratorModule")
+	    .def(init<const I3Particle&, const BundleSpec&>((arg("axis"), "bundle")))
+	    .def_readwrite("pos", &BundleRecord::pos)
+	    .def_readwrite("dir", &BundleRecord::dir)
+	    .def_readwrite("radius", &BundleRecord::radius)
+	    .def_readwrite("energy", &BundleRecord::energy)
+	    .def_readwrite("omitted_radius", &BundleRecord::omittedRadius)
+	    .def_readwrite("omitted_energy", &BundleRecord::omittedEnergy)
+	    .def_readwrite("log_generation_probability", &BundleRecord::logGenerationProbability)
+	    .def_readwrite("generator_hash", &BundleRecord::generatorHash)
+	    .add_property("axis", &BundleRecord::GetAxis)
+	    .add_property("bundle", &BundleRecord::GetBundle)
+	    .def("generator_hash_of", &BundleRecord::GetGeneratorHash, arg("generator"))
+	    .staticmethod("generator_hash_of")
+	    .def(dataclass_suite<BundleRecord>())
+	;
+	register_pointer_conversions<BundleRecord>();
+	
+	class_<ThinningFunction, ThinningFunctionPtr, boost::noncopyable>("ThinningFunction", no_init)
+	    .def("__call__", &ThinningFunction::GetKeepProbability, (arg("axis"), "bundle"))
+	;
+	
+	class_<EnergyThinning, boost::shared_ptr<EnergyThinning>, bases<ThinningFunction> >("EnergyThinning",
+	    "Keep bundles with probability max(min_probability, min(1, (E/reference_energy)**index)), "
+	    "where E is the total energy of the muons in the bundle",
+	    init<double, double, double>((arg("reference_energy"), arg("index")=1., arg("min_probability")=1e-3)))
+	;
+	
+	class_<PyThinningFunction, boost::shared_ptr<PyThinningFunction>, bases<ThinningFunction>,
+	    boost::noncopyable>("ThinningFunctionBase", "Subclass this and implement "
+	    "GetKeepProbability(axis, bundle) to thin bundles from Python")
+	    .def("GetKeepProbability", pure_virtual(&ThinningFunction::GetKeepProbability))
+	;
 }
@@ -7,9 +7,35 @@
  */
 
 #include <MuonGun/I3MuonGun.h>
+#include <MuonGun/NormalizationCache.h>
+#include <MuonGun/CounterRandomService.h>
+#include <MuonGun/QuasiRandomService.h>
 #include <dataclasses/I3Position.h>
 #include <dataclasses/I3Direction.h>
 
+static void
+SetNormalizationCache(const std::string &path)
+{
+	I3MuonGun::NormalizationCache::GetInstance().SetDirectory(path);
+}
+
+static std::string
+GetNormalizationCache()
+{
+	return I3MuonGun::NormalizationCache::GetInstance().GetDirectory();
+}
+
+static I3MuonGun::RQMCEstimate
+EstimateRQMC(const I3MuonGun::Generator &generator, boost::python::object f,
+    size_t points, I3RandomServicePtr rng, unsigned scrambles, unsigned dimensions)
+{
+	return I3MuonGun::EstimateRQMC(generator,
+	    [f](const I3Particle &axis, const I3MuonGun::BundleSpec &bundle)
+	    {
+		return boost::python::extract<double>(f(axis, bundle))();
+	    }, points, scrambles, dimensions, rng);
+}
+
 void
 register_I3MuonGun()
 {
@@ -17,4 +43,42 @@ register_I3MuonGun()
 	namespace bp = boost::python;
 	
 	bp::def("depth", &GetDepth, "Convert a z coordinate to a depth.");
+	bp::def("set_normalization_cache", &SetNormalizationCache, bp::arg("path"),
+	    "Store generator normalization integrals in the given directory so "
+	    "that they can be reused by other processes. Pass an empty string to "
+	    "disable the on-disk cache.");
+	bp::def("get_normalization_cache", &GetNormalizationCache);
+	
+	bp::class_<CounterRandomService, CounterRandomServicePtr,
+	    bp::bases<I3RandomService>, boost::noncopyable>("CounterRandomService",
+	    "A counter-based (Philox4x32-10) random number generator whose "
+	    "stream is determined entirely by (run, event, stream).",
+	    bp::init<uint32_t, uint64_t, uint32_t>((bp::arg("run"), bp::arg("event"), bp::arg("stream")=0)))
+	    .def("set_event", &CounterRandomService::SetEvent)
+	;
+	bp::implicitly_convertible<CounterRandomServicePtr, I3RandomServicePtr>();
+	
+	bp::class_<QuasiRandomService, QuasiRandomServicePtr,
+	    bp::bases<I3RandomService>, boost::noncopyable>("QuasiRandomService",
+	    "A scrambled Sobol sequence that supplies the first *dimensions* "
+	    "uniform numbers after each call to next_point(), and draws the rest "
+	    "from a pseudo-random service.",
+	    bp::init<unsigned, I3RandomServicePtr>((bp::arg("dimensions"), bp::arg("rng"))))
+	    .def("next_point", &QuasiRandomService::NextPoint)
+	    .def("set_point", &QuasiRandomService::SetPoint, bp::arg("index"))
+	    .add_property("dimensions", &QuasiRandomService::GetDimensions)
+	    .add_static_property("max_dimensions", &QuasiRandomService::GetMaxDimensions)
+	;
+	bp::implicitly_convertible<QuasiRandomServicePtr, I3RandomServicePtr>();
+	
+	bp::class_<RQMCEstimate>("RQMCEstimate", bp::no_init)
+	    .def_readonly("mean", &RQMCEstimate::mean)
+	    .def_readonly("error", &RQMCEstimate::error)
+	;
+	bp::def("estimate_rqmc", &EstimateRQMC,
+	    (bp::arg("generator"), "f", "points", "rng", bp::arg("scrambles")=8,
+	    bp::arg("dimensions")=8),
+	    "Estimate the mean of f(axis, bundle) over the generator's "
+	    "distribution with several independently scrambled Sobol sequences, "
+	    "returning the mean and its standard error.");
 }
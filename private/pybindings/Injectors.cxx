@@ -12,6 +12,20 @@
 #include <MuonGun/NaturalRateInjector.h>
 #include <icetray/python/function.hpp>
 
+template <typename T>
+static boost::python::tuple
+GetZenithRange(const T &self)
+{
+	return boost::python::make_tuple(self.GetZenithRange().first, self.GetZenithRange().second);
+}
+
+template <typename T>
+static boost::python::tuple
+GetAzimuthRange(const T &self)
+{
+	return boost::python::make_tuple(self.GetAzimuthRange().first, self.GetAzimuthRange().second);
+}
+
 void
 register_CanCan()
 {
@@ -21,19 +35,35 @@ register_CanCan()
 	class_<StaticSurfaceInjector, bases<Generator> >("StaticSurfaceInjector")
 		.def(init<SamplingSurfacePtr, FluxPtr,
 		    boost::shared_ptr<OffsetPowerLaw>, RadialDistributionPtr>())
-		#define PROPS (Flux)(RadialDistribution)(EnergyDistribution)
+		#define PROPS (Flux)(RadialDistribution)(EnergyDistribution)(EnergyProposal)(MuonEnergyThreshold)
 		BOOST_PP_SEQ_FOR_EACH(WRAP_PROP, StaticSurfaceInjector, PROPS)
 		#undef PROPS
 		.add_property("total_rate", &StaticSurfaceInjector::GetTotalRate)
+		.def("fit_energy_proposal", &StaticSurfaceInjector::FitEnergyProposal,
+		    (arg("target"), arg("rng"), arg("samples")=10000, arg("knots")=24, arg("defensive")=0.1),
+		    "Replace the OffsetPowerLaw with a PiecewisePowerLaw fit to the "
+		    "per-muon energy spectrum of the target EnergyDistribution")
+		.def("set_zenith_range", &StaticSurfaceInjector::SetZenithRange, (arg("cos_min"), arg("cos_max")),
+		    "Only generate bundle axes with cos(zenith) in [cos_min, cos_max]")
+		.def("set_azimuth_range", &StaticSurfaceInjector::SetAzimuthRange, (arg("min"), arg("max")),
+		    "Only generate bundle axes with azimuth in [min, max]")
+		.add_property("zenith_range", &GetZenithRange<StaticSurfaceInjector>)
+		.add_property("azimuth_range", &GetAzimuthRange<StaticSurfaceInjector>)
 	;
 	
 	class_<NaturalRateInjector, bases<Generator> >("NaturalRateInjector")
 		.def(init<SamplingSurfacePtr, FluxPtr,
 		    EnergyDistributionPtr>())
-		#define PROPS (Flux)(EnergyDistribution)
+		#define PROPS (Flux)(EnergyDistribution)(MuonEnergyThreshold)
 		BOOST_PP_SEQ_FOR_EACH(WRAP_PROP, NaturalRateInjector, PROPS)
 		#undef PROPS
 		.add_property("total_rate", &NaturalRateInjector::GetTotalRate)
+		.def("set_zenith_range", &NaturalRateInjector::SetZenithRange, (arg("cos_min"), arg("cos_max")),
+		    "Only generate bundle axes with cos(zenith) in [cos_min, cos_max]")
+		.def("set_azimuth_range", &NaturalRateInjector::SetAzimuthRange, (arg("min"), arg("max")),
+		    "Only generate bundle axes with azimuth in [min, max]")
+		.add_property("zenith_range", &GetZenithRange<NaturalRateInjector>)
+		.add_property("azimuth_range", &GetAzimuthRange<NaturalRateInjector>)
 	;
 
 	class_<SurfaceScalingFunction, SurfaceScalingFunctionPtr, boost::noncopyable>("SurfaceScalingFunction", no_init)
@@ -58,7 +88,7 @@ register_CanCan()
 	    arg("radius")=RadialDistributionPtr(), arg("scaling")=boost::make_shared<BasicSurfaceScalingFunction>())))
 		.def("total_rate", &EnergyDependentSurfaceInjector::GetTotalRate)
 		.def("target_surface", &EnergyDependentSurfaceInjector::GetTargetSurface)
-		#define PROPS (Scaling)(Flux)(EnergyDistribution)(RadialDistribution)
+		#define PROPS (Scaling)(Flux)(EnergyDistribution)(EnergyProposal)(RadialDistribution)(MuonEnergyThreshold)
 		BOOST_PP_SEQ_FOR_EACH(WRAP_PROP, EnergyDependentSurfaceInjector, PROPS)
 		#undef PROPS
 	;
@@ -44,7 +44,8 @@ register_Track()
 		scope track_scope = 
 		class_<Track, TrackPtr, bases<I3Particle> >("Track")
 		    .def("get_energy", (double (Track::*)(double) const)&Track::GetEnergy)
-		    .def("harvest", &Track::Harvest)
+		    .def("get_energy", (std::vector<double> (Track::*)(const std::vector<double>&) const)&Track::GetEnergy)
+		    .def("harvest", (std::list<Track> (*)(const I3MCTree &, const I3MMCTrackList &))&Track::Harvest)
 		    .staticmethod("harvest")
 		    // non-public testing interface
 		    .add_property("_checkpoints", &Track::GetCheckpoints)
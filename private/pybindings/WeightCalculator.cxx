@@ -14,6 +14,8 @@
 #include <MuonGun/EnergyDistribution.h>
 
 #include <tableio/converter/pybindings.h>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
 
 using namespace I3MuonGun;
 using namespace boost::python;
@@ -43,13 +45,23 @@ get(const BOOST_NUMPY::ndarray &a, int i0, int i1)
 	return *reinterpret_cast<T*>(a.get_data() + i0*a.strides(0) + i1*a.strides(1));
 }
 
+// Release the GIL for the lifetime of this object
+class gil_release {
+public:
+	gil_release() : state_(PyEval_SaveThread()) {}
+	~gil_release() { PyEval_RestoreThread(state_); }
+private:
+	gil_release(const gil_release&);
+	gil_release& operator=(const gil_release&);
+	PyThreadState *state_;
+};
+
 }
 
-// An adapter function to use the standard WeightCalculator with Numpy arrays,
-// most likely from tableio/hdfwriter
-object
-GetWeight(const WeightCalculator& weighter, object &xo, object &yo, object &zo,
-    object &zeno, object &azio, object &mo, object &eno, object &rado)
+// Gather table columns, most likely from tableio/hdfwriter, into a BundleBatch
+BundleBatch
+MakeBatch(object &xo, object &yo, object &zo, object &zeno, object &azio,
+    object &mo, object &eno, object &rado)
 {
 	using namespace BOOST_NUMPY;
 	
@@ -76,33 +88,126 @@ GetWeight(const WeightCalculator& weighter, object &xo, object &yo, object &zo,
 	}
 	
 	int nrows = x.shape(0);
-	int ncols = std::min(radii.shape(1), energies.shape(1));
 	if (y.shape(0) != nrows || z.shape(0) != nrows
-	    || zen.shape(0) != nrows || azi.shape(0) != nrows
-	    || energies.shape(0) != nrows || radii.shape(0) != nrows)
+	    || zen.shape(0) != nrows || azi.shape(0) != nrows || mult.shape(0) != nrows)
 	    throw(std::runtime_error("shape mismatch!"));
 	
-	ndarray weights = zeros(x.get_nd(), x.get_shape(), dtype::get_builtin<double>());	
-	I3Particle axis;
+	// One-dimensional energies and radii hold one entry per muon, as
+	// written by BundleMuonConverter, rather than one row per bundle
+	const bool ragged = (energies.get_nd() == 1);
+	int ncols = 0;
+	if (ragged) {
+		size_t nmuons = 0;
+		for (int i=0; i < nrows; i++)
+			nmuons += get<uint32_t>(mult, i);
+		if (energies.shape(0) != int(nmuons) || radii.shape(0) != int(nmuons))
+			throw(std::runtime_error("shape mismatch! The multiplicities "
+			    "don't add up to the number of muons."));
+	} else {
+		ncols = std::min(radii.shape(1), energies.shape(1));
+		if (energies.shape(0) != nrows || radii.shape(0) != nrows)
+			throw(std::runtime_error("shape mismatch!"));
+	}
+	
+	BundleBatch batch;
+	batch.reserve(nrows, ragged ? size_t(energies.shape(0)) : size_t(nrows)*ncols);
+	int muon = 0, truncated = 0;
 	for (int i=0; i < nrows; i++) {
-		
-		int m = get<uint32_t>(mult, i);
-		BundleConfiguration spec;
-		for (int j=0; j < std::min(ncols, m); j++) {
-			spec.push_back(BundleEntry(
-			    get<float>(radii, i, j), get<float>(energies, i, j)));
+		batch.x.push_back(get<double>(x, i));
+		batch.y.push_back(get<double>(y, i));
+		batch.z.push_back(get<double>(z, i));
+		batch.zenith.push_back(get<double>(zen, i));
+		batch.azimuth.push_back(get<double>(azi, i));
+		batch.multiplicity.push_back(0);
+		batch.offsets.push_back(batch.offsets.back());
+		if (ragged) {
+			for (int end = muon + int(get<uint32_t>(mult, i)); muon < end; muon++)
+				batch.AddMuon(get<float>(radii, muon), get<float>(energies, muon));
+		} else {
+			int m = int(get<uint32_t>(mult, i));
+			if (m > ncols) {
+				m = ncols;
+				truncated++;
+			}
+			for (int j=0; j < m; j++)
+				batch.AddMuon(get<float>(radii, i, j), get<float>(energies, i, j));
 		}
-		axis.SetPos(get<double>(x, i), get<double>(y, i), get<double>(z, i));
-		axis.SetDir(get<double>(zen, i), get<double>(azi, i));
-		
-		reinterpret_cast<double*>(weights.get_data())[i] = weighter.GetWeight(axis, spec);
 	}
+	if (truncated > 0)
+		log_warn("%d of %d bundles have more muons than the %d columns of "
+		    "energies and radii, and are weighted with only those. Pass one "
+		    "entry per muon, as written by BundleMuonConverter, instead.",
+		    truncated, nrows, ncols);
+	
+	return batch;
+}
+
+// An adapter function to use the standard WeightCalculator with Numpy arrays
+object
+GetWeight(const WeightCalculator& weighter, object &xo, object &yo, object &zo,
+    object &zeno, object &azio, object &mo, object &eno, object &rado, unsigned nthreads)
+{
+	using namespace BOOST_NUMPY;
+	
+	// Copy the rows into a batch while we still hold the GIL, then let go
+	// of it while the weights are calculated
+	BundleBatch batch = MakeBatch(xo, yo, zo, zeno, azio, mo, eno, rado);
+	std::vector<double> values;
+	{
+		gil_release unlock;
+		weighter.GetWeights(batch, values, nthreads);
+	}
+	
+	ndarray weights = zeros(make_tuple(values.size()), dtype::get_builtin<double>());
+	std::copy(values.begin(), values.end(), reinterpret_cast<double*>(weights.get_data()));
 	
 	return weights.scalarize();
 }
 
+// The same for MultiModelWeightCalculator, returning one column per model
+object
+GetWeights(const MultiModelWeightCalculator& weighter, object &xo, object &yo, object &zo,
+    object &zeno, object &azio, object &mo, object &eno, object &rado, unsigned nthreads)
+{
+	using namespace BOOST_NUMPY;
+	
+	BundleBatch batch = MakeBatch(xo, yo, zo, zeno, azio, mo, eno, rado);
+	std::vector<double> values;
+	{
+		gil_release unlock;
+		weighter.GetWeights(batch, values, nthreads);
+	}
+	
+	ndarray weights = zeros(make_tuple(batch.size(), weighter.GetNumModels()),
+	    dtype::get_builtin<double>());
+	std::copy(values.begin(), values.end(), reinterpret_cast<double*>(weights.get_data()));
+	
+	return weights;
+}
+
 #endif
 
+static boost::shared_ptr<MultiModelWeightCalculator>
+MakeMultiModelWeightCalculator(object models, GenerationProbabilityPtr generator)
+{
+	std::vector<BundleModel> bundleModels;
+	for (int i=0; i < len(models); i++)
+		bundleModels.push_back(extract<BundleModel>(models[i]));
+	
+	return boost::make_shared<MultiModelWeightCalculator>(bundleModels, generator);
+}
+
+static list
+GetMultiModelWeights(const MultiModelWeightCalculator &self, const I3Particle &axis,
+    const BundleSpec &bundle)
+{
+	list weights;
+	BOOST_FOREACH(double weight, self.GetWeights(axis, bundle))
+		weights.append(weight);
+	
+	return weights;
+}
+
 void register_WeightCalculator()
 {
 	def("muons_at_surface", &GetMuonsAtSurface);
@@ -116,20 +221,50 @@ void register_WeightCalculator()
 
 	class_<WeightCalculator>("WeightCalculator", init<const BundleModel&, GenerationProbabilityPtr>(
 	    (arg("model"), "generator")))
-	    .def("__call__", &WeightCalculator::GetWeight)
+	    .def("__call__", (double (WeightCalculator::*)(const I3Particle&,
+	        const BundleSpec&) const)&WeightCalculator::GetWeight, (arg("axis"), "bundle"))
+	    .def("__call__", (double (WeightCalculator::*)(const I3Particle&,
+	        const BundleSpec&, double) const)&WeightCalculator::GetWeight,
+	        (arg("axis"), "bundle", "log_generated_events"))
 #ifdef USE_NUMPY
 	    .def("__call__", &GetWeight, (bp::arg("x"), "y", "z", "zenith", "azimuth",
-	        "multiplicity", "energies", "radii"))
+	        "multiplicity", "energies", "radii", arg("nthreads")=0),
+	        "Weight a table of bundles. The weights are calculated in nthreads "
+	        "threads (by default, one per core) without holding the GIL.")
 #endif
 	    #define PROPS (Surface)
 	    BOOST_PP_SEQ_FOR_EACH(WRAP_PROP, WeightCalculator, PROPS)
 	    #undef PROPS
 	;
 	
+	class_<MultiModelWeightCalculator, boost::shared_ptr<MultiModelWeightCalculator> >(
+	    "MultiModelWeightCalculator", "Calculate weights for several flux models "
+	    "at once, sharing the bundle kinematics and generation probability "
+	    "between them.", no_init)
+	    .def("__init__", make_constructor(&MakeMultiModelWeightCalculator,
+	        default_call_policies(), (arg("models"), "generator")))
+	    .def("__call__", &GetMultiModelWeights, (arg("axis"), "bundle"),
+	        "Return a list with the weight of the bundle under each model")
+#ifdef USE_NUMPY
+	    .def("__call__", &GetWeights, (bp::arg("x"), "y", "z", "zenith", "azimuth",
+	        "multiplicity", "energies", "radii", arg("nthreads")=0),
+	        "Weight a table of bundles. Returns an array with one row per "
+	        "bundle and one column per model.")
+#endif
+	    .add_property("num_models", &MultiModelWeightCalculator::GetNumModels)
+	    .add_property("surface", &MultiModelWeightCalculator::GetSurface)
+	;
+	
 	I3CONVERTER_NAMESPACE(MuonGun);
 	I3CONVERTER_EXPORT(MuonBundleConverter, "foo")
 	    .def(init<uint32_t, SamplingSurfaceConstPtr>((
 	    arg("maxMultiplicity")=25,
 	    arg("surface")=boost::make_shared<Cylinder>(1600, 800))))
 	;
+	I3CONVERTER_EXPORT(BundleMuonConverter, "Book the muons of each bundle, one "
+	    "row per muon. Use with MuonBundleConverter(0) to keep every muon of "
+	    "large bundles without padding the rows of small ones.")
+	    .def(init<SamplingSurfaceConstPtr>((
+	    arg("surface")=boost::make_shared<Cylinder>(1600, 800))))
+	;
 }
@@ -0,0 +1,118 @@
+
+#include <I3Test.h>
+
+#include "common.h"
+#include "MuonGun/CounterRandomService.h"
+#include "MuonGun/StaticSurfaceInjector.h"
+#include "MuonGun/Cylinder.h"
+#include <dataclasses/I3Vector.h>
+#include <dataclasses/physics/I3MCTree.h>
+#include <boost/make_shared.hpp>
+
+#include <cmath>
+
+TEST_GROUP(CounterRandomService);
+
+// Known-answer tests from the Random123 distribution
+TEST(Philox)
+{
+	using I3MuonGun::CounterRandomService;
+	
+	uint32_t result[4];
+	{
+		const uint32_t counter[4] = {0, 0, 0, 0};
+		const uint32_t key[2] = {0, 0};
+		const uint32_t expected[4] = {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8};
+		CounterRandomService::Philox(counter, key, result);
+		for (unsigned i=0; i < 4; i++)
+			ENSURE_EQUAL(result[i], expected[i]);
+	}
+	{
+		const uint32_t counter[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+		const uint32_t key[2] = {0xa4093822, 0x299f31d0};
+		const uint32_t expected[4] = {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1};
+		CounterRandomService::Philox(counter, key, result);
+		for (unsigned i=0; i < 4; i++)
+			ENSURE_EQUAL(result[i], expected[i]);
+	}
+}
+
+TEST(EventStreams)
+{
+	using I3MuonGun::CounterRandomService;
+	
+	CounterRandomService rng(1, 0);
+	std::vector<double> event0, event7;
+	for (unsigned i=0; i < 10; i++)
+		event0.push_back(rng.Uniform());
+	rng.SetEvent(7);
+	for (unsigned i=0; i < 10; i++)
+		event7.push_back(rng.Uniform());
+	
+	// Jump straight to event 7 without drawing from event 0
+	CounterRandomService direct(1, 7);
+	for (unsigned i=0; i < 10; i++)
+		ENSURE_EQUAL(direct.Uniform(), event7[i], "Events can be regenerated independently");
+	
+	CounterRandomService other(2, 0);
+	ENSURE(other.Uniform() != event0[0], "Different runs give different streams");
+	CounterRandomService substream(1, 0, 1);
+	ENSURE(substream.Uniform() != event0[0], "Different sub-streams give different numbers");
+}
+
+TEST(State)
+{
+	using I3MuonGun::CounterRandomService;
+	
+	CounterRandomService rng(3, 42);
+	// Leave the state in the middle of a block
+	rng.Next();
+	I3FrameObjectPtr state = rng.GetState();
+	std::vector<uint32_t> draws;
+	for (unsigned i=0; i < 9; i++)
+		draws.push_back(rng.Next());
+	
+	CounterRandomService restored(0, 0);
+	restored.RestoreState(state);
+	for (unsigned i=0; i < draws.size(); i++)
+		ENSURE_EQUAL(restored.Next(), draws[i]);
+}
+
+TEST(Uniform)
+{
+	using I3MuonGun::CounterRandomService;
+	
+	CounterRandomService rng(1, 0);
+	const unsigned n = 100000;
+	double sum = 0;
+	for (unsigned i=0; i < n; i++) {
+		double u = rng.Uniform();
+		ENSURE(u > 0 && u < 1);
+		sum += u;
+	}
+	ENSURE_DISTANCE(sum/n, 0.5, 5*std::sqrt(1./12/n));
+}
+
+TEST(FixedMultiplicity)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	CounterRandomService rng(1, 0);
+	ENSURE_EQUAL(rng.Integer(0), 0u);
+	
+	// Single muons only, as in the default StaticSurfaceInjector
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	model.flux->SetMinMultiplicity(1);
+	model.flux->SetMaxMultiplicity(1);
+	StaticSurfaceInjector generator(make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	
+	for (unsigned event=0; event < 10; event++) {
+		rng.SetEvent(event);
+		I3MCTree mctree;
+		BundleConfiguration bundlespec;
+		generator.Generate(rng, mctree, bundlespec);
+		ENSURE_EQUAL(bundlespec.size(), 1u);
+	}
+}
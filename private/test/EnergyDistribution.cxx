@@ -3,9 +3,14 @@
 
 #include "MuonGun/EnergyDistribution.h"
 #include "MuonGun/RadialDistribution.h"
+#include "MuonGun/I3MuonGun.h"
 #include "phys-services/I3GSLRandomService.h"
 #include "common.h"
 
+#include <archive/portable_binary_archive.hpp>
+#include <boost/make_shared.hpp>
+#include <sstream>
+
 TEST_GROUP(EnergyDistribution);
 
 TEST(Equality)
@@ -59,3 +64,110 @@ TEST(Sampling)
 		std::vector<pair> vals = model.energy->Generate(rng, depth, ct, m, 1000);
 	}
 }
+
+TEST(PiecewisePowerLaw)
+{
+	using namespace I3MuonGun;
+	
+	std::vector<double> energies, logdensity;
+	for (unsigned i=0; i < 6; i++) {
+		energies.push_back(std::pow(10, 1+i));
+		// Include a segment with index exactly 1
+		logdensity.push_back(i < 2 ? -std::log(energies.back()) : -2.7*std::log(energies.back()));
+	}
+	PiecewisePowerLaw spectrum(energies, logdensity);
+	
+	ENSURE_DISTANCE(Integrate(boost::function<double (double)>(
+	    [&](double loge) { return spectrum(std::exp(loge))*std::exp(loge); }),
+	    std::log(spectrum.GetMin()), std::log(spectrum.GetMax())), 1., 1e-6,
+	    "Spectrum is normalized");
+	ENSURE_EQUAL(spectrum.GetLog(1.), -std::numeric_limits<double>::infinity());
+	ENSURE_EQUAL(spectrum.GetLog(1e7), -std::numeric_limits<double>::infinity());
+	
+	I3GSLRandomService rng(1);
+	for (unsigned i=0; i < 1000; i++) {
+		double e = spectrum.Generate(rng);
+		ENSURE(e >= spectrum.GetMin() && e <= spectrum.GetMax());
+		ENSURE(std::isfinite(spectrum.GetLog(e)));
+	}
+	ENSURE_DISTANCE(spectrum.InverseSurvivalFunction(1.), spectrum.GetMin(), 1e-9);
+	ENSURE_DISTANCE(spectrum.InverseSurvivalFunction(0.), spectrum.GetMax(), 1e-3);
+	for (unsigned i=1; i < 10; i++) {
+		double p = i/10.;
+		ENSURE_DISTANCE(std::exp(spectrum.GetLogCumulative(spectrum.InverseSurvivalFunction(p))),
+		    1-p, 1e-9, "CDF inverts the survival function");
+	}
+	
+	// A copy read back from an archive is identical, down to the last bit
+	boost::shared_ptr<PiecewisePowerLaw> original = boost::make_shared<PiecewisePowerLaw>(spectrum);
+	std::stringstream buf;
+	{
+		icecube::archive::portable_binary_oarchive ar(buf);
+		ar << icecube::serialization::make_nvp("Object", original);
+	}
+	boost::shared_ptr<PiecewisePowerLaw> restored;
+	{
+		icecube::archive::portable_binary_iarchive ar(buf);
+		ar >> icecube::serialization::make_nvp("Object", restored);
+	}
+	ENSURE((bool)restored);
+	ENSURE(*restored == spectrum, "Densities are not renormalized on loading");
+	ENSURE_EQUAL(restored->Hash(), spectrum.Hash());
+	for (unsigned i=1; i < 10; i++) {
+		double p = i/10.;
+		ENSURE_EQUAL(restored->InverseSurvivalFunction(p), spectrum.InverseSurvivalFunction(p));
+	}
+}
+
+TEST(Cumulative)
+{
+	using namespace I3MuonGun;
+	
+	OffsetPowerLaw spectrum(2, 500, 50, 1e6);
+	ENSURE_EQUAL(spectrum.GetLogCumulative(10.), -std::numeric_limits<double>::infinity());
+	ENSURE_EQUAL(spectrum.GetLogCumulative(1e7), 0.);
+	for (unsigned i=1; i < 10; i++) {
+		double p = i/10.;
+		ENSURE_DISTANCE(std::exp(spectrum.GetLogCumulative(spectrum.InverseSurvivalFunction(p))),
+		    1-p, 1e-9, "CDF inverts the survival function");
+	}
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	double depth = 1.5, ct = 0.8;
+	double threshold = 1e3;
+	ENSURE_DISTANCE(std::exp(model.energy->GetLogCumulative(depth, ct, 1, 0.,
+	    EnergyDistribution::log_value(std::log(threshold)))),
+	    model.energy->Integrate(depth, ct, 1, 0, 0, model.energy->GetMin(), threshold), 1e-6);
+}
+
+TEST(Truncation)
+{
+	using namespace I3MuonGun;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	boost::shared_ptr<SplineEnergyDistribution> energy =
+	    boost::dynamic_pointer_cast<SplineEnergyDistribution>(model.energy);
+	ENSURE((bool)energy);
+	ENSURE(!energy->IsTruncated());
+	
+	double depth = 1.5, ct = 0.8;
+	double full = energy->GetLog(depth, ct, 1, 0., EnergyDistribution::log_value(std::log(1e4)));
+	double below = energy->Integrate(depth, ct, 1, 0, 0, 1e3, energy->GetMax());
+	// Another point, to check that the normalization follows the bundle axis
+	double depth2 = 1.13, ct2 = 0.31;
+	double full2 = energy->GetLog(depth2, ct2, 1, 0., EnergyDistribution::log_value(std::log(1e4)));
+	double below2 = energy->Integrate(depth2, ct2, 1, 0, 0, 1e3, energy->GetMax());
+	
+	energy->SetMin(1e3);
+	ENSURE(energy->IsTruncated());
+	ENSURE_DISTANCE(energy->Integrate(depth, ct, 1, 0, 0, energy->GetMin(), energy->GetMax()),
+	    1., 1e-3, "Truncated distribution is renormalized");
+	ENSURE_DISTANCE(energy->Integrate(depth, ct, 5, 0, energy->GetMaxRadius(),
+	    energy->GetMin(), energy->GetMax()), 1., 1e-3, "Bundles are renormalized too");
+	ENSURE_DISTANCE(energy->GetLog(depth, ct, 1, 0., EnergyDistribution::log_value(std::log(1e4))),
+	    full - std::log(below), 1e-3);
+	ENSURE_DISTANCE(energy->GetLog(depth2, ct2, 1, 0., EnergyDistribution::log_value(std::log(1e4))),
+	    full2 - std::log(below2), 1e-3);
+	ENSURE_EQUAL(energy->GetLog(depth, ct, 1, 0., EnergyDistribution::log_value(std::log(1e2))),
+	    -std::numeric_limits<double>::infinity());
+}
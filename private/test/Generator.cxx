@@ -3,10 +3,22 @@
 
 #include "common.h"
 #include "MuonGun/Generator.h"
+#include "MuonGun/I3MuonGun.h"
+#include "MuonGun/BundleRecord.h"
 #include "MuonGun/CORSIKAGenerationProbability.h"
+#include "MuonGun/Floodlight.h"
 #include "MuonGun/Cylinder.h"
+#include "MuonGun/NormalizationCache.h"
+#include "MuonGun/StaticSurfaceInjector.h"
+#include "MuonGun/ShardPlan.h"
+#include "MuonGun/ThinningFunction.h"
+#include "phys-services/I3GSLRandomService.h"
 
+#include <icetray/I3Frame.h>
+#include <dataclasses/physics/I3MCTree.h>
+#include <dataclasses/physics/I3MCTreeUtils.h>
 #include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
 
 TEST_GROUP(Generator);
 
@@ -35,3 +47,551 @@ TEST(Addition)
 	ENSURE((bool)boost::dynamic_pointer_cast<const GenerationProbabilityCollection>(soft_g+hard_g),
 	    "Sum of incompatible generators is a collection");
 }
+
+TEST(BatchMatchesGenerate)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	model.flux->SetMinMultiplicity(1);
+	model.flux->SetMaxMultiplicity(10);
+	StaticSurfaceInjector generator(make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	
+	I3GSLRandomService rng1(1), rng2(1);
+	BundleBatch batch = generator.GenerateBatch(rng2, 10);
+	ENSURE_EQUAL(batch.size(), 10u);
+	ENSURE_EQUAL(batch.offsets.size(), 11u);
+	ENSURE_EQUAL(batch.offsets.back(), batch.energy.size());
+	
+	for (size_t i=0; i < batch.size(); i++) {
+		I3MCTree mctree;
+		BundleConfiguration bundlespec;
+		generator.Generate(rng1, mctree, bundlespec);
+		const I3Particle &primary = *mctree.begin();
+		ENSURE_DISTANCE(batch.x[i], primary.GetPos().GetX(), 1e-9);
+		ENSURE_DISTANCE(batch.zenith[i], primary.GetDir().GetZenith(), 1e-9);
+		ENSURE_EQUAL(batch.multiplicity[i], bundlespec.size());
+		size_t j = batch.offsets[i];
+		BOOST_FOREACH(const BundleEntry &entry, bundlespec) {
+			ENSURE_EQUAL(batch.radius[j], entry.radius);
+			ENSURE_EQUAL(batch.energy[j], entry.energy);
+			j++;
+		}
+	}
+}
+
+TEST(ShardPlan)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	GenerationProbabilityPtr generator = make_shared<StaticSurfaceInjector>(
+	    make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	
+	ShardPlan plan(generator, 1003, 10, 7);
+	ENSURE_EQUAL(plan.GetNumShards(), 10u);
+	uint64_t next = 0;
+	for (unsigned i=0; i < plan.GetNumShards(); i++) {
+		const Shard &shard = plan.GetShard(i);
+		ENSURE_EQUAL(shard.firstEvent, next, "Shards are contiguous");
+		ENSURE(shard.numEvents == 100 || shard.numEvents == 101);
+		ENSURE_EQUAL(plan.GetGenerator(i)->GetTotalEvents(), double(shard.numEvents));
+		next += shard.numEvents;
+	}
+	ENSURE_EQUAL(next, 1003u);
+	ENSURE(plan.GetShard(0).seed != plan.GetShard(1).seed);
+	ENSURE_EQUAL(ShardPlan(generator, 1003, 10, 7).GetShard(3).seed, plan.GetShard(3).seed,
+	    "Plans are deterministic");
+	
+	std::vector<unsigned> finished;
+	finished.push_back(2);
+	finished.push_back(5);
+	GenerationProbabilityPtr partial = plan.GetCombined(finished);
+	ENSURE_EQUAL(partial->GetTotalEvents(), double(plan.GetShard(2).numEvents + plan.GetShard(5).numEvents));
+	ENSURE(partial->IsCompatible(generator));
+	ENSURE_EQUAL(plan.GetCombined()->GetTotalEvents(), 1003.);
+}
+
+TEST(ZenithAzimuthRange)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	StaticSurfaceInjector full(make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	StaticSurfaceInjector restricted(full);
+	restricted.SetZenithRange(0.5, 0.8);
+	restricted.SetAzimuthRange(0, M_PI/2);
+	ENSURE(!restricted.IsCompatible(GenerationProbabilityConstPtr(new StaticSurfaceInjector(full))));
+	ENSURE(restricted.GetTotalRate() < full.GetTotalRate()/4.);
+	
+	I3GSLRandomService rng(1);
+	for (unsigned i=0; i < 100; i++) {
+		I3MCTree mctree;
+		BundleConfiguration bundlespec;
+		restricted.Generate(rng, mctree, bundlespec);
+		const I3Particle &axis = *mctree.begin();
+		double ct = std::cos(axis.GetDir().GetZenith());
+		ENSURE(ct >= 0.5 && ct <= 0.8, "cos(zenith) is in range");
+		ENSURE(axis.GetDir().GetAzimuth() >= 0 && axis.GetDir().GetAzimuth() <= M_PI/2,
+		    "azimuth is in range");
+		ENSURE(std::isfinite(restricted.GetLogGenerationProbability(axis, bundlespec)));
+		
+		I3Particle outside(axis);
+		outside.SetDir(axis.GetDir().GetZenith(), axis.GetDir().GetAzimuth() + M_PI);
+		ENSURE(!std::isfinite(restricted.GetLogGenerationProbability(outside, bundlespec)),
+		    "Directions outside the range are never generated");
+	}
+}
+
+TEST(MuonEnergyThreshold)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	model.flux->SetMinMultiplicity(1);
+	model.flux->SetMaxMultiplicity(10);
+	StaticSurfaceInjector generator(make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	const double threshold = 1e3;
+	generator.SetMuonEnergyThreshold(threshold);
+	
+	I3GSLRandomService rng(1);
+	unsigned omitted = 0;
+	for (unsigned i=0; i < 100; i++) {
+		I3MCTree mctree;
+		BundleConfiguration bundlespec;
+		generator.Generate(rng, mctree, bundlespec);
+		const I3Particle &axis = *mctree.begin();
+		unsigned kept = 0;
+		BOOST_FOREACH(const BundleEntry &entry, bundlespec) {
+			if (entry.omitted) {
+				ENSURE_EQUAL(entry.energy, threshold);
+				omitted++;
+			} else {
+				ENSURE(entry.energy >= threshold);
+				kept++;
+			}
+		}
+		ENSURE_EQUAL(size_t(kept), I3MCTreeUtils::GetDaughters(mctree, axis).size(),
+		    "Omitted muons are not in the tree");
+		ENSURE(std::isfinite(generator.GetLogGenerationProbability(axis, bundlespec)));
+	}
+	ENSURE(omitted > 0, "Some muons fell below the threshold");
+}
+
+TEST(HitsTarget)
+{
+	using namespace I3MuonGun;
+	
+	I3MCTree mctree;
+	I3Particle axis;
+	axis.SetPos(0, 0, 800);
+	axis.SetDir(0, 0);
+	I3MCTreeUtils::AddPrimary(mctree, axis);
+	
+	Cylinder centered(100, 50), offset(100, 50, I3Position(500, 0, 0));
+	ENSURE(Generator::HitsTarget(mctree, centered), "Vertical axis hits the target");
+	ENSURE(!Generator::HitsTarget(mctree, offset), "Vertical axis misses the target");
+	
+	I3Particle track = Generator::CreateParallelTrack(500, 0, Cylinder(1600, 800), axis);
+	I3MCTreeUtils::AppendChild(mctree, axis, track);
+	ENSURE(Generator::HitsTarget(mctree, offset), "Offset muon hits the target");
+	
+	axis.SetDir(M_PI, 0);
+	I3MCTree upgoing;
+	I3MCTreeUtils::AddPrimary(upgoing, axis);
+	ENSURE(!Generator::HitsTarget(upgoing, centered), "Target behind the track is missed");
+}
+
+TEST(EnergyThinning)
+{
+	using namespace I3MuonGun;
+	
+	EnergyThinning thinning(1e4, 1., 0.01);
+	I3Particle axis;
+	BundleConfiguration bundle;
+	bundle.push_back(BundleEntry(0., 1e3));
+	ENSURE_DISTANCE(thinning.GetKeepProbability(axis, bundle), 0.1, 1e-12);
+	bundle.push_back(BundleEntry(10., 1e3, true));
+	ENSURE_DISTANCE(thinning.GetKeepProbability(axis, bundle), 0.1, 1e-12,
+	    "Omitted muons don't count");
+	bundle.push_back(BundleEntry(10., 2e4));
+	ENSURE_EQUAL(thinning.GetKeepProbability(axis, bundle), 1.);
+	
+	BundleConfiguration faint;
+	faint.push_back(BundleEntry(0., 1.));
+	ENSURE_EQUAL(thinning.GetKeepProbability(axis, faint), 0.01, "Probability is bounded below");
+}
+
+TEST(BundleSpec)
+{
+	using namespace I3MuonGun;
+	
+	BundleConfiguration entries;
+	for (unsigned i=0; i < 20; i++)
+		entries.push_back(BundleEntry(i, (i*7) % 11 + 1., i % 3 == 0));
+	
+	BundleSpec bundle(entries);
+	ENSURE_EQUAL(bundle.GetMultiplicity(), 20u);
+	ENSURE_EQUAL(bundle.GetMaxEnergy(), 11.);
+	ENSURE(bundle.GetEntries() == entries, "Round trip through a list preserves order");
+	
+	entries.sort();
+	bundle.sort();
+	ENSURE(bundle.GetEntries() == entries, "Sorts like a list");
+	ENSURE_EQUAL(bundle.GetEnergy(0), bundle.GetMaxEnergy());
+	
+	bundle.Omit(0, 5.);
+	ENSURE(bundle.IsOmitted(0));
+	ENSURE_EQUAL(bundle.GetEnergy(0), 5.);
+	ENSURE_EQUAL(bundle.GetMaxEnergy(), bundle.GetEnergy(1),
+	    "Maximum is updated when the leading entry is lowered");
+	
+	BundleSpec moved(std::move(bundle));
+	ENSURE_EQUAL(moved.size(), 20u);
+	bundle.clear();
+	ENSURE(bundle.empty());
+	ENSURE_EQUAL(bundle.GetMaxEnergy(), 0.);
+	
+	I3GSLRandomService rng(1);
+	boost::shared_ptr<OffsetPowerLaw> spectrum = boost::make_shared<OffsetPowerLaw>(2, 500., 50, 1e6);
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	StaticSurfaceInjector generator(boost::make_shared<Cylinder>(1600, 800), model.flux,
+	    spectrum, model.radius);
+	for (unsigned i=0; i < 10; i++) {
+		I3MCTree mctree;
+		BundleSpec bundlespec;
+		generator.Generate(rng, mctree, bundlespec);
+		const I3Particle &axis = *mctree.begin();
+		ENSURE_EQUAL(generator.GetLogGenerationProbability(axis, bundlespec),
+		    generator.GetLogGenerationProbability(axis, bundlespec.GetEntries()),
+		    "Lists and arrays give the same generation probability");
+	}
+}
+
+TEST(BundleKinematics)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	I3Particle axis;
+	axis.SetPos(100, 50, 900);
+	axis.SetDir(0.3, 1.2);
+	BundleSpec bundle;
+	bundle.push_back(BundleEntry(0., 1e3));
+	bundle.push_back(BundleEntry(5., 1e2, true));
+	
+	BundleKinematics kinematics(axis, bundle);
+	ENSURE_EQUAL(kinematics.GetMultiplicity(), 2u);
+	ENSURE_DISTANCE(kinematics.GetCosZenith(), std::cos(0.3), 1e-12);
+	ENSURE_DISTANCE(kinematics.GetLogEnergy(1), std::log(1e2), 1e-12);
+	
+	SamplingSurfacePtr big = make_shared<Cylinder>(1600, 800);
+	SamplingSurfacePtr small = make_shared<Cylinder>(1000, 500);
+	std::pair<double, double> steps = big->GetIntersection(axis.GetPos(), axis.GetDir());
+	ENSURE_DISTANCE(kinematics.GetEntry(big), steps.first, 1e-9);
+	ENSURE_DISTANCE(kinematics.GetDepth(big),
+	    GetDepth(axis.GetPos().GetZ() + steps.first*axis.GetDir().GetZ()), 1e-9);
+	ENSURE_DISTANCE(kinematics.GetEntry(make_shared<Cylinder>(1600, 800)), steps.first, 1e-9,
+	    "Identical surfaces share an intersection");
+	ENSURE_DISTANCE(kinematics.GetEntry(small),
+	    small->GetIntersection(axis.GetPos(), axis.GetDir()).first, 1e-9,
+	    "Different surfaces are intersected anew");
+	ENSURE_DISTANCE(kinematics.GetEntry(big), steps.first, 1e-9);
+	
+	// Members of a collection see the same kinematics
+	BundleModel soft = load_model("Hoerandel5_atmod12_SIBYLL");
+	BundleModel hard = load_model("GaisserH4a_atmod12_SIBYLL");
+	GenerationProbabilityPtr soft_g = make_shared<CORSIKAGenerationProbability>(
+	    make_shared<Cylinder>(1600, 800), soft.flux, soft.radius, soft.energy);
+	GenerationProbabilityPtr hard_g = make_shared<CORSIKAGenerationProbability>(
+	    make_shared<Cylinder>(1600, 800), hard.flux, hard.radius, hard.energy);
+	GenerationProbabilityPtr both = soft_g + hard_g;
+	double expected = std::log(std::exp(soft_g->GetLogGeneratedEvents(axis, bundle))
+	    + std::exp(hard_g->GetLogGeneratedEvents(axis, bundle)));
+	ENSURE_DISTANCE(both->GetLogGeneratedEvents(kinematics), expected, 1e-9);
+	ENSURE_DISTANCE(both->GetLogGeneratedEvents(axis, bundle), expected, 1e-9);
+}
+
+TEST(BundleRecord)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	model.flux->SetMinMultiplicity(1);
+	model.flux->SetMaxMultiplicity(10);
+	boost::shared_ptr<StaticSurfaceInjector> generator = make_shared<StaticSurfaceInjector>(
+	    make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	generator->SetMuonEnergyThreshold(1e3);
+	
+	const uint64_t hash = BundleRecord::GetGeneratorHash(*generator);
+	GenerationProbabilityPtr scaled = generator->Clone();
+	scaled->SetTotalEvents(100);
+	ENSURE_EQUAL(BundleRecord::GetGeneratorHash(*scaled), hash,
+	    "Hash doesn't depend on the number of events");
+	GenerationProbabilityPtr other = generator->Clone();
+	boost::dynamic_pointer_cast<StaticSurfaceInjector>(other)->SetMuonEnergyThreshold(2e3);
+	ENSURE(BundleRecord::GetGeneratorHash(*other) != hash,
+	    "Differently configured generators have different hashes");
+	
+	// GeneratorModule writes the generator to the S frame after its
+	// normalizations have been computed
+	GenerationProbabilityPtr warmed = generator->Clone();
+	warmed->Prepare();
+	I3Frame frame(I3Frame::Simulation);
+	frame.Put("GenerationSpec", warmed);
+	std::stringstream buf;
+	frame.save(buf);
+	I3Frame restored_frame;
+	restored_frame.load(buf);
+	GenerationProbabilityConstPtr restored_generator =
+	    restored_frame.Get<GenerationProbabilityConstPtr>("GenerationSpec");
+	ENSURE((bool)restored_generator);
+	ENSURE_EQUAL(BundleRecord::GetGeneratorHash(*restored_generator), hash,
+	    "Hash survives a round trip through a frame after warm-up");
+	
+	WeightCalculator weighter(model, scaled);
+	I3GSLRandomService rng(1);
+	for (unsigned i=0; i < 20; i++) {
+		I3MCTree mctree;
+		BundleSpec bundlespec;
+		generator->Generate(rng, mctree, bundlespec);
+		const I3Particle &axis = *mctree.begin();
+		
+		BundleRecord record(axis, bundlespec);
+		BundleSpec restored = record.GetBundle();
+		ENSURE_EQUAL(restored.size(), bundlespec.size());
+		bundlespec.sort();
+		restored.sort();
+		ENSURE(restored == bundlespec, "Record holds the same muons");
+		
+		double loggen = scaled->GetLogGeneratedEvents(record.GetAxis(), restored);
+		ENSURE_DISTANCE(loggen, scaled->GetLogGeneratedEvents(axis, bundlespec), 1e-12);
+		ENSURE_DISTANCE(weighter.GetWeight(axis, bundlespec, loggen),
+		    weighter.GetWeight(axis, bundlespec), 1e-12*weighter.GetWeight(axis, bundlespec),
+		    "Precomputed generation probability gives the same weight");
+	}
+}
+
+TEST(BatchWeights)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	model.flux->SetMinMultiplicity(1);
+	model.flux->SetMaxMultiplicity(10);
+	boost::shared_ptr<StaticSurfaceInjector> generator = make_shared<StaticSurfaceInjector>(
+	    make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	
+	I3GSLRandomService rng(1);
+	BundleBatch batch = generator->GenerateBatch(rng, 2000);
+	
+	WeightCalculator weighter(model, generator);
+	std::vector<double> serial = weighter.GetWeights(batch, 1);
+	std::vector<double> parallel = weighter.GetWeights(batch, 4);
+	ENSURE_EQUAL(serial.size(), batch.size());
+	ENSURE_EQUAL(parallel.size(), batch.size());
+	
+	for (size_t i=0; i < batch.size(); i++) {
+		I3Particle axis;
+		axis.SetPos(batch.x[i], batch.y[i], batch.z[i]);
+		axis.SetDir(batch.zenith[i], batch.azimuth[i]);
+		BundleSpec bundlespec;
+		for (uint64_t j=batch.offsets[i]; j < batch.offsets[i+1]; j++)
+			bundlespec.push_back(BundleEntry(batch.radius[j], batch.energy[j]));
+		double weight = weighter.GetWeight(axis, bundlespec);
+		ENSURE_EQUAL(serial[i], weight, "Batch weights match one-at-a-time weights");
+		ENSURE_EQUAL(parallel[i], weight, "Weights don't depend on the number of threads");
+	}
+	
+	ENSURE(weighter.GetWeights(BundleBatch()).empty());
+}
+
+TEST(MultiModelWeights)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel soft = load_model("Hoerandel5_atmod12_SIBYLL");
+	BundleModel hard = load_model("GaisserH4a_atmod12_SIBYLL");
+	soft.flux->SetMinMultiplicity(1);
+	soft.flux->SetMaxMultiplicity(10);
+	boost::shared_ptr<StaticSurfaceInjector> generator = make_shared<StaticSurfaceInjector>(
+	    make_shared<Cylinder>(1600, 800), soft.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), soft.radius);
+	
+	std::vector<BundleModel> models;
+	models.push_back(soft);
+	models.push_back(hard);
+	MultiModelWeightCalculator weighter(models, generator);
+	ENSURE_EQUAL(weighter.GetNumModels(), 2u);
+	WeightCalculator soft_weighter(soft, generator), hard_weighter(hard, generator);
+	
+	I3GSLRandomService rng(1);
+	BundleBatch batch = generator->GenerateBatch(rng, 1000);
+	std::vector<double> weights = weighter.GetWeights(batch, 2);
+	ENSURE_EQUAL(weights.size(), 2*batch.size());
+	std::vector<double> soft_weights = soft_weighter.GetWeights(batch, 1);
+	std::vector<double> hard_weights = hard_weighter.GetWeights(batch, 1);
+	
+	for (size_t i=0; i < batch.size(); i++) {
+		ENSURE_EQUAL(weights[2*i], soft_weights[i], "Weights are stored row by row");
+		ENSURE_EQUAL(weights[2*i+1], hard_weights[i], "Weights are stored row by row");
+	}
+	
+	I3Particle axis;
+	axis.SetPos(batch.x[0], batch.y[0], batch.z[0]);
+	axis.SetDir(batch.zenith[0], batch.azimuth[0]);
+	BundleSpec bundlespec;
+	for (uint64_t j=batch.offsets[0]; j < batch.offsets[1]; j++)
+		bundlespec.push_back(BundleEntry(batch.radius[j], batch.energy[j]));
+	std::vector<double> single = weighter.GetWeights(axis, bundlespec);
+	ENSURE_EQUAL(single.size(), 2u);
+	ENSURE_EQUAL(single[0], soft_weighter.GetWeight(axis, bundlespec));
+	ENSURE_EQUAL(single[1], hard_weighter.GetWeight(axis, bundlespec));
+}
+
+TEST(CollectionEvaluation)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	// Enough members for the collection to be evaluated in parallel, only
+	// some of which cover the test bundle
+	SamplingSurfacePtr surface = make_shared<Cylinder>(1600, 800);
+	std::vector<GenerationProbabilityPtr> members;
+	GenerationProbabilityPtr sum;
+	for (unsigned k=0; k < 64; k++) {
+		members.push_back(make_shared<Floodlight>(surface,
+		    make_shared<OffsetPowerLaw>(2, 0., 500.*(k+1), 1e7), -1. + k/32., 1.));
+		sum = sum ? sum + members.back() : members.back();
+	}
+	boost::shared_ptr<GenerationProbabilityCollection> collection =
+	    boost::dynamic_pointer_cast<GenerationProbabilityCollection>(sum);
+	ENSURE((bool)collection);
+	ENSURE_EQUAL(collection->size(), members.size());
+	
+	I3Particle axis;
+	axis.SetPos(0, 0, 0);
+	axis.SetDir(0.5, 0.);
+	BundleSpec bundle;
+	bundle.push_back(BundleEntry(0., 1e4));
+	
+	unsigned covered = 0;
+	double expected = 0;
+	BOOST_FOREACH(const GenerationProbabilityPtr &p, members) {
+		double logp = p->GetLogGeneratedEvents(axis, bundle);
+		ENSURE_EQUAL(p->Covers(BundleKinematics(axis, bundle)), std::isfinite(logp),
+		    "Members cover exactly the bundles they could have generated");
+		if (std::isfinite(logp)) {
+			covered++;
+			expected += std::exp(logp);
+		}
+	}
+	ENSURE(covered > 0 && covered < members.size());
+	
+	ENSURE_DISTANCE(collection->GetLogGeneratedEvents(axis, bundle), std::log(expected), 1e-12);
+	collection->SetNumThreads(4);
+	ENSURE_EQUAL(collection->GetNumThreads(), 4u);
+	ENSURE_DISTANCE(collection->GetLogGeneratedEvents(axis, bundle), std::log(expected), 1e-12,
+	    "Parallel evaluation gives the same result");
+	
+	// Nobody generates bundles of two muons
+	bundle.push_back(BundleEntry(10., 1e4));
+	ENSURE(!collection->Covers(BundleKinematics(axis, bundle)));
+	ENSURE(std::isinf(collection->GetLogGeneratedEvents(axis, bundle)),
+	    "Probability is zero, not NaN, if no member covers the bundle");
+}
+
+namespace {
+
+// Hash of the full serialized state, including lazily computed normalizations
+uint64_t
+state_hash(I3MuonGun::GenerationProbabilityConstPtr p)
+{
+	return I3MuonGun::CacheKey("State").Add(p).GetValue();
+}
+
+}
+
+TEST(Prepare)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	BundleModel model = load_model("Hoerandel5_atmod12_SIBYLL");
+	model.flux->SetMinMultiplicity(1);
+	model.flux->SetMaxMultiplicity(1);
+	GenerationProbabilityPtr static_gen = make_shared<StaticSurfaceInjector>(
+	    make_shared<Cylinder>(1600, 800), model.flux,
+	    make_shared<OffsetPowerLaw>(2, 500., 50, 1e6), model.radius);
+	GenerationProbabilityPtr floodlight = make_shared<Floodlight>(make_shared<Cylinder>(1600, 800),
+	    make_shared<OffsetPowerLaw>(2, 0., 500., 1e7), -1., 1.);
+	
+	GenerationProbabilityPtr fresh = static_gen->Clone();
+	GenerationProbabilityPtr prepared = static_gen->Clone();
+	prepared->Prepare();
+	ENSURE(state_hash(prepared) != state_hash(fresh), "Prepare() fills in normalizations");
+	
+	// A bundle that misses the surface doesn't touch the normalizations...
+	I3Particle axis;
+	axis.SetPos(1e4, 1e4, 1e4);
+	axis.SetDir(0., 0.);
+	BundleSpec bundle;
+	bundle.push_back(BundleEntry(0., 1e3));
+	ENSURE(std::isinf(static_gen->GetLogGeneratedEvents(axis, bundle)));
+	ENSURE_EQUAL(state_hash(static_gen), state_hash(fresh));
+	
+	// ...but preparing a collection reaches its members
+	GenerationProbabilityPtr sum = static_gen + floodlight;
+	ENSURE((bool)boost::dynamic_pointer_cast<GenerationProbabilityCollection>(sum));
+	sum->Prepare();
+	ENSURE_EQUAL(state_hash(static_gen), state_hash(prepared));
+}
+
+TEST(CollectionMerging)
+{
+	using namespace I3MuonGun;
+	using boost::make_shared;
+	
+	// Many copies of a handful of configurations, as from adding up the
+	// generators of a few thousand files
+	const unsigned nconfigs = 8, ncopies = 50;
+	GenerationProbabilityPtr sum;
+	for (unsigned i=0; i < ncopies; i++)
+		for (unsigned k=0; k < nconfigs; k++) {
+			GenerationProbabilityPtr p = make_shared<Floodlight>(make_shared<Cylinder>(1600, 800),
+			    make_shared<OffsetPowerLaw>(2, 0., 500.*(k+1), 1e7), -1., 1.);
+			p->SetTotalEvents(k+1);
+			sum = sum ? sum + p : p;
+		}
+	boost::shared_ptr<GenerationProbabilityCollection> collection =
+	    boost::dynamic_pointer_cast<GenerationProbabilityCollection>(sum);
+	ENSURE((bool)collection);
+	ENSURE_EQUAL(collection->size(), size_t(nconfigs), "Compatible members are merged");
+	for (unsigned k=0; k < nconfigs; k++)
+		ENSURE_EQUAL((*collection)[k]->GetTotalEvents(), double(ncopies*(k+1)));
+	
+	// A collection on the right-hand side absorbs the left-hand side
+	GenerationProbabilityPtr extra = make_shared<Floodlight>(make_shared<Cylinder>(1600, 800),
+	    make_shared<OffsetPowerLaw>(2, 0., 500., 1e7), -1., 1.);
+	collection = boost::dynamic_pointer_cast<GenerationProbabilityCollection>(extra + sum);
+	ENSURE((bool)collection);
+	ENSURE_EQUAL(collection->size(), size_t(nconfigs));
+	ENSURE_EQUAL((*collection)[0]->GetTotalEvents(), double(ncopies+1));
+	
+	ENSURE_EQUAL(extra->Hash(), (*collection)[0]->Hash(),
+	    "Hash does not depend on the number of events");
+	ENSURE(extra->Hash() != (*collection)[1]->Hash());
+}
@@ -0,0 +1,110 @@
+
+#include <I3Test.h>
+
+#include "MuonGun/NormalizationCache.h"
+#include "MuonGun/Cylinder.h"
+
+#include <boost/make_shared.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+TEST_GROUP(NormalizationCache);
+
+namespace {
+
+struct counter {
+	counter(unsigned &n) : calls(n) {}
+	unsigned &calls;
+	double operator()() { calls++; return 42.; }
+};
+
+}
+
+TEST(ContentHash)
+{
+	using namespace I3MuonGun;
+	
+	CylinderPtr c1 = boost::make_shared<Cylinder>(1600, 800);
+	CylinderPtr c2 = boost::make_shared<Cylinder>(1600, 800);
+	CylinderPtr c3 = boost::make_shared<Cylinder>(1000, 500);
+	
+	ENSURE_EQUAL(CacheKey("foo").Add(c1).GetValue(), CacheKey("foo").Add(c2).GetValue(),
+	    "Identical objects hash identically");
+	ENSURE(CacheKey("foo").Add(c1).GetValue() != CacheKey("foo").Add(c3).GetValue(),
+	    "Different objects hash differently");
+	ENSURE(CacheKey("foo").Add(c1).GetValue() != CacheKey("bar").Add(c1).GetValue(),
+	    "Different quantities hash differently");
+}
+
+TEST(Memoization)
+{
+	using namespace I3MuonGun;
+	
+	NormalizationCache &cache = NormalizationCache::GetInstance();
+	cache.SetDirectory("");
+	cache.Clear();
+	
+	unsigned calls = 0;
+	CacheKey key("Memoization");
+	key.Add(1.);
+	ENSURE_EQUAL(cache.Get(key, counter(calls)), 42.);
+	ENSURE_EQUAL(cache.Get(key, counter(calls)), 42.);
+	ENSURE_EQUAL(calls, 1u, "Value is computed only once");
+	
+	cache.Clear();
+	ENSURE_EQUAL(cache.Get(key, counter(calls)), 42.);
+	ENSURE_EQUAL(calls, 2u, "Value is recomputed after clearing the cache");
+}
+
+TEST(Persistence)
+{
+	using namespace I3MuonGun;
+	
+	char dir[] = "/tmp/muongun-cache-XXXXXX";
+	ENSURE(mkdtemp(dir) != NULL);
+	NormalizationCache &cache = NormalizationCache::GetInstance();
+	cache.SetDirectory(dir);
+	cache.Clear();
+	
+	// Threads store their values to disk concurrently
+	const unsigned nkeys = 8;
+	std::vector<std::thread> threads;
+	for (unsigned k=0; k < nkeys; k++)
+		threads.push_back(std::thread([&cache,k]()
+		{
+			CacheKey key("Persistence");
+			key.Add(k);
+			cache.Get(key, [k]() { return double(k); });
+		}));
+	for (unsigned k=0; k < nkeys; k++)
+		threads[k].join();
+	
+	cache.Clear();
+	unsigned calls = 0;
+	for (unsigned k=0; k < nkeys; k++) {
+		CacheKey key("Persistence");
+		key.Add(k);
+		ENSURE_EQUAL(cache.Get(key, counter(calls)), double(k));
+	}
+	ENSURE_EQUAL(calls, 0u, "Values are read back from disk");
+	
+	cache.SetDirectory("");
+	cache.Clear();
+	unsigned nfiles = 0;
+	if (DIR *d = opendir(dir)) {
+		while (struct dirent *entry = readdir(d)) {
+			if (entry->d_name[0] == '.')
+				continue;
+			nfiles++;
+			std::remove((std::string(dir) + "/" + entry->d_name).c_str());
+		}
+		closedir(d);
+	}
+	rmdir(dir);
+	ENSURE_EQUAL(nfiles, nkeys, "No temporary files are left behind");
+}
@@ -0,0 +1,76 @@
+
+#include <I3Test.h>
+
+#include "MuonGun/QuasiRandomService.h"
+#include "MuonGun/Floodlight.h"
+#include "MuonGun/Cylinder.h"
+#include "phys-services/I3GSLRandomService.h"
+
+#include <boost/make_shared.hpp>
+#include <set>
+
+TEST_GROUP(QuasiRandomService);
+
+TEST(Stratification)
+{
+	using namespace I3MuonGun;
+	
+	I3RandomServicePtr rng = boost::make_shared<I3GSLRandomService>(1);
+	const unsigned dims = QuasiRandomService::GetMaxDimensions();
+	QuasiRandomService qrng(dims, rng);
+	
+	// The first 2^m points of a (scrambled) Sobol sequence put exactly one
+	// point in each of the 2^m equal bins of every coordinate
+	const unsigned n = 1024;
+	std::vector<std::set<unsigned> > bins(dims);
+	for (unsigned i=0; i < n; i++) {
+		qrng.NextPoint();
+		for (unsigned d=0; d < dims; d++) {
+			double u = qrng.Uniform();
+			ENSURE(u > 0 && u < 1);
+			bins[d].insert(unsigned(u*n));
+		}
+	}
+	for (unsigned d=0; d < dims; d++)
+		ENSURE_EQUAL(bins[d].size(), size_t(n), "Each coordinate is stratified");
+}
+
+TEST(RandomAccess)
+{
+	using namespace I3MuonGun;
+	
+	I3RandomServicePtr rng = boost::make_shared<I3GSLRandomService>(1);
+	QuasiRandomService qrng(4, rng);
+	std::vector<double> sequence;
+	for (unsigned i=0; i < 13; i++) {
+		qrng.NextPoint();
+		sequence.push_back(qrng.Uniform());
+	}
+	qrng.SetPoint(9);
+	ENSURE_EQUAL(qrng.Uniform(), sequence[9]);
+}
+
+namespace {
+
+// Floodlight puts the muon energy on the axis
+double
+energy(const I3Particle &axis, const I3MuonGun::BundleSpec &)
+{
+	return std::log(axis.GetEnergy());
+}
+
+}
+
+TEST(EstimateRQMC)
+{
+	using namespace I3MuonGun;
+	
+	// Mean of log(E) for an E^-1 spectrum between 1e3 and 1e5 is log(1e4)
+	boost::shared_ptr<OffsetPowerLaw> spectrum = boost::make_shared<OffsetPowerLaw>(1, 0., 1e3, 1e5);
+	Floodlight generator(boost::make_shared<Cylinder>(1000, 500), spectrum);
+	I3RandomServicePtr rng = boost::make_shared<I3GSLRandomService>(1);
+	
+	RQMCEstimate estimate = EstimateRQMC(generator, &energy, 256, 8, 6, rng);
+	ENSURE(estimate.error > 0);
+	ENSURE_DISTANCE(estimate.mean, std::log(1e4), 5*estimate.error);
+}
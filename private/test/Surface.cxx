@@ -2,6 +2,7 @@
 #include <I3Test.h>
 
 #include "MuonGun/Cylinder.h"
+#include "MuonGun/ExtrudedPolygon.h"
 
 TEST_GROUP(Surface);
 
@@ -20,3 +21,32 @@ TEST(Equality)
 	ENSURE(!(cylinder == offset_cylinder));
 	// ENSURE(!(cylinder == sphere));
 }
+
+TEST(Hash)
+{
+	using namespace I3MuonGun;
+	
+	Cylinder cylinder(1600, 800);
+	ENSURE_EQUAL(cylinder.Hash(), Cylinder(1600, 800).Hash());
+	ENSURE(cylinder.Hash() != Cylinder(1600, 800, I3Position(3,2,1)).Hash());
+	ENSURE(cylinder.Hash() != Cylinder(1601, 800).Hash());
+}
+
+TEST(ExtrudedPolygonEquality)
+{
+	using namespace I3MuonGun;
+	
+	std::vector<I3Position> points;
+	points.push_back(I3Position(-500, -500, -500));
+	points.push_back(I3Position(500, -500, -500));
+	points.push_back(I3Position(0, 500, 500));
+	
+	ExtrudedPolygon polygon(points);
+	ExtrudedPolygon padded(points, 60.);
+	
+	ENSURE(polygon == ExtrudedPolygon(points));
+	ENSURE_EQUAL(polygon.Hash(), ExtrudedPolygon(points).Hash());
+	ENSURE(!(polygon == padded), "Polygons with different footprints differ");
+	ENSURE(polygon.Hash() != padded.Hash());
+	ENSURE(!(polygon == Cylinder(1600, 800)), "Polygons are not cylinders");
+}
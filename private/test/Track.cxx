@@ -0,0 +1,182 @@
+
+#include <I3Test.h>
+
+#include "MuonGun/Track.h"
+#include <dataclasses/physics/I3MCTreeUtils.h>
+#include <simclasses/I3MMCTrack.h>
+#include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
+
+#include <vector>
+
+TEST_GROUP(Track);
+
+namespace {
+
+// Make a tree with a single muon, and a fresh list with its MMCTrack
+I3MCTreePtr
+MakeTree(I3MMCTrackListPtr &mmctracks)
+{
+	I3MCTreePtr mctree = boost::make_shared<I3MCTree>();
+	I3Particle muon;
+	muon.SetType(I3Particle::MuMinus);
+	muon.SetShape(I3Particle::Primary);
+	muon.SetPos(0, 0, 500);
+	muon.SetDir(0, 0);
+	muon.SetEnergy(1e3);
+	muon.SetLength(2e3);
+	I3MCTreeUtils::AddPrimary(*mctree, muon);
+
+	I3Particle loss;
+	loss.SetType(I3Particle::Brems);
+	loss.SetPos(0, 0, 0);
+	loss.SetEnergy(1e2);
+	I3MCTreeUtils::AppendChild(*mctree, muon, loss);
+
+	I3MMCTrack mmctrack;
+	mmctrack.SetParticle(muon);
+	mmctrack.SetEnter(0, 0, 0, 0, 8e2);
+	mmctracks = boost::make_shared<I3MMCTrackList>();
+	mmctracks->push_back(mmctrack);
+
+	return mctree;
+}
+
+}
+
+TEST(HarvestCache)
+{
+	using namespace I3MuonGun;
+
+	I3MMCTrackListPtr mmctracks;
+	I3MCTreePtr mctree = MakeTree(mmctracks);
+
+	boost::shared_ptr<const std::list<Track> > tracks = Track::Harvest(mctree, mmctracks);
+	ENSURE_EQUAL(tracks->size(), Track::Harvest(*mctree, *mmctracks).size());
+	ENSURE_EQUAL(tracks->size(), size_t(1));
+	ENSURE_EQUAL(tracks->front().GetEnergy(1e3), Track::Harvest(*mctree, *mmctracks).front().GetEnergy(1e3));
+
+	// The same frame objects share a harvest
+	ENSURE(Track::Harvest(mctree, mmctracks) == tracks);
+
+	// Equal, but different, frame objects do not
+	I3MCTreePtr copy = boost::make_shared<I3MCTree>(*mctree);
+	ENSURE(Track::Harvest(copy, mmctracks) != tracks);
+
+	// Once the frame objects are gone, the harvest is eventually released
+	boost::weak_ptr<const std::list<Track> > expired(tracks);
+	tracks.reset();
+	mctree.reset();
+	copy.reset();
+	mmctracks.reset();
+	for (int i=0; i < 64; i++) {
+		I3MMCTrackListPtr other;
+		I3MCTreePtr tree = MakeTree(other);
+		Track::Harvest(tree, other);
+	}
+	ENSURE(expired.expired());
+}
+
+TEST(HarvestCacheManyFrames)
+{
+	using namespace I3MuonGun;
+
+	// More frames in flight than a weighting module holds back by default
+	const size_t nframes = 100;
+	std::vector<I3MCTreePtr> mctrees(nframes);
+	std::vector<I3MMCTrackListPtr> mmctracks(nframes);
+	std::vector<boost::shared_ptr<const std::list<Track> > > tracks(nframes);
+	for (size_t i=0; i < nframes; i++) {
+		mctrees[i] = MakeTree(mmctracks[i]);
+		tracks[i] = Track::Harvest(mctrees[i], mmctracks[i]);
+	}
+	for (size_t i=0; i < nframes; i++)
+		ENSURE(Track::Harvest(mctrees[i], mmctracks[i]) == tracks[i],
+		    "Harvests of live frames are shared");
+}
+
+TEST(HarvestByValue)
+{
+	using namespace I3MuonGun;
+
+	I3MCTree mctree;
+	I3Particle primary;
+	primary.SetType(I3Particle::PPlus);
+	I3MCTreeUtils::AddPrimary(mctree, primary);
+
+	// Tracks that differ only in energy, each with a stochastic loss
+	std::vector<I3Particle> muons;
+	for (int i=0; i < 10; i++) {
+		I3Particle muon;
+		muon.SetType(I3Particle::MuMinus);
+		muon.SetPos(0, 0, 500);
+		// Set from Cartesian components, unlike the copies below
+		muon.SetDir(I3Direction(0.3, -0.2 + 0.01*i, -0.9));
+		muon.SetEnergy(1e3 + i);
+		muon.SetLength(2e3);
+		I3MCTreeUtils::AppendChild(mctree, primary, muon);
+		I3Particle loss;
+		loss.SetType(I3Particle::Brems);
+		loss.SetPos(0, 0, 0);
+		loss.SetEnergy(1e2);
+		I3MCTreeUtils::AppendChild(mctree, muon, loss);
+		muons.push_back(muon);
+	}
+
+	// MMCTracks whose particles have the same properties as the muons in
+	// the tree, but not the same IDs, and directions set from angles
+	I3MMCTrackList mmctracks;
+	BOOST_FOREACH(const I3Particle &muon, muons) {
+		I3Particle copy;
+		copy.SetType(muon.GetType());
+		copy.SetPos(muon.GetPos());
+		copy.SetDir(I3Direction(muon.GetDir().GetZenith(), muon.GetDir().GetAzimuth()));
+		ENSURE(copy.GetDir() == muon.GetDir());
+		copy.SetEnergy(muon.GetEnergy());
+		copy.SetLength(muon.GetLength());
+		ENSURE(!(copy.GetID() == muon.GetID()));
+		I3MMCTrack mmctrack;
+		mmctrack.SetParticle(copy);
+		mmctrack.SetEnter(0, 0, 0, 0, 8e2);
+		mmctracks.push_back(mmctrack);
+	}
+
+	std::list<Track> tracks = Track::Harvest(mctree, mmctracks);
+	ENSURE_EQUAL(tracks.size(), muons.size());
+	std::vector<I3Particle>::const_iterator muon = muons.begin();
+	BOOST_FOREACH(const Track &track, tracks) {
+		ENSURE(track.GetID() == muon->GetID());
+		ENSURE_EQUAL(track.GetEnergy(), muon->GetEnergy());
+		muon++;
+	}
+}
+
+TEST(BatchedEnergy)
+{
+	using namespace I3MuonGun;
+
+	I3MMCTrackListPtr mmctracks;
+	I3MCTreePtr mctree = MakeTree(mmctracks);
+	std::list<Track> tracks = Track::Harvest(*mctree, *mmctracks);
+	ENSURE_EQUAL(tracks.size(), size_t(1));
+	const Track &track = tracks.front();
+
+	// Ascending, with a step back and points outside the track
+	std::vector<double> lengths;
+	for (int i=-2; i < 24; i++)
+		lengths.push_back(100*i);
+	lengths.push_back(499.9);
+	lengths.push_back(500.1);
+	lengths.push_back(NAN);
+
+	std::vector<double> energies = track.GetEnergy(lengths);
+	std::vector<I3Position> positions = track.GetPos(lengths);
+	std::vector<double> times = track.GetTime(lengths);
+	ENSURE_EQUAL(energies.size(), lengths.size());
+	for (size_t i=0; i < lengths.size(); i++) {
+		ENSURE_EQUAL(energies[i], track.GetEnergy(lengths[i]));
+		ENSURE(positions[i] == track.GetPos(lengths[i]));
+		ENSURE(times[i] == track.GetTime(lengths[i])
+		    || (std::isnan(times[i]) && std::isnan(track.GetTime(lengths[i]))));
+	}
+}
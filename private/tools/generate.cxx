@@ -0,0 +1,205 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ *
+ * Generate muon bundles outside of IceTray, writing their kinematics to a
+ * chunked binary file. The file layout (all values little-endian) is:
+ *
+ *   char[8]  magic "MGBUNDL1"
+ *   double   total number of events the generator represents
+ *   uint64   size of the serialized generator in bytes
+ *   char[]   the generator, in I3 portable binary format
+ *
+ * followed by any number of chunks of the form
+ *
+ *   uint64   number of bundles n (0 marks the end of the file)
+ *   uint64   number of muons k
+ *   double   x[n], y[n], z[n], zenith[n], azimuth[n]
+ *   uint32   multiplicity[n]
+ *   double   radius[k], energy[k]
+ *
+ * Each chunk is generated from its own random stream, seeded from the base
+ * seed and the chunk index, so the output does not depend on the number of
+ * threads used.
+ */
+
+#include "io.h"
+
+#include <MuonGun/Generator.h>
+#include <MuonGun/ThreadPool.h>
+#include <phys-services/I3GSLRandomService.h>
+#include <icetray/I3Logging.h>
+#include <archive/portable_binary_archive.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace I3MuonGun;
+
+namespace {
+
+void
+usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options] GENERATOR.i3 OUTFILE\n\n"
+	    "Draw muon bundles from the Generator stored in GENERATOR.i3\n\n"
+	    "Options:\n"
+	    "  --events=N      number of bundles to generate (required)\n"
+	    "  --key=NAME      frame key of the generator (default: first one found)\n"
+	    "  --seed=N        base random seed (default: 1)\n"
+	    "  --threads=N     worker threads (default: one per core)\n"
+	    "  --chunk-size=N  bundles per output chunk (default: 100000)\n";
+}
+
+// SplitMix64 finalizer, used to decorrelate the per-chunk seeds
+uint64_t
+mix(uint64_t z)
+{
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+bool
+host_is_little_endian()
+{
+	const uint16_t probe = 1;
+	return *reinterpret_cast<const unsigned char*>(&probe) == 1;
+}
+
+// Write values in little-endian byte order, whatever the host's
+template <typename T>
+void
+write(std::ostream &os, const T *values, size_t n)
+{
+	if (host_is_little_endian()) {
+		os.write(reinterpret_cast<const char*>(values), n*sizeof(T));
+		return;
+	}
+	for (size_t i=0; i < n; i++) {
+		char bytes[sizeof(T)];
+		std::memcpy(bytes, &values[i], sizeof(T));
+		std::reverse(bytes, bytes+sizeof(T));
+		os.write(bytes, sizeof(T));
+	}
+}
+
+template <typename T>
+void
+write(std::ostream &os, const T &value)
+{
+	write(os, &value, 1);
+}
+
+template <typename T>
+void
+write(std::ostream &os, const std::vector<T> &values)
+{
+	write(os, values.data(), values.size());
+}
+
+void
+write(std::ostream &os, const BundleBatch &batch)
+{
+	write(os, uint64_t(batch.size()));
+	write(os, uint64_t(batch.energy.size()));
+	write(os, batch.x);
+	write(os, batch.y);
+	write(os, batch.z);
+	write(os, batch.zenith);
+	write(os, batch.azimuth);
+	write(os, batch.multiplicity);
+	write(os, batch.radius);
+	write(os, batch.energy);
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	tools::Options options(argc, argv);
+	if (options.Has("help") || options.GetPositional().size() != 2 || !options.Has("events")) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	const uint64_t nevents = options.Get("events", 0ul);
+	const uint64_t seed = options.Get("seed", 1ul);
+	const uint64_t chunksize = std::max(1ul, options.Get("chunk-size", 100000ul));
+	ThreadPool pool(unsigned(options.Get("threads", 0ul)));
+	
+	GeneratorPtr generator;
+	try {
+		generator = boost::dynamic_pointer_cast<Generator>(
+		    tools::LoadGenerationProbability(options.GetPositional()[0], options.Get("key")));
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	if (!generator) {
+		std::cerr << options.GetPositional()[0] << " contains a GenerationProbability, "
+		    "but it is not a Generator" << std::endl;
+		return 1;
+	}
+	generator->SetTotalEvents(double(nevents));
+	// Fill in lazy normalizations before more than one thread can touch them
+	generator->Prepare();
+	
+	std::ofstream out(options.GetPositional()[1].c_str(), std::ios::binary);
+	if (!out.good()) {
+		std::cerr << "Can't open " << options.GetPositional()[1] << std::endl;
+		return 1;
+	}
+	{
+		std::ostringstream buf;
+		{
+			icecube::archive::portable_binary_oarchive ar(buf);
+			GenerationProbabilityPtr p(generator);
+			ar << icecube::serialization::make_nvp("Generator", p);
+		}
+		out.write("MGBUNDL1", 8);
+		write(out, generator->GetTotalEvents());
+		write(out, uint64_t(buf.str().size()));
+		out << buf.str();
+	}
+	
+	// Generate a few chunks per worker at a time, then write them out in
+	// order. This keeps memory bounded no matter how many events are
+	// requested.
+	const uint64_t nchunks = (nevents + chunksize - 1)/chunksize;
+	const uint64_t wave = 2*pool.GetSize();
+	std::vector<BundleBatch> batches(wave);
+	for (uint64_t first = 0; first < nchunks; first += wave) {
+		const uint64_t todo = std::min(wave, nchunks-first);
+		pool.ParallelFor(todo, [&](size_t i)
+		{
+			const uint64_t chunk = first + i;
+			I3GSLRandomService rng(mix(seed ^ mix(chunk)) % (1ul << 32));
+			batches[i].clear();
+			generator->GenerateBatch(rng,
+			    std::min(chunksize, nevents - chunk*chunksize), batches[i]);
+		});
+		for (uint64_t i=0; i < todo; i++)
+			write(out, batches[i]);
+		log_info("Generated %lu/%lu bundles",
+		    (unsigned long)std::min(nevents, (first+todo)*chunksize),
+		    (unsigned long)nevents);
+	}
+	write(out, uint64_t(0));
+	
+	out.close();
+	if (out.fail()) {
+		std::cerr << "Error writing " << options.GetPositional()[1] << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
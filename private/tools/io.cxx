@@ -0,0 +1,132 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#include "io.h"
+
+#include <MuonGun/Flux.h>
+#include <MuonGun/RadialDistribution.h>
+#include <MuonGun/EnergyDistribution.h>
+#include <icetray/I3Frame.h>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+namespace I3MuonGun { namespace tools {
+
+GenerationProbabilityPtr
+LoadGenerationProbability(const std::string &path, const std::string &key)
+{
+	const std::string suffix = path.substr(path.find_last_of('.')+1);
+	if (suffix == "gz" || suffix == "bz2" || suffix == "zst")
+		throw std::runtime_error(path + ": compressed files are not supported; "
+		    "store the generator in an uncompressed .i3 file");
+	std::ifstream stream(path.c_str(), std::ios::binary);
+	if (!stream.good())
+		throw std::runtime_error("Can't open " + path);
+	
+	I3Frame frame;
+	while (stream.peek() != EOF && frame.load(stream)) {
+		BOOST_FOREACH(const std::string &name, frame.keys()) {
+			if (!key.empty() && name != key)
+				continue;
+			GenerationProbabilityConstPtr p =
+			    boost::dynamic_pointer_cast<const GenerationProbability>(
+			    frame.Get<I3FrameObjectConstPtr>(name));
+			if (p)
+				return p->Clone();
+		}
+	}
+	
+	throw std::runtime_error(path + " does not contain a GenerationProbability"
+	    + (key.empty() ? std::string() : " named '" + key + "'"));
+}
+
+namespace {
+
+bool
+exists(const std::string &path)
+{
+	return std::ifstream(path.c_str()).good();
+}
+
+}
+
+BundleModel
+LoadBundleModel(const std::string &name)
+{
+	std::string base(name);
+	if (!exists(base + ".single_flux.fits")) {
+		const char *build = getenv("I3_BUILD");
+		if (build)
+			base = std::string(build) + "/MuonGun/resources/tables/" + name;
+		if (!build || !exists(base + ".single_flux.fits"))
+			throw std::runtime_error("Can't find the tables for model " + name);
+	}
+	
+	using boost::make_shared;
+	return BundleModel(make_shared<SplineFlux>(base + ".single_flux.fits", base + ".bundle_flux.fits"),
+	    make_shared<SplineRadialDistribution>(base + ".radius.fits"),
+	    make_shared<SplineEnergyDistribution>(base + ".single_energy.fits", base + ".bundle_energy.fits"));
+}
+
+std::vector<std::string>
+Split(const std::string &s, char sep)
+{
+	std::vector<std::string> pieces;
+	size_t start = 0;
+	while (start <= s.size()) {
+		size_t end = s.find(sep, start);
+		if (end == std::string::npos)
+			end = s.size();
+		if (end > start)
+			pieces.push_back(s.substr(start, end-start));
+		start = end+1;
+	}
+	
+	return pieces;
+}
+
+Options::Options(int argc, char **argv)
+{
+	for (int i=1; i < argc; i++) {
+		std::string arg(argv[i]);
+		if (arg.compare(0, 2, "--") == 0) {
+			size_t eq = arg.find('=');
+			if (eq == std::string::npos)
+				options_[arg.substr(2)] = "";
+			else
+				options_[arg.substr(2, eq-2)] = arg.substr(eq+1);
+		} else {
+			positional_.push_back(arg);
+		}
+	}
+}
+
+std::string
+Options::Get(const std::string &name, const std::string &def) const
+{
+	std::map<std::string, std::string>::const_iterator it = options_.find(name);
+	return (it == options_.end()) ? def : it->second;
+}
+
+double
+Options::Get(const std::string &name, double def) const
+{
+	return Has(name) ? std::stod(Get(name, std::string())) : def;
+}
+
+unsigned long
+Options::Get(const std::string &name, unsigned long def) const
+{
+	return Has(name) ? std::stoul(Get(name, std::string())) : def;
+}
+
+}}
@@ -0,0 +1,69 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef MUONGUN_TOOLS_IO_H_INCLUDED
+#define MUONGUN_TOOLS_IO_H_INCLUDED
+
+#include <MuonGun/Generator.h>
+#include <MuonGun/WeightCalculator.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace I3MuonGun { namespace tools {
+
+/**
+ * @brief Read a GenerationProbability from an (uncompressed) .i3 file
+ *
+ * @param[in] path name of the file
+ * @param[in] key  frame key to look for. If empty, return the first
+ *                 GenerationProbability found in any frame.
+ * @throws std::runtime_error if the file can't be read or contains no
+ *         matching object
+ */
+GenerationProbabilityPtr LoadGenerationProbability(const std::string &path,
+    const std::string &key="");
+
+/**
+ * @brief Load a flux model from its spline tables, like load_model() in Python
+ *
+ * @param[in] base path to the tables, without the suffixes. If no such
+ *                 tables exist, look for them in the MuonGun table
+ *                 directory under $I3_BUILD instead.
+ * @throws std::runtime_error if the tables can't be found
+ */
+BundleModel LoadBundleModel(const std::string &base);
+
+/** Split a string at each occurrence of *sep*, dropping empty pieces */
+std::vector<std::string> Split(const std::string &s, char sep=',');
+
+/**
+ * @brief Minimal command-line parser for options of the form --name=value
+ *
+ * Anything that does not start with "--" is collected as a positional
+ * argument.
+ */
+class Options {
+public:
+	Options(int argc, char **argv);
+	
+	bool Has(const std::string &name) const { return options_.count(name) > 0; }
+	std::string Get(const std::string &name, const std::string &def="") const;
+	double Get(const std::string &name, double def) const;
+	unsigned long Get(const std::string &name, unsigned long def) const;
+	
+	const std::vector<std::string>& GetPositional() const { return positional_; }
+private:
+	std::map<std::string, std::string> options_;
+	std::vector<std::string> positional_;
+};
+
+}}
+
+#endif // MUONGUN_TOOLS_IO_H_INCLUDED
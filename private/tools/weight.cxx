@@ -0,0 +1,509 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ *
+ * Weight muon bundles in an HDF5 file written by tableio/hdfwriter, outside
+ * of IceTray. The bundle axis is read from a table of I3Particles (e.g.
+ * MCPrimary), and the muons from a table written by MuonBundleConverter
+ * (e.g. BundleParameters). Both must come from the same sub-event stream, so
+ * that their rows line up. If the bundles were booked with
+ * MuonBundleConverter(0), the muons are instead read from the per-muon
+ * table written alongside by BundleMuonConverter. This is also the only way
+ * to weight bundles with more muons than the MuonBundleConverter table has
+ * columns for; those are an error otherwise.
+ *
+ * The weights are written back into the same file as a new table, with one
+ * column per flux model (named after the model) and the usual Run, Event,
+ * SubEvent, SubEventStream, and exists columns. Rows are processed in chunks,
+ * so memory use does not depend on the size of the file, and each chunk is
+ * weighted on a pool of threads while the next one is being read.
+ */
+
+#include "io.h"
+
+#include <MuonGun/WeightCalculator.h>
+#include <icetray/I3Logging.h>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace I3MuonGun;
+
+namespace {
+
+void
+usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options] TABLES.hdf5 GENERATOR.i3 [GENERATOR.i3 ...]\n\n"
+	    "Weight the muon bundles in TABLES.hdf5, generated with the sum of the\n"
+	    "generators stored in the GENERATOR.i3 files\n\n"
+	    "Options:\n"
+	    "  --models=A,B,...  flux models (default: Hoerandel5_atmod12_SIBYLL)\n"
+	    "  --key=NAME        frame key of the generators (default: first one found)\n"
+	    "  --axis=NAME       table with the bundle axes (default: MCPrimary)\n"
+	    "  --bundle=NAME     table written by MuonBundleConverter (default: BundleParameters)\n"
+	    "  --muons=NAME      table written by BundleMuonConverter, to read the muons\n"
+	    "                    from instead of the bundle table\n"
+	    "  --output=NAME     table to write the weights to (default: MuonGunWeights)\n"
+	    "  --overwrite       replace the output table if it already exists\n"
+	    "  --threads=N       worker threads (default: one per core)\n"
+	    "  --chunk-size=N    rows to read at a time (default: 100000)\n";
+}
+
+template <typename T>
+T
+check(T status, const std::string &what)
+{
+	if (status < 0)
+		throw std::runtime_error(what + " failed");
+	return status;
+}
+
+/*
+ * Read selected fields of a table in chunks of rows. Fields are converted to
+ * the requested native types by HDF5; fields that hold arrays (like the
+ * energies in BundleParameters) are read in full.
+ */
+class TableReader {
+public:
+	TableReader(hid_t file, const std::string &name)
+	    : name_(name), memtype_(-1), rowsize_(0)
+	{
+		dataset_ = check(H5Dopen2(file, name.c_str(), H5P_DEFAULT), "Opening table " + name);
+		hid_t space = check(H5Dget_space(dataset_), "H5Dget_space");
+		if (H5Sget_simple_extent_ndims(space) != 1) {
+			H5Sclose(space);
+			H5Dclose(dataset_);
+			throw std::runtime_error(name + " is not a table");
+		}
+		H5Sget_simple_extent_dims(space, &nrows_, NULL);
+		H5Sclose(space);
+	}
+	~TableReader()
+	{
+		if (memtype_ >= 0)
+			H5Tclose(memtype_);
+		H5Dclose(dataset_);
+	}
+
+	hsize_t GetSize() const { return nrows_; }
+
+	/** Select a field to read. Returns a handle to use with Get(). */
+	size_t AddField(const std::string &name, hid_t type)
+	{
+		if (memtype_ >= 0)
+			throw std::logic_error("Fields must be added before the first read");
+		field f = { name, type, rowsize_, H5Tget_size(type), 1, false };
+
+		hid_t filetype = check(H5Dget_type(dataset_), "H5Dget_type");
+		int index = H5Tget_member_index(filetype, name.c_str());
+		if (index >= 0) {
+			hid_t member = H5Tget_member_type(filetype, unsigned(index));
+			if (H5Tget_class(member) == H5T_ARRAY) {
+				hsize_t dims[H5S_MAX_RANK];
+				int ndims = H5Tget_array_dims2(member, dims);
+				f.length = 1;
+				for (int i=0; i < ndims; i++)
+					f.length *= dims[i];
+				f.array = true;
+			}
+			H5Tclose(member);
+		}
+		H5Tclose(filetype);
+		if (index < 0)
+			throw std::runtime_error(name_ + " has no column named '" + name + "'");
+
+		// Keep every field 8-byte aligned
+		rowsize_ += (f.size*f.length + 7) & ~size_t(7);
+		fields_.push_back(f);
+
+		return fields_.size()-1;
+	}
+
+	/** Number of elements in an array field, or 1 for scalars */
+	size_t GetLength(size_t field) const { return fields_[field].length; }
+
+	/** Read *count* rows, starting at *start* */
+	void Read(hsize_t start, hsize_t count)
+	{
+		if (memtype_ < 0) {
+			memtype_ = check(H5Tcreate(H5T_COMPOUND, rowsize_), "H5Tcreate");
+			for (std::vector<field>::const_iterator f = fields_.begin(); f != fields_.end(); f++) {
+				hsize_t length = f->length;
+				hid_t type = f->array ? H5Tarray_create2(f->type, 1, &length) : H5Tcopy(f->type);
+				H5Tinsert(memtype_, f->name.c_str(), f->offset, type);
+				H5Tclose(type);
+			}
+		}
+
+		buffer_.resize(count*rowsize_);
+		if (count == 0)
+			return;
+		hid_t filespace = check(H5Dget_space(dataset_), "H5Dget_space");
+		hid_t memspace = H5Screate_simple(1, &count, NULL);
+		herr_t status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET, &start, NULL, &count, NULL);
+		if (status >= 0)
+			status = H5Dread(dataset_, memtype_, memspace, filespace, H5P_DEFAULT, &buffer_[0]);
+		H5Sclose(memspace);
+		H5Sclose(filespace);
+		check(status, "Reading " + name_);
+	}
+
+	/** Get element *i* of a field in the given row of the last chunk read */
+	template <typename T>
+	T Get(hsize_t row, size_t field, size_t i=0) const
+	{
+		T value;
+		std::memcpy(&value, &buffer_[row*rowsize_ + fields_[field].offset + i*sizeof(T)], sizeof(T));
+		return value;
+	}
+private:
+	TableReader(const TableReader&);
+	TableReader& operator=(const TableReader&);
+
+	struct field {
+		std::string name;
+		hid_t type;
+		size_t offset, size, length;
+		bool array;
+	};
+
+	std::string name_;
+	hid_t dataset_, memtype_;
+	hsize_t nrows_;
+	std::vector<field> fields_;
+	size_t rowsize_;
+	std::vector<char> buffer_;
+};
+
+/*
+ * Append rows of weights to a table in the layout hdfwriter uses, so
+ * that it can be joined with the other tables on the event ID columns.
+ */
+class WeightTableWriter {
+public:
+	WeightTableWriter(hid_t file, const std::string &name,
+	    const std::vector<std::string> &columns, hsize_t chunksize)
+	    : file_(file), name_(name), ncolumns_(columns.size())
+	{
+		const char *index[] = { "Run", "Event", "SubEvent", "SubEventStream", "exists" };
+		const hid_t indexTypes[] = { H5T_NATIVE_UINT32, H5T_NATIVE_UINT32, H5T_NATIVE_UINT32,
+		    H5T_NATIVE_UINT32, H5T_NATIVE_UINT8 };
+		for (unsigned i=0; i < 5; i++) {
+			names_.push_back(index[i]);
+			types_.push_back(indexTypes[i]);
+			offsets_.push_back(i < 4 ? 4*i : 16);
+			sizes_.push_back(i < 4 ? 4 : 1);
+		}
+		for (size_t i=0; i < ncolumns_; i++) {
+			names_.push_back(columns[i].c_str());
+			types_.push_back(H5T_NATIVE_DOUBLE);
+			offsets_.push_back(GetWeightOffset() + i*sizeof(double));
+			sizes_.push_back(sizeof(double));
+		}
+
+		check(H5TBmake_table("Muon bundle weights [1/s]", file_, name_.c_str(),
+		    names_.size(), 0, GetRowSize(), &names_[0], &offsets_[0], &types_[0],
+		    std::min(chunksize, hsize_t(1024)), NULL, 1, NULL), "Creating table " + name_);
+	}
+
+	static size_t GetWeightOffset() { return 24; }
+	size_t GetRowSize() const { return GetWeightOffset() + ncolumns_*sizeof(double); }
+
+	/** Append rows packed in the layout described by GetWeightOffset() and GetRowSize() */
+	void Append(const std::vector<char> &rows)
+	{
+		const size_t nrows = rows.size()/GetRowSize();
+		if (nrows > 0)
+			check(H5TBappend_records(file_, name_.c_str(), nrows, GetRowSize(),
+			    &offsets_[0], &sizes_[0], &rows[0]), "Writing to " + name_);
+	}
+private:
+	hid_t file_;
+	std::string name_;
+	size_t ncolumns_;
+	std::vector<const char*> names_;
+	std::vector<hid_t> types_;
+	std::vector<size_t> offsets_, sizes_;
+};
+
+/*
+ * Walk through the rows of a table written by BundleMuonConverter in step
+ * with the bundle table. The muon table has its own number of rows, so it
+ * is read in chunks of its own.
+ */
+class MuonReader {
+public:
+	MuonReader(TableReader &table, hsize_t chunksize)
+	    : table_(table), chunksize_(chunksize), start_(0), count_(0), next_(0)
+	{
+		const char *ids[] = { "Run", "Event", "SubEvent" };
+		BOOST_FOREACH(const char *name, ids)
+			table_.AddField(name, H5T_NATIVE_UINT32);
+		table_.AddField("exists", H5T_NATIVE_UINT8);
+		table_.AddField("energy", H5T_NATIVE_FLOAT);
+		table_.AddField("radius", H5T_NATIVE_FLOAT);
+	}
+
+	/**
+	 * Consume the rows that belong to the event with the given Run, Event,
+	 * and SubEvent, adding their muons to *batch* if it is not NULL.
+	 * Returns the number of muons found.
+	 */
+	size_t Read(const uint32_t *ids, BundleBatch *batch)
+	{
+		enum { run, event, subevent, exists, energy, radius };
+
+		size_t nmuons = 0;
+		for (; Fill(); next_++) {
+			const hsize_t row = next_ - start_;
+			if (table_.Get<uint32_t>(row, run) != ids[0] || table_.Get<uint32_t>(row, event) != ids[1]
+			    || table_.Get<uint32_t>(row, subevent) != ids[2])
+				break;
+			if (!table_.Get<uint8_t>(row, exists))
+				continue;
+			if (batch)
+				batch->AddMuon(table_.Get<float>(row, radius), table_.Get<float>(row, energy));
+			nmuons++;
+		}
+
+		return nmuons;
+	}
+private:
+	// Make sure that the next row is in memory. Returns false at the end of the table.
+	bool Fill()
+	{
+		if (next_ < start_ + count_)
+			return true;
+		if (next_ >= table_.GetSize())
+			return false;
+		start_ = next_;
+		count_ = std::min(chunksize_, table_.GetSize() - start_);
+		table_.Read(start_, count_);
+		return true;
+	}
+
+	TableReader &table_;
+	hsize_t chunksize_, start_, count_, next_;
+};
+
+// One chunk of rows on its way through the pipeline
+struct chunk {
+	/** Output rows, with the weights still to be filled in */
+	std::vector<char> rows;
+	/** Position in *rows* of each bundle in *batch* */
+	std::vector<size_t> positions;
+	BundleBatch batch;
+	std::vector<double> weights;
+};
+
+void
+read_chunk(TableReader &axes, TableReader &bundles, MuonReader *muons,
+    hsize_t start, hsize_t count, size_t rowsize, chunk &c)
+{
+	// Field handles, in the order they were added in main()
+	enum { run, event, subevent, stream, exists, x, y, z, zenith, azimuth };
+	enum { brun, bevent, bsubevent, bexists, multiplicity, energy, radius };
+
+	axes.Read(start, count);
+	bundles.Read(start, count);
+	const size_t maxMultiplicity = muons ? 0 :
+	    std::min(bundles.GetLength(energy), bundles.GetLength(radius));
+
+	c.rows.assign(count*rowsize, 0);
+	c.positions.clear();
+	c.batch.clear();
+	for (hsize_t i=0; i < count; i++) {
+		const uint32_t ids[] = { axes.Get<uint32_t>(i, run), axes.Get<uint32_t>(i, event),
+		    axes.Get<uint32_t>(i, subevent), axes.Get<uint32_t>(i, stream) };
+		if (bundles.Get<uint32_t>(i, brun) != ids[0] || bundles.Get<uint32_t>(i, bevent) != ids[1]
+		    || bundles.Get<uint32_t>(i, bsubevent) != ids[2]) {
+			std::ostringstream msg;
+			msg << "Row " << (start+i) << " of the axis table is from event " << ids[0] << "/"
+			    << ids[1] << "/" << ids[2] << ", but the bundle table is not. "
+			    "Were they written from the same sub-event stream?";
+			throw std::runtime_error(msg.str());
+		}
+		char *row = &c.rows[i*rowsize];
+		std::memcpy(row, ids, sizeof(ids));
+
+		const uint8_t valid = axes.Get<uint8_t>(i, exists) && bundles.Get<uint8_t>(i, bexists);
+		row[16] = valid;
+		if (!valid) {
+			if (muons)
+				muons->Read(ids, NULL);
+			continue;
+		}
+
+		c.positions.push_back(i*rowsize);
+		c.batch.x.push_back(axes.Get<double>(i, x));
+		c.batch.y.push_back(axes.Get<double>(i, y));
+		c.batch.z.push_back(axes.Get<double>(i, z));
+		c.batch.zenith.push_back(axes.Get<double>(i, zenith));
+		c.batch.azimuth.push_back(axes.Get<double>(i, azimuth));
+		c.batch.multiplicity.push_back(0);
+		c.batch.offsets.push_back(c.batch.offsets.back());
+		if (muons) {
+			const size_t m = muons->Read(ids, &c.batch);
+			if (m != bundles.Get<uint32_t>(i, multiplicity)) {
+				std::ostringstream msg;
+				msg << "The muon table has " << m << " muons for event " << ids[0] << "/"
+				    << ids[1] << "/" << ids[2] << ", but the bundle table has "
+				    << bundles.Get<uint32_t>(i, multiplicity) << ". Were they written "
+				    "from the same sub-event stream?";
+				throw std::runtime_error(msg.str());
+			}
+		} else {
+			const size_t m = bundles.Get<uint32_t>(i, multiplicity);
+			if (m > maxMultiplicity) {
+				std::ostringstream msg;
+				msg << "Event " << ids[0] << "/" << ids[1] << "/" << ids[2] << " has " << m
+				    << " muons, but the bundle table only holds " << maxMultiplicity
+				    << ". Write the muons with BundleMuonConverter and pass that "
+				    "table with --muons.";
+				throw std::runtime_error(msg.str());
+			}
+			for (size_t j=0; j < m; j++)
+				c.batch.AddMuon(bundles.Get<float>(i, radius, j), bundles.Get<float>(i, energy, j));
+		}
+	}
+}
+
+void
+fill_weights(chunk &c, size_t nmodels)
+{
+	for (size_t i=0; i < c.positions.size(); i++)
+		std::memcpy(&c.rows[c.positions[i] + WeightTableWriter::GetWeightOffset()],
+		    &c.weights[i*nmodels], nmodels*sizeof(double));
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	tools::Options options(argc, argv);
+	if (options.Has("help") || options.GetPositional().size() < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const std::vector<std::string> &positional = options.GetPositional();
+	const hsize_t chunksize = std::max(1ul, options.Get("chunk-size", 100000ul));
+	const unsigned nthreads = unsigned(options.Get("threads", 0ul));
+	const std::string output = options.Get("output", "MuonGunWeights");
+
+	hid_t file = -1;
+	try {
+		GenerationProbabilityPtr generator;
+		for (size_t i=1; i < positional.size(); i++) {
+			GenerationProbabilityPtr p =
+			    tools::LoadGenerationProbability(positional[i], options.Get("key"));
+			generator = generator ? generator + p : p;
+		}
+
+		std::vector<std::string> columns;
+		std::vector<BundleModel> models;
+		BOOST_FOREACH(const std::string &name,
+		    tools::Split(options.Get("models", "Hoerandel5_atmod12_SIBYLL"))) {
+			models.push_back(tools::LoadBundleModel(name));
+			columns.push_back(name.substr(name.find_last_of('/')+1));
+		}
+		if (models.empty())
+			throw std::runtime_error("No flux models given");
+		const MultiModelWeightCalculator weighter(models, generator);
+
+		// Report errors through exceptions rather than the HDF5 error stack
+		H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+		file = H5Fopen(positional[0].c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+		if (file < 0)
+			throw std::runtime_error("Can't open " + positional[0] + " for writing");
+
+		TableReader axes(file, options.Get("axis", "MCPrimary"));
+		const char *axisFields[] = { "Run", "Event", "SubEvent", "SubEventStream", "exists" };
+		BOOST_FOREACH(const char *name, axisFields)
+			axes.AddField(name, std::string(name) == "exists" ? H5T_NATIVE_UINT8 : H5T_NATIVE_UINT32);
+		const char *coordinates[] = { "x", "y", "z", "zenith", "azimuth" };
+		BOOST_FOREACH(const char *name, coordinates)
+			axes.AddField(name, H5T_NATIVE_DOUBLE);
+
+		TableReader bundles(file, options.Get("bundle", "BundleParameters"));
+		bundles.AddField("Run", H5T_NATIVE_UINT32);
+		bundles.AddField("Event", H5T_NATIVE_UINT32);
+		bundles.AddField("SubEvent", H5T_NATIVE_UINT32);
+		bundles.AddField("exists", H5T_NATIVE_UINT8);
+		bundles.AddField("multiplicity", H5T_NATIVE_UINT32);
+		boost::scoped_ptr<TableReader> muonTable;
+		boost::scoped_ptr<MuonReader> muons;
+		if (options.Has("muons")) {
+			muonTable.reset(new TableReader(file, options.Get("muons")));
+			muons.reset(new MuonReader(*muonTable, chunksize));
+		} else {
+			bundles.AddField("energy", H5T_NATIVE_FLOAT);
+			bundles.AddField("radius", H5T_NATIVE_FLOAT);
+		}
+
+		if (axes.GetSize() != bundles.GetSize())
+			throw std::runtime_error("The axis and bundle tables have different numbers of rows");
+		const hsize_t nrows = axes.GetSize();
+
+		if (H5Lexists(file, output.c_str(), H5P_DEFAULT) > 0) {
+			if (!options.Has("overwrite"))
+				throw std::runtime_error(output + " already exists; pass --overwrite to replace it");
+			check(H5Ldelete(file, output.c_str(), H5P_DEFAULT), "Removing " + output);
+		}
+		WeightTableWriter writer(file, output, columns, chunksize);
+
+		// Weight each chunk in the background while the next one is read.
+		// All HDF5 calls stay on this thread.
+		chunk current, next;
+		read_chunk(axes, bundles, muons.get(), 0, std::min(chunksize, nrows),
+		    writer.GetRowSize(), current);
+		for (hsize_t start = 0; start < nrows; start += chunksize) {
+			std::future<void> weighing = std::async(std::launch::async, [&]()
+			{
+				weighter.GetWeights(current.batch, current.weights, nthreads);
+			});
+			const hsize_t following = start + chunksize;
+			try {
+				if (following < nrows)
+					read_chunk(axes, bundles, muons.get(), following,
+					    std::min(chunksize, nrows-following), writer.GetRowSize(), next);
+			} catch (...) {
+				weighing.wait();
+				throw;
+			}
+			weighing.get();
+
+			fill_weights(current, models.size());
+			writer.Append(current.rows);
+			log_info("Weighted %lu/%lu rows",
+			    (unsigned long)std::min(nrows, following), (unsigned long)nrows);
+			std::swap(current, next);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		if (file >= 0)
+			H5Fclose(file);
+		return 1;
+	}
+
+	if (H5Fclose(file) < 0) {
+		std::cerr << "Error writing " << positional[0] << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+/** $Id$
+ * @file
+ * @author Jakob van Santen <vansanten@wisc.edu>
+ *
+ * $Revision$
+ * $Date$
+ */
+
+#ifndef I3MUONGUN_BUNDLERECORD_H_INCLUDED
+#define I3MUONGUN_BUNDLERECORD_H_INCLUDED
+
+#include <MuonGun/Generator.h>
+#include <dataclasses/I3Position.h>
+#include <dataclasses/I3Direction.h>
+#include <dataclasses/physics/I3Particle.h>
+
+namespace I3MuonGun {
+
+/**
+ * @brief A compact record of a generated muon bundle
+ *
+ * GeneratorModule stores one of these next to each I3MCTree it emits. It
+ * holds everything WeightCalculatorModule needs to weight the bundle, so the
+ * muons don't have to be dug back out of the tree, and if the bundle is
+ * weighted with the generator that produced it, the generation probability
+ * doesn't have to be calculated again either.
+ */
+class BundleRecord : public I3FrameObject {
+public:
+	BundleRecord();
+	/**
+	 * @param[in] axis   the bundle axis
+	 * @param[in] bundle the muons, with energies at the sampling surface
+	 */
+	BundleRecord(const I3Particle &axis, const BundleSpec &bundle);
+	virtual ~BundleRecord();
+
+	/** Position and direction of the bundle axis */
+	I3Position pos;
+	I3Direction dir;
+	/** Radial offset and energy of each muon in the I3MCTree */
+	std::vector<double> radius, energy;
+	/**
+	 * Radial offset and upper energy bound of each muon that was left out
+	 * of the I3MCTree for being below the generator's energy threshold
+	 */
+	std::vector<double> omittedRadius, omittedEnergy;
+
+	/**
+	 * Log of the generation probability of a single event, i.e.
+	 * GetLogGeneratedEvents() of the generator scaled to 1 event
+	 */
+	double logGenerationProbability;
+	/** GetGeneratorHash() of the generator that produced the bundle */
+	uint64_t generatorHash;
+
+	I3Particle GetAxis() const;
+	BundleSpec GetBundle() const;
+
+	/**
+	 * @brief Identify a generation scheme, irrespective of how many events
+	 *        it generates
+	 *
+	 * The hash is built from GenerationProbability::Hash(), so it only
+	 * matches generators that were configured identically, whether or not
+	 * their normalizations have been computed yet.
+	 */
+	static uint64_t GetGeneratorHash(const GenerationProbability &generator);
+
+	bool operator==(const BundleRecord &) const;
+private:
+	friend class icecube::serialization::access;
+	template <typename Archive>
+	void serialize(Archive&, unsigned);
+};
+
+I3_POINTER_TYPEDEFS(BundleRecord);
+
+}
+
+#endif // I3MUONGUN_BUNDLERECORD_H_INCLUDED
@@ -31,6 +31,7 @@ public:
 
 	// SamplingSurface interface
 	bool operator==(const SamplingSurface&) const;
+	uint64_t Hash() const;
 
 	double GetLength() const { return CylinderBase::GetLength(); };
 
@@ -49,11 +49,25 @@ public:
 	};
 	virtual double GetLog(double depth, double cos_theta,
 	    unsigned multiplicity, double radius, log_value log_energy) const = 0;
+	/**
+	 * @brief Get the log of the probability that a muon has an energy below
+	 *        *log_energy*
+	 *
+	 * For bundles this is still a density in radius. It is used to account
+	 * for muons that were omitted from an event because they fell below an
+	 * energy threshold.
+	 */
+	virtual double GetLogCumulative(double depth, double cos_theta,
+	    unsigned multiplicity, double radius, log_value log_energy) const;
 
 	/// Sample *samples* (radius, energy) pairs
 	virtual std::vector<std::pair<double,double> > Generate(I3RandomService &rng,
 	    double depth, double cos_theta, unsigned multiplicity, unsigned samples) const = 0;
 	
+	/**
+	 * The range of energies the distribution covers. Distributions are
+	 * renormalized when it is narrowed.
+	 */
 	double GetMax() const { return std::exp(maxLog_); }
 	double GetMin() const { return std::exp(minLog_); }
 	void SetMax(double v) { maxLog_ = std::log(v); }
@@ -62,6 +76,11 @@ public:
 	virtual double GetMaxRadius() const = 0;
 	
 	virtual bool operator==(const EnergyDistribution&) const = 0;
+	/**
+	 * @brief A hash of the configuration. Distributions that compare
+	 *        equal have the same hash.
+	 */
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -78,6 +97,11 @@ I3_POINTER_TYPEDEFS(EnergyDistribution);
  *
  * The surface is fit to @f$ d \log{P} / d\log(E) @f$, which is nearly
  * polynomial and thus easier to represent with low-order splines.
+ *
+ * If the energy range is narrowed with SetMin() or SetMax(), the density
+ * is divided by its integral over the remaining range. This integral
+ * depends on depth, zenith angle, and multiplicity, and is recomputed
+ * whenever those change.
  */
 class SplineEnergyDistribution : public EnergyDistribution {
 public:
@@ -88,9 +112,23 @@ public:
 	    double depth, double cos_theta, unsigned multiplicity, unsigned samples) const;
 	virtual double GetMaxRadius() const;
 	virtual bool operator==(const EnergyDistribution&) const;
+	virtual uint64_t Hash() const;
+	
+	/** Has the energy range been narrowed from the extent of the fit? */
+	bool IsTruncated() const;
 private:
 	SplineEnergyDistribution() {}
 	
+	/** Set the energy range to the extent of the fit */
+	void ResetEnergyRange();
+	/** The density as fit, without renormalization */
+	double GetLogDensity(double depth, double cos_theta,
+	    unsigned multiplicity, double radius, log_value log_energy) const;
+	/** Log of the integral of the fit density over the current energy range */
+	double GetLogNorm(double depth, double cos_theta, unsigned multiplicity) const;
+	/** Integral of the fit density over the current energy range */
+	double IntegrateDensity(double depth, double cos_theta, unsigned multiplicity) const;
+	
 	friend class icecube::serialization::access;
 	template <typename Archive>
 	void serialize(Archive &, unsigned);
@@ -110,6 +148,7 @@ public:
 	virtual double GetMaxRadius() const;
 	
 	virtual bool operator==(const EnergyDistribution&) const;
+	virtual uint64_t Hash() const;
 	
 	OffsetPowerLaw GetSpectrum(double depth, double cos_theta, unsigned m, double r) const;
 private:
@@ -152,6 +191,8 @@ public:
 	double operator()(double energy) const;
 	double GetLog(double energy) const;
 	double GetLog(EnergyDistribution::log_value log_energy) const;
+	/** Calculate the log of the probability of an energy below *energy* */
+	double GetLogCumulative(double energy) const;
 	/** Draw an energy from the distribution */
 	double Generate(I3RandomService &rng) const;
 	double InverseSurvivalFunction(double p) const;
@@ -160,6 +201,7 @@ public:
 	const double GetMax() const { return emax_; }
 	
 	bool operator==(const OffsetPowerLaw &other) const;
+	uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -170,11 +212,68 @@ private:
 	double nmin_, nmax_, norm_, lognorm_;
 };
 
+/**
+ * @brief A tabulated energy spectrum made of power-law segments
+ *
+ * The density is specified at a set of knot energies and interpolated
+ * linearly in @f$ \log{dP/dE} @f$ vs. @f$ \log{E} @f$, i.e. each segment is
+ * an exact power law. Both the normalization and the inverse CDF are
+ * available in closed form, so it can be used as a generation spectrum that
+ * closely follows the shape of a more detailed model, e.g. with
+ * StaticSurfaceInjector::FitEnergyProposal().
+ */
+class PiecewisePowerLaw {
+public:
+	PiecewisePowerLaw();
+	/**
+	 * @param[in] energies    knot energies, in increasing order
+	 * @param[in] log_density logarithm of the (unnormalized) density
+	 *                        @f$ dP/dE @f$ at each knot
+	 */
+	PiecewisePowerLaw(const std::vector<double> &energies, const std::vector<double> &log_density);
+	typedef double result_type;
+	/** Calculate the probability that the given energy was generated */
+	double operator()(double energy) const;
+	double GetLog(double energy) const;
+	double GetLog(EnergyDistribution::log_value log_energy) const;
+	/** Calculate the log of the probability of an energy below *energy* */
+	double GetLogCumulative(double energy) const;
+	/** Draw an energy from the distribution */
+	double Generate(I3RandomService &rng) const;
+	double InverseSurvivalFunction(double p) const;
+	
+	double GetMin() const { return std::exp(logEnergy_.front()); }
+	double GetMax() const { return std::exp(logEnergy_.back()); }
+	
+	std::vector<double> GetEnergies() const;
+	/** @returns the normalized log density at each knot */
+	const std::vector<double>& GetLogDensity() const { return logDensity_; }
+	
+	bool operator==(const PiecewisePowerLaw &other) const;
+	uint64_t Hash() const;
+private:
+	friend class icecube::serialization::access;
+	template <typename Archive>
+	void serialize(Archive &, unsigned);
+	
+	/** Scale the densities to integrate to 1 */
+	void Normalize();
+	/** Recalculate slope_ and cdf_, and return the integral of the densities */
+	double UpdateSegments();
+	
+	std::vector<double> logEnergy_, logDensity_;
+	// Power-law index and cumulative probability at the upper edge of each segment
+	std::vector<double> slope_, cdf_;
+};
+
+I3_POINTER_TYPEDEFS(PiecewisePowerLaw);
+
 }
 
-I3_CLASS_VERSION(I3MuonGun::EnergyDistribution, 0);
-I3_CLASS_VERSION(I3MuonGun::SplineEnergyDistribution, 0);
+I3_CLASS_VERSION(I3MuonGun::EnergyDistribution, 1);
+I3_CLASS_VERSION(I3MuonGun::SplineEnergyDistribution, 1);
 I3_CLASS_VERSION(I3MuonGun::BMSSEnergyDistribution, 0);
 I3_CLASS_VERSION(I3MuonGun::OffsetPowerLaw, 0);
+I3_CLASS_VERSION(I3MuonGun::PiecewisePowerLaw, 0);
 
 #endif
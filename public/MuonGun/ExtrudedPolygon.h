@@ -23,10 +23,8 @@ public:
 	virtual ~ExtrudedPolygon();
 	ExtrudedPolygon(const std::vector<I3Position> &points, double padding=0.) : Base(points, padding) {};
 	
-	virtual bool operator==(const SamplingSurface&) const
-	{
-		return false;
-	}
+	virtual bool operator==(const SamplingSurface&) const;
+	virtual uint64_t Hash() const;
 
 protected:
 	// UprightSurface interface
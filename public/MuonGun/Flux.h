@@ -36,6 +36,11 @@ public:
 	void SetMinMultiplicity(unsigned m) { minMultiplicity_ = m; }
 	
 	virtual bool operator==(const Flux&) const;
+	/**
+	 * @brief A hash of the configuration. Fluxes that compare equal have
+	 *        the same hash.
+	 */
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -55,6 +60,7 @@ public:
 	double GetLog(double depth, double cos_theta, unsigned multiplicity) const;
 	
 	virtual bool operator==(const Flux&) const;
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -73,6 +79,7 @@ public:
 	double GetLog(double depth, double cos_theta, unsigned multiplicity) const;
 	
 	virtual bool operator==(const Flux&) const;
+	virtual uint64_t Hash() const;
 private:
 	SplineFlux() {}
 	
@@ -10,8 +10,12 @@
 #define I3MUONGUN_GENERATOR_H_INCLUDED
 
 #include <list>
+#include <unordered_map>
 #include <vector>
+#include <stdint.h>
 #include <boost/make_shared.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/iterator/iterator_facade.hpp>
 
 #include <icetray/I3PointerTypedefs.h>
 #include <icetray/I3FrameObject.h>
@@ -19,6 +23,8 @@
 #include <I3/hash_map.h>
 
 class I3Particle;
+class I3Position;
+class I3Direction;
 struct I3ParticleID;
 class I3RandomService;
 namespace TreeBase {
@@ -34,24 +40,186 @@ namespace I3MuonGun {
 
 /**
  * The radial offset and energy of each muon in a bundle
+ *
+ * Muons that were generated below a generator's energy threshold are not
+ * added to the I3MCTree. They are marked as *omitted*, and their *energy*
+ * is only an upper bound on the true energy.
  */
 struct BundleEntry {
-	BundleEntry(double r=0., double e=0.) : radius(r), energy(e) {}
+	BundleEntry(double r=0., double e=0., bool o=false) : radius(r), energy(e), omitted(o) {}
 	double radius, energy;
+	bool omitted;
 	bool operator<(const BundleEntry &other) const
 	{
 		return other.energy < this->energy;
 	}
 	bool operator==(const BundleEntry &other) const
 	{
-		return (this->radius == other.radius) && (this->energy == other.energy);
+		return (this->radius == other.radius) && (this->energy == other.energy)
+		    && (this->omitted == other.omitted);
 	}
 };
 typedef std::list<BundleEntry> BundleConfiguration;
 
+/**
+ * @brief The radial offset and energy of each muon in a bundle, stored as
+ *        parallel arrays
+ *
+ * This holds the same information as a BundleConfiguration, but keeps it
+ * in contiguous arrays with room for a typical bundle inline, so filling
+ * one usually doesn't allocate, and walking it doesn't chase list nodes.
+ * The energy of the leading muon is kept up to date as entries are added.
+ *
+ * A BundleSpec can be implicitly constructed from a BundleConfiguration,
+ * so interfaces that take one also accept the other.
+ */
+class BundleSpec {
+public:
+	typedef boost::container::small_vector<double, 8> array_type;
+	typedef BundleEntry value_type;
+	
+	/** Iterates over the entries, yielding a BundleEntry by value */
+	class const_iterator : public boost::iterator_facade<const_iterator,
+	    const BundleEntry, boost::random_access_traversal_tag, BundleEntry> {
+	public:
+		const_iterator() : bundle_(NULL), index_(0) {}
+		const_iterator(const BundleSpec &bundle, size_t index) : bundle_(&bundle), index_(index) {}
+	private:
+		friend class boost::iterator_core_access;
+		BundleEntry dereference() const { return (*bundle_)[index_]; }
+		bool equal(const const_iterator &other) const { return index_ == other.index_; }
+		void increment() { index_++; }
+		void decrement() { index_--; }
+		void advance(std::ptrdiff_t n) { index_ += n; }
+		std::ptrdiff_t distance_to(const const_iterator &other) const
+		{ return std::ptrdiff_t(other.index_) - std::ptrdiff_t(index_); }
+		
+		const BundleSpec *bundle_;
+		size_t index_;
+	};
+	typedef const_iterator iterator;
+	
+	BundleSpec() : maxEnergy_(0) {}
+	BundleSpec(const BundleConfiguration &entries);
+	
+	/** Copy the entries into a list */
+	BundleConfiguration GetEntries() const;
+	
+	size_t size() const { return energy_.size(); }
+	bool empty() const { return energy_.empty(); }
+	unsigned GetMultiplicity() const { return unsigned(energy_.size()); }
+	/** The highest energy (or energy bound) of any entry, or 0 if empty */
+	double GetMaxEnergy() const { return maxEnergy_; }
+	
+	void reserve(size_t n);
+	void clear();
+	void push_back(const BundleEntry &entry);
+	
+	BundleEntry operator[](size_t i) const
+	{ return BundleEntry(radius_[i], energy_[i], omitted_[i]); }
+	BundleEntry front() const { return (*this)[0]; }
+	
+	double GetRadius(size_t i) const { return radius_[i]; }
+	double GetEnergy(size_t i) const { return energy_[i]; }
+	bool IsOmitted(size_t i) const { return omitted_[i]; }
+	void SetRadius(size_t i, double radius) { radius_[i] = radius; }
+	/** Mark entry *i* as omitted, with the given upper bound on its energy */
+	void Omit(size_t i, double bound);
+	
+	const array_type& GetRadii() const { return radius_; }
+	const array_type& GetEnergies() const { return energy_; }
+	
+	/** Sort in descending order of energy, like BundleConfiguration::sort() */
+	void sort();
+	
+	const_iterator begin() const { return const_iterator(*this, 0); }
+	const_iterator end() const { return const_iterator(*this, size()); }
+	
+	bool operator==(const BundleSpec &other) const;
+private:
+	array_type radius_, energy_;
+	boost::container::small_vector<bool, 8> omitted_;
+	double maxEnergy_;
+};
+
+/**
+ * @brief The kinematics of many muon bundles, stored as parallel arrays
+ *
+ * The muons belonging to bundle i occupy the range
+ * [offsets[i], offsets[i+1]) of the radius and energy arrays.
+ */
+struct BundleBatch {
+	BundleBatch() : offsets(1, 0) {}
+	
+	/** Bundle axes: impact point on the sampling surface and direction */
+	std::vector<double> x, y, z, zenith, azimuth;
+	std::vector<uint32_t> multiplicity;
+	std::vector<uint64_t> offsets;
+	/** Radial offset and energy of each muon */
+	std::vector<double> radius, energy;
+	
+	size_t size() const { return multiplicity.size(); }
+	void clear();
+	void reserve(size_t bundles, size_t muons);
+	
+	/** Start a new (empty) bundle with the given axis */
+	void AddBundle(const I3Position &pos, const I3Direction &dir);
+	/** Add a muon to the most recently started bundle */
+	void AddMuon(double radius, double energy);
+};
+
 I3_FORWARD_DECLARATION(SamplingSurface);
 I3_FORWARD_DECLARATION(GenerationProbability);
 
+class ThreadPool;
+
+/**
+ * @brief Quantities derived from a bundle that generation probabilities
+ *        and weights have in common
+ *
+ * Everything that depends only on the bundle is calculated once, on
+ * construction. The point where the axis enters a sampling surface is
+ * calculated on first use, and reused for as long as it is requested for
+ * the same (or an identical) surface, so that e.g. all the members of a
+ * GenerationProbabilityCollection share a single intersection.
+ *
+ * The axis and bundle are held by reference, and must outlive this object.
+ */
+class BundleKinematics {
+public:
+	BundleKinematics(const I3Particle &axis, const BundleSpec &bundle);
+	/**
+	 * A BundleConfiguration would be converted to a temporary BundleSpec
+	 * that dies before this object does. Convert it explicitly instead.
+	 */
+	BundleKinematics(const I3Particle &axis, const BundleConfiguration &bundle) = delete;
+	
+	const I3Particle& GetAxis() const { return *axis_; }
+	const BundleSpec& GetBundle() const { return *bundle_; }
+	unsigned GetMultiplicity() const { return bundle_->GetMultiplicity(); }
+	double GetCosZenith() const { return cosZenith_; }
+	/** Natural logarithm of the energy of entry *i* */
+	double GetLogEnergy(size_t i) const { return logEnergy_[i]; }
+	
+	/**
+	 * Distance along the axis from its position to the point where it
+	 * enters *surface*. This is not finite if the axis misses.
+	 */
+	double GetEntry(SamplingSurfaceConstPtr surface) const;
+	/** Vertical depth of the point where the axis enters *surface* */
+	double GetDepth(SamplingSurfaceConstPtr surface) const;
+private:
+	void Intersect(SamplingSurfaceConstPtr surface) const;
+	
+	const I3Particle *axis_;
+	const BundleSpec *bundle_;
+	double cosZenith_;
+	BundleSpec::array_type logEnergy_;
+	
+	mutable SamplingSurfaceConstPtr surface_;
+	mutable double entry_, depth_;
+};
+
 /**
  * @brief A muon bundle generation scheme
  *
@@ -78,9 +246,11 @@ public:
 	 *          For multi-muon bundles it contains an additional doubly differential probability in radius and energy
 	 *          for each muon in the bundle.
 	 */
-	double GetLogGeneratedEvents(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	double GetLogGeneratedEvents(const I3Particle &axis, const BundleSpec &bundle) const;
+	/** @brief Calculate GetLogGeneratedEvents from precomputed kinematics */
+	double GetLogGeneratedEvents(const BundleKinematics &kinematics) const;
 	/** @brief Call GetLogGeneratedEvents and exponential the result **/
-	double GetGeneratedEvents(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	double GetGeneratedEvents(const I3Particle &axis, const BundleSpec &bundle) const;
 	
 public:
 	/**
@@ -99,6 +269,35 @@ public:
 	 *          within a scale factor, false otherwise.
 	 */
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const = 0;
+	
+	/**
+	 * @brief A hash of the configuration, excluding the number of events
+	 *
+	 * Distributions that are compatible have the same hash, so it can be
+	 * used to find candidates for IsCompatible() without comparing
+	 * against everything. The default implementation returns the same
+	 * value for every distribution.
+	 */
+	virtual uint64_t Hash() const;
+	
+	/**
+	 * @brief Could this scheme have generated the given bundle at all?
+	 *
+	 * This is a cheap check of the injection bounds, e.g. the range of
+	 * zenith angles or muon energies. If it returns false, the generation
+	 * probability is zero, and collections skip evaluating it. The default
+	 * implementation always returns true.
+	 */
+	virtual bool Covers(const BundleKinematics &kinematics) const;
+	
+	/**
+	 * @brief Compute every normalization that is otherwise computed lazily
+	 *
+	 * Call this before evaluating or sampling from the distribution on
+	 * several threads at once; afterwards, no const method writes to it.
+	 * The default implementation does nothing.
+	 */
+	virtual void Prepare() const;
 protected:
 	/**
 	 * @brief Calculate the differential probability per event that the
@@ -107,11 +306,12 @@ protected:
 	 * For single muons, this is @f$ \log(dP/dE) [\log(1/GeV)]@f$, for bundles
 	 * @f$ \log(d^2P/dEdr) [\log(1/GeV m)]@f$
 	 *
-	 * @param[in] axis   the bundle axis
-	 * @param[in] bundle the radial offset and energy of each muon
-	 *                   in the bundle
+	 * @param[in] kinematics the bundle axis, and the radial offset and
+	 *                       energy of each muon in the bundle
 	 */
-	virtual double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const = 0;
+	virtual double GetLogGenerationProbability(const BundleKinematics &kinematics) const = 0;
+	/** @brief Shorthand for GetLogGenerationProbability(BundleKinematics(axis, bundle)) */
+	double GetLogGenerationProbability(const I3Particle &axis, const BundleSpec &bundle) const;
 
 private:
 	friend class icecube::serialization::access;
@@ -136,14 +336,36 @@ public:
 	virtual GenerationProbabilityPtr Clone() const;
 	virtual SamplingSurfaceConstPtr GetInjectionSurface() const;
 	virtual bool IsCompatible(GenerationProbabilityConstPtr) const;
+	/** Combined hash of the members and their relative numbers of events */
+	virtual uint64_t Hash() const;
+	/** Does any of the distributions in the collection cover the bundle? */
+	virtual bool Covers(const BundleKinematics &kinematics) const;
+	/** Prepare every distribution in the collection */
+	virtual void Prepare() const;
+	
+	/**
+	 * @brief Evaluate the members of the collection on a pool of threads
+	 *
+	 * This pays off for collections with hundreds of members, e.g. from
+	 * merging many files. Small collections are always evaluated serially.
+	 *
+	 * @param[in] nthreads number of threads. If 0 (the default), evaluate
+	 *                     members serially.
+	 */
+	void SetNumThreads(unsigned nthreads);
+	unsigned GetNumThreads() const;
 protected:
 	/**
 	 * Calculate the *total* probability that the given configuration was generated
 	 * by any of the distributions in the colleciton.
 	 */
-	virtual double GetLogGenerationProbability(const I3Particle &axis, const BundleConfiguration &bundle) const;
+	virtual double GetLogGenerationProbability(const BundleKinematics &kinematics) const;
 private:
 	GenerationProbabilityCollection() {}
+	
+	boost::shared_ptr<ThreadPool> pool_;
+	/** Position of each member, keyed by its Hash() */
+	std::unordered_multimap<uint64_t, size_t> index_;
 	friend class icecube::serialization::access;
 	template <typename Archive>
 	void serialize(Archive&, unsigned);
@@ -179,7 +401,26 @@ public:
 	 * @param[out] bundle the radial offset and energy of each muon
 	 *                    in the bundle
 	 */
-	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const = 0;
+	virtual void Generate(I3RandomService &rng, I3MCTree &tree, BundleSpec &bundle) const = 0;
+	/** @brief Generate a muon bundle, reporting it as a list of entries */
+	void Generate(I3RandomService &rng, I3MCTree &tree, BundleConfiguration &bundle) const;
+	
+	/**
+	 * @brief Generate many muon bundles without building I3MCTrees
+	 *
+	 * @param[in]  rng   A random number generator
+	 * @param[in]  n     Number of bundles to generate
+	 * @param[out] batch Axes, radial offsets, and energies of the generated
+	 *                   bundles are appended here
+	 *
+	 * The default implementation calls Generate() and extracts the bundle
+	 * from the tree; generators should override it with something faster.
+	 * Muon energy thresholds are not applied here: every muon is recorded
+	 * with its true energy.
+	 */
+	virtual void GenerateBatch(I3RandomService &rng, size_t n, BundleBatch &batch) const;
+	/** @brief Generate *n* bundles into a new BundleBatch */
+	BundleBatch GenerateBatch(I3RandomService &rng, size_t n) const;
 
 	/**
 	 * @brief Place a muon at a given radial offset and rotation with respect
@@ -193,6 +434,16 @@ public:
 	 */
 	static I3Particle CreateParallelTrack(double radius, double azimuth,
 	    const I3Surfaces::Surface &surface, const I3Particle &axis);
+	
+	/**
+	 * @brief Does the bundle axis or any muon in the tree come within
+	 *        reach of *target*?
+	 *
+	 * Tracks are treated as rays starting at their positions. This ignores
+	 * energy losses, so bundles that fail this test can be safely discarded
+	 * before propagation.
+	 */
+	static bool HitsTarget(const I3MCTree &tree, const I3Surfaces::Surface &target);
 
 private:
 	friend class icecube::serialization::access;
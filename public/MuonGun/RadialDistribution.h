@@ -58,6 +58,11 @@ public:
 	    
 	
 	virtual bool operator==(const RadialDistribution&) const = 0;
+	/**
+	 * @brief A hash of the configuration. Distributions that compare
+	 *        equal have the same hash.
+	 */
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -78,6 +83,7 @@ public:
 	    unsigned multiplicity) const;
 	
 	virtual bool operator==(const RadialDistribution&) const;
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -107,6 +113,7 @@ public:
 	    unsigned multiplicity) const;
 	
 	virtual bool operator==(const RadialDistribution&) const;
+	virtual uint64_t Hash() const;
 private:
 	SplineRadialDistribution() {}
 	friend class icecube::serialization::access;
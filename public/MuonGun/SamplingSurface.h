@@ -39,6 +39,14 @@ public:
 	virtual double IntegrateFlux(boost::function<double (double, double)> flux, double cosMin=0, double cosMax=1) const = 0;
 
 	virtual bool operator==(const SamplingSurface&) const = 0;
+	/**
+	 * @brief A hash of the surface's configuration
+	 *
+	 * Surfaces that compare equal have the same hash, so it can be used to
+	 * find candidates for comparison without comparing every pair. The
+	 * default implementation gives every surface the same hash.
+	 */
+	virtual uint64_t Hash() const;
 private:
 	friend class icecube::serialization::access;
 	template <typename Archive>
@@ -40,6 +40,19 @@ public:
 	I3Position GetPos(double length) const;
 	double GetTime(double length) const;
 	
+	/**
+	 * Get the energy of the particle at several down-track distances.
+	 * The result is the same as calling GetEnergy(double) for each
+	 * distance, but if the distances are in ascending order, the energy
+	 * losses are traversed only once for all of them.
+	 *
+	 * @param[in] lengths distances from the track origin
+	 * @returns one energy for each distance
+	 */
+	std::vector<double> GetEnergy(const std::vector<double> &lengths) const;
+	std::vector<I3Position> GetPos(const std::vector<double> &lengths) const;
+	std::vector<double> GetTime(const std::vector<double> &lengths) const;
+	
 	// Un-hide overridden base class methods
 	using I3Particle::GetEnergy;
 	using I3Particle::GetPos;
@@ -52,6 +65,18 @@ public:
 	 * in the I3MCTree, and store them together in a Track.
 	 */
 	static std::list<Track> Harvest(const I3MCTree &, const I3MMCTrackList &);
+	
+	/**
+	 * @brief Extract energy losses from frame objects, reusing earlier results
+	 *
+	 * Like Harvest(const I3MCTree &, const I3MMCTrackList &), but the
+	 * tracks are remembered for as long as both frame objects are alive,
+	 * so that every consumer of a frame shares a single harvest. Frame
+	 * objects are assumed not to change once they are in the frame.
+	 * Safe to call from several threads at once.
+	 */
+	static boost::shared_ptr<const std::list<Track> > Harvest(I3MCTreeConstPtr,
+	    boost::shared_ptr<const I3MMCTrackList>);
 
 	/**
 	 * @brief A point at which the absolute energy of the particle is known
@@ -71,12 +96,19 @@ public:
 		    : length(l), energy(e) {}
 	};
 	
-	std::vector<Checkpoint> GetCheckpoints() const { return checkpoints_; }
-	std::vector<LossSum> GetLosses() const { return losses_; }
+	std::vector<Checkpoint> GetCheckpoints() const;
+	std::vector<LossSum> GetLosses() const;
 	
 private:
-	std::vector<Checkpoint> checkpoints_;
-	std::vector<LossSum> losses_;
+	void AddCheckpoint(double length, double energy);
+	void AddLoss(double length, double energy);
+	double GetEnergy(double length, size_t checkpoint, size_t loss) const;
+	
+	// Checkpoints and loss sums, stored as parallel arrays. The offset of a
+	// checkpoint is the index of the first loss sum after it.
+	std::vector<double> checkpointLength_, checkpointEnergy_;
+	std::vector<size_t> checkpointOffset_;
+	std::vector<double> lossLength_, lossEnergy_;
 };
 
 I3_POINTER_TYPEDEFS(Track);
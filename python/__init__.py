@@ -66,3 +66,34 @@ def corsika_genprob(config='CascadeOptimized5Comp', atmosphere=12, hadronic_mode
 	    SplineRadialDistribution(base+'.radius.fits'),
 	    SplineEnergyDistribution(base+'.single_energy.fits', base+'.bundle_energy.fits'))
 del expandvars
+
+def read_bundles(fname):
+	"""
+	Read a file written by MuonGun-generate.
+	
+	:returns: a tuple (nevents, bundles), where nevents is the number of
+	          events the generator represents and bundles is a dict of
+	          numpy arrays with the same layout as Generator.generate_batch()
+	"""
+	import numpy, struct
+	columns = dict(x=[], y=[], z=[], zenith=[], azimuth=[], multiplicity=[], radius=[], energy=[])
+	with open(fname, 'rb') as f:
+		if f.read(8) != b'MGBUNDL1':
+			raise ValueError("%s was not written by MuonGun-generate" % fname)
+		nevents, header = struct.unpack('<dQ', f.read(16))
+		f.seek(header, 1)
+		while True:
+			nbundles = struct.unpack('<Q', f.read(8))[0]
+			if nbundles == 0:
+				break
+			nmuons = struct.unpack('<Q', f.read(8))[0]
+			for k in ('x', 'y', 'z', 'zenith', 'azimuth'):
+				columns[k].append(numpy.fromfile(f, dtype='<f8', count=nbundles))
+			columns['multiplicity'].append(numpy.fromfile(f, dtype='<u4', count=nbundles))
+			for k in ('radius', 'energy'):
+				columns[k].append(numpy.fromfile(f, dtype='<f8', count=nmuons))
+	bundles = dict()
+	for k, v in columns.items():
+		bundles[k] = numpy.concatenate(v) if len(v) else numpy.zeros(0)
+	bundles['offsets'] = numpy.concatenate(([0], numpy.cumsum(bundles['multiplicity'], dtype=numpy.uint64)))
+	return nevents, bundles
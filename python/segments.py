@@ -7,11 +7,24 @@ def GenerateBundles(tray, name, Generator=None,
     RunNumber=1, NEvents=100,
     GCDFile='/data/sim/sim-new/downloads/GCD_31_08_11/GeoCalibDetectorStatus_IC79.55380_L2a.i3.gz',
     FromTime=dataclasses.I3Time(55380),
-    ToTime=dataclasses.I3Time(55380)):
+    ToTime=dataclasses.I3Time(55380), NThreads=0, FirstEvent=None,
+    TargetSurface=None, Thinning=None):
 	"""
 	Generate muon bundles from a parametrization.
 	
 	:param Generator: an instance of I3MuonGun.Generator
+	:param NThreads: if nonzero, generate events on this many background
+	                 threads while downstream modules run
+	:param FirstEvent: if not None, generate each event from a random stream
+	                   keyed by RunNumber and its index in the campaign,
+	                   starting at FirstEvent (see MuonGun.ShardPlan)
+	:param TargetSurface: if not None, discard bundles that can't reach this
+	                      surface (e.g. a Cylinder around the fiducial volume)
+	                      instead of emitting them. NEvents still counts the
+	                      discarded bundles.
+	:param Thinning: if not None, an instance of MuonGun.ThinningFunction.
+	                 Each bundle is kept with the probability it returns, and
+	                 the inverse is stored in MuonGunThinningWeight.
 	"""
 	
 	from icecube import icetray, dataclasses
@@ -46,6 +59,9 @@ def GenerateBundles(tray, name, Generator=None,
 			Streams=[icetray.I3Frame.DAQ])
 	
 	tray.AddModule('I3MuonGun::GeneratorModule',name,
-	    Generator=NEvents*Generator)
+	    Generator=NEvents*Generator, NThreads=NThreads,
+	    EventRandomStreams=(FirstEvent is not None), RunNumber=RunNumber,
+	    FirstEvent=(FirstEvent or 0), TargetSurface=TargetSurface,
+	    Thinning=Thinning)
 	# tray.AddModule('Dump', name+'dump')
 	
@@ -0,0 +1,61 @@
+"""
+Frames with hand-made muon bundles, for tests that book and weight them.
+
+Each DAQ frame gets a vertical, down-going bundle with an I3MCTree, an
+I3MMCTrackList, and the primary as MCPrimary. The i-th muon of a bundle is
+offset i+1 m from the axis, so the radii the converters find are known.
+"""
+
+from icecube import icetray, dataclasses, simclasses
+
+# Empty, single, ordinary, and bundles wider than the default 25 columns
+multiplicities = [0, 1, 3, 40, 2, 26, 0, 25, 5]
+
+def make_bundle(multiplicity):
+    primary = dataclasses.I3Particle()
+    primary.type = dataclasses.I3Particle.PPlus
+    primary.shape = dataclasses.I3Particle.Primary
+    primary.pos = dataclasses.I3Position(0, 0, 1000)
+    primary.dir = dataclasses.I3Direction(0, 0)
+    primary.energy = 1e6
+
+    mctree = dataclasses.I3MCTree()
+    mctree.add_primary(primary)
+    mmctracks = simclasses.I3MMCTrackList()
+    for i in range(multiplicity):
+        muon = dataclasses.I3Particle()
+        muon.type = dataclasses.I3Particle.MuMinus
+        muon.pos = dataclasses.I3Position(i+1, 0, 1000)
+        muon.dir = dataclasses.I3Direction(0, 0)
+        muon.energy = 1e4*(i+1)
+        muon.length = 3e3
+        mctree.append_child(primary, muon)
+
+        # Track::Harvest() only keeps muons with stochastic losses
+        loss = dataclasses.I3Particle()
+        loss.type = dataclasses.I3Particle.Brems
+        loss.pos = dataclasses.I3Position(i+1, 0, 0)
+        loss.energy = 10.
+        mctree.append_child(muon, loss)
+
+        mmctrack = simclasses.I3MMCTrack()
+        mmctrack.SetParticle(muon)
+        mmctrack.SetEnter(i+1, 0, 0, 0, 0.5e4*(i+1))
+        mmctracks.append(mmctrack)
+
+    return primary, mctree, mmctracks
+
+def add_bundles(tray, name='bundles', multiplicities=multiplicities):
+    """
+    Fill DAQ frames with bundles of the given multiplicities, in order, and
+    split them with an I3NullSplitter named 'nullsplit'
+    """
+    def fill(frame):
+        m = multiplicities[len(filled) % len(multiplicities)]
+        frame['MCPrimary'], frame['I3MCTree'], frame['MMCTrackList'] = make_bundle(m)
+        filled.append(m)
+    filled = []
+    tray.Add(fill, name, Streams=[icetray.I3Frame.DAQ])
+    tray.AddModule('I3NullSplitter', 'nullsplit')
+
+    return filled
@@ -25,16 +25,18 @@ energies = model.energy
 
 generator = 10000*MuonGun.StaticSurfaceInjector(surface, flux, MuonGun.OffsetPowerLaw(2, 500., energies.min, energies.max), radii)
 
-tray.AddModule('I3MuonGun::GeneratorModule', 'GenerateCosmicRayMuons', Generator=generator)
+tray.AddModule('I3MuonGun::GeneratorModule', 'GenerateCosmicRayMuons', Generator=generator,
+    BundleRecord='CosmicRayBundle')
 tray.AddModule('I3MuonGun::WeightCalculatorModule', 'weight',
     Model=MuonGun.BundleModel(flux, radii, energies),
-    Generator=generator)
+    Generator=generator, BundleRecord='CosmicRayBundle')
 
 weights = []
 def check_weight(frame):
     frame['MCMuon'] = frame['I3MCTree'].primaries[0]
     m = len(frame['I3MCTree'].children(frame['MCMuon']))
     weight = frame['weight'].value
+    assert 'CosmicRayBundle' in frame and 'MuonGunBundle' not in frame
     
     # print weight, m
     weights.append(weight)
@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+
+"""
+BundleMuonConverter writes as many rows per event as MuonBundleConverter
+counts muons, including for empty bundles and bundles wider than the
+fixed-width columns, and the weight calculators give the same weights for
+its one-dimensional columns as for the padded, fixed-width ones.
+"""
+
+import os, sys, tempfile
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+
+try:
+    import numpy, tables
+    from icecube import hdfwriter
+except ImportError:
+    print("numpy, pytables, or hdfwriter is missing; skipping")
+    sys.exit(0)
+
+from icecube import icetray, dataclasses, simclasses, tableio, MuonGun
+from I3Tray import I3Tray
+from fake_bundles import multiplicities, add_bundles
+
+fd, fname = tempfile.mkstemp(suffix='.hdf5')
+os.close(fd)
+
+surface = MuonGun.Cylinder(1600, 800)
+tray = I3Tray()
+tray.AddModule('I3InfiniteSource', 'driver', Stream=icetray.I3Frame.DAQ)
+add_bundles(tray)
+tray.AddModule(tableio.I3TableWriter, 'writer',
+    tableservice=hdfwriter.I3HDFTableService(fname),
+    keys=[dict(key='I3MCTree', name='BundleParameters',
+               converter=MuonGun.converters.MuonBundleConverter(0, surface)),
+          dict(key='I3MCTree', name='BundleColumns',
+               converter=MuonGun.converters.MuonBundleConverter(25, surface)),
+          dict(key='I3MCTree', name='BundleMuons',
+               converter=MuonGun.converters.BundleMuonConverter(surface)),
+          'MCPrimary'],
+    SubEventStreams=['nullsplit'])
+tray.Execute(len(multiplicities))
+
+try:
+    with tables.open_file(fname) as hdf:
+        axis = hdf.root.MCPrimary.read()
+        bundle = hdf.root.BundleParameters.read()
+        columns = hdf.root.BundleColumns.read()
+        muons = hdf.root.BundleMuons.read()
+finally:
+    os.unlink(fname)
+
+assert list(bundle['multiplicity']) == multiplicities
+assert list(columns['multiplicity']) == multiplicities, "wide bundles are counted in full"
+assert 'energy' not in bundle.dtype.names, "MuonBundleConverter(0) has no muon columns"
+
+muons = muons[muons['exists'] == 1]
+for event, m in zip(bundle['Event'], multiplicities):
+    rows = muons[muons['Event'] == event]
+    assert len(rows) == m, "event %d has %d muon rows, not %d" % (event, len(rows), m)
+    assert list(rows['vector_index']) == list(range(m))
+    assert numpy.allclose(sorted(rows['radius']), numpy.arange(1, m+1), atol=1e-3)
+    width = min(m, 25)
+    row = columns[columns['Event'] == event][0]
+    assert numpy.array_equal(row['energy'][:width], rows['energy'][:width])
+    assert numpy.array_equal(row['radius'][:width], rows['radius'][:width])
+
+# The one-dimensional path through the weight calculators
+model = MuonGun.load_model('Hoerandel5_atmod12_SIBYLL')
+model.flux.min_multiplicity = 1
+model.flux.max_multiplicity = 100
+generator = 1000*MuonGun.StaticSurfaceInjector(surface, model.flux,
+    MuonGun.OffsetPowerLaw(2, 500., 50, 1e6), model.radius)
+weighter = MuonGun.WeightCalculator(model, generator)
+
+args = [axis[k] for k in ('x', 'y', 'z', 'zenith', 'azimuth')] + [bundle['multiplicity']]
+ragged = weighter(*(args + [muons['energy'], muons['radius']]))
+
+width = max(multiplicities)
+energies = numpy.zeros((len(bundle), width), dtype=numpy.float32)
+radii = numpy.zeros((len(bundle), width), dtype=numpy.float32)
+start = 0
+for i, m in enumerate(bundle['multiplicity']):
+    energies[i,:m] = muons['energy'][start:start+m]
+    radii[i,:m] = muons['radius'][start:start+m]
+    start += m
+padded = weighter(*(args + [energies, radii]))
+
+assert len(ragged) == len(multiplicities)
+assert numpy.allclose(ragged, padded, rtol=0, atol=0, equal_nan=True), \
+    "per-muon columns give the same weights as fixed-width ones"
+assert numpy.isfinite(ragged[numpy.asarray(multiplicities) > 0]).all()
+
+try:
+    weighter(*(args + [muons['energy'][:-1], muons['radius'][:-1]]))
+except Exception:
+    pass
+else:
+    raise AssertionError("multiplicities that don't add up to the number of muons are an error")
@@ -0,0 +1,42 @@
+#!/usr/bin/env python
+
+"""
+GeneratorModule stores the weight that compensates for thinning under its
+ThinningWeight, and WeightCalculatorModule multiplies in the weight it finds
+under its own.
+"""
+
+from icecube import icetray, dataclasses, dataio
+from icecube import phys_services, sim_services, simclasses, MuonGun
+from I3Tray import I3Tray
+
+tray = I3Tray()
+
+tray.AddModule('I3InfiniteSource', 'driver')
+tray.AddService('I3GSLRandomServiceFactory', 'rng', Seed=1337)
+
+model = MuonGun.load_model('GaisserH4a_atmod12_SIBYLL')
+surface = MuonGun.Cylinder(1600, 800)
+generator = 500*MuonGun.StaticSurfaceInjector(surface, model.flux,
+    MuonGun.OffsetPowerLaw(2, 500., model.energy.min, model.energy.max), model.radius)
+
+tray.AddModule('I3MuonGun::GeneratorModule', 'generator', Generator=generator,
+    Thinning=MuonGun.EnergyThinning(1e4, 1., 0.1), ThinningWeight='Survival')
+tray.AddModule('I3MuonGun::WeightCalculatorModule', 'thinned',
+    Model=model, Generator=generator, ThinningWeight='Survival')
+tray.AddModule('I3MuonGun::WeightCalculatorModule', 'unthinned',
+    Model=model, Generator=generator, ThinningWeight='')
+
+survivors = []
+def check(frame):
+    assert 'MuonGunThinningWeight' not in frame
+    survival = frame['Survival'].value
+    assert survival >= 1
+    assert abs(frame['thinned'].value/(survival*frame['unthinned'].value) - 1) < 1e-12
+    survivors.append(survival)
+tray.Add(check, Streams=[icetray.I3Frame.DAQ])
+
+tray.Execute()
+
+assert 0 < len(survivors) < 500, "some bundles were thinned away"
+assert max(survivors) > 1, "some bundles were kept with probability < 1"
@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+
+"""
+Weighting on a pool of threads gives the same weights as weighting each
+frame as it arrives, and emits the frames in their original order.
+"""
+
+from icecube import icetray, dataclasses, dataio
+from icecube import phys_services, sim_services, simclasses, MuonGun
+from I3Tray import I3Tray
+
+tray = I3Tray()
+
+tray.AddModule('I3InfiniteSource', 'driver')
+tray.AddService('I3GSLRandomServiceFactory', 'rng', Seed=1337)
+
+model = MuonGun.load_model('GaisserH4a_atmod12_SIBYLL')
+surface = MuonGun.Cylinder(1600, 800)
+generator = 500*MuonGun.StaticSurfaceInjector(surface, model.flux,
+    MuonGun.OffsetPowerLaw(2, 500., model.energy.min, model.energy.max), model.radius)
+
+tray.AddModule('I3MuonGun::GeneratorModule', 'generator', Generator=generator)
+tray.AddModule('I3NullSplitter', 'nullsplit')
+
+def tag(frame):
+    frame['Order'] = icetray.I3Int(len(order))
+    order.append(frame.Stop)
+order = []
+tray.Add(tag, Streams=[icetray.I3Frame.DAQ, icetray.I3Frame.Physics])
+
+tray.AddModule('I3MuonGun::WeightCalculatorModule', 'serial',
+    Model=model, Generator=generator)
+tray.AddModule('I3MuonGun::WeightCalculatorModule', 'threaded',
+    Model=model, Generator=generator, NThreads=4, QueueDepth=7)
+tray.AddModule('I3MuonGun::WeightCalculatorModule', 'harvested',
+    Model=model, Generator=generator, NThreads=3, BundleRecord='')
+
+seen = []
+def check(frame):
+    seen.append(frame['Order'].value)
+    if frame.Stop == icetray.I3Frame.DAQ:
+        assert frame['serial'].value > 0
+        assert frame['threaded'].value == frame['serial'].value
+        assert abs(frame['harvested'].value/frame['serial'].value - 1) < 1e-6
+tray.Add(check, Streams=[icetray.I3Frame.DAQ, icetray.I3Frame.Physics])
+
+tray.Execute()
+
+assert len(seen) == 1000, "all frames were emitted"
+assert seen == list(range(len(seen))), "frames were emitted in order"
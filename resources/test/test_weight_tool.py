@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+
+"""
+MuonGun-weight gives the same weights as WeightCalculator for bundles booked
+with fixed-width columns and with per-muon rows, and refuses to weight
+bundles that are wider than their columns.
+"""
+
+import os, sys, shutil, subprocess, tempfile
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+
+try:
+    import numpy, tables
+    from icecube import hdfwriter
+except ImportError:
+    print("numpy, pytables, or hdfwriter is missing; skipping")
+    sys.exit(0)
+
+from icecube import icetray, dataclasses, simclasses, dataio, tableio, MuonGun
+from I3Tray import I3Tray
+from fake_bundles import multiplicities, add_bundles
+
+tool = os.path.join(os.environ.get('I3_BUILD', ''), 'bin', 'MuonGun-weight')
+if not os.path.exists(tool):
+    print("MuonGun-weight was not built; skipping")
+    sys.exit(0)
+
+workdir = tempfile.mkdtemp()
+tablefile = os.path.join(workdir, 'bundles.hdf5')
+genfile = os.path.join(workdir, 'generator.i3')
+
+model = MuonGun.load_model('Hoerandel5_atmod12_SIBYLL')
+model.flux.min_multiplicity = 1
+model.flux.max_multiplicity = 100
+surface = MuonGun.Cylinder(1600, 800)
+generator = 1000*MuonGun.StaticSurfaceInjector(surface, model.flux,
+    MuonGun.OffsetPowerLaw(2, 500., 50, 1e6), model.radius)
+
+frame = icetray.I3Frame(icetray.I3Frame.Simulation)
+frame['Generator'] = generator
+f = dataio.I3File(genfile, 'w')
+f.push(frame)
+f.close()
+
+tray = I3Tray()
+tray.AddModule('I3InfiniteSource', 'driver', Stream=icetray.I3Frame.DAQ)
+add_bundles(tray)
+tray.AddModule(tableio.I3TableWriter, 'writer',
+    tableservice=hdfwriter.I3HDFTableService(tablefile),
+    keys=[dict(key='I3MCTree', name='BundleParameters',
+               converter=MuonGun.converters.MuonBundleConverter(0, surface)),
+          dict(key='I3MCTree', name='BundleMuons',
+               converter=MuonGun.converters.BundleMuonConverter(surface)),
+          dict(key='I3MCTree', name='BundleColumns',
+               converter=MuonGun.converters.MuonBundleConverter(25, surface)),
+          dict(key='I3MCTree', name='BundleWideColumns',
+               converter=MuonGun.converters.MuonBundleConverter(50, surface)),
+          'MCPrimary'],
+    SubEventStreams=['nullsplit'])
+tray.Execute(len(multiplicities))
+
+def weigh(*options):
+    # Small chunks, so that bundles and muons straddle chunk boundaries
+    args = [tool, tablefile, genfile, '--chunk-size=4', '--threads=2'] + list(options)
+    p = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+        universal_newlines=True)
+    out, err = p.communicate()
+    return p.returncode, out + err
+
+try:
+    code, log = weigh('--bundle=BundleParameters', '--muons=BundleMuons',
+        '--output=RaggedWeights')
+    assert code == 0, log
+    code, log = weigh('--bundle=BundleWideColumns', '--output=FixedWeights')
+    assert code == 0, log
+    code, log = weigh('--bundle=BundleColumns', '--output=TruncatedWeights')
+    assert code != 0, "bundles wider than the columns are an error"
+    assert '--muons' in log, log
+
+    with tables.open_file(tablefile) as hdf:
+        axis = hdf.root.MCPrimary.read()
+        bundle = hdf.root.BundleParameters.read()
+        muons = hdf.root.BundleMuons.read_where('exists == 1')
+        ragged = hdf.root.RaggedWeights.read()
+        fixed = hdf.root.FixedWeights.read()
+finally:
+    shutil.rmtree(workdir)
+
+weighter = MuonGun.WeightCalculator(model, generator)
+expected = weighter(*([axis[k] for k in ('x', 'y', 'z', 'zenith', 'azimuth')]
+    + [bundle['multiplicity'], muons['energy'], muons['radius']]))
+
+for weights in ragged, fixed:
+    assert len(weights) == len(multiplicities)
+    for k in ('Run', 'Event', 'SubEvent', 'SubEventStream'):
+        assert numpy.array_equal(weights[k], bundle[k]), k
+    assert numpy.array_equal(weights['exists'], bundle['exists'])
+    assert numpy.allclose(weights['Hoerandel5_atmod12_SIBYLL'], expected,
+        rtol=1e-12, atol=0, equal_nan=True), \
+        "MuonGun-weight agrees with WeightCalculator"